@@ -62,6 +62,11 @@ rfboot. The licence remains the same LGPLv3 or later
   */
 //const byte paTable[8] = {0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x60};
 
+/**
+ * Fixed packet length with the FEC (cc1101_setFec), 0 without
+ */
+static byte cc1101_fecLen;
+
 /**
  * CC1101
  * 
@@ -215,6 +220,37 @@ void cc1101_reset(void)
   //setRegsFromEeprom();                  // Take user settings from EEPROM
 }
 
+/**
+ * cc1101_detect
+ * 
+ * Check if a CC1101 is connected. SPI must be initialized.
+ * Unlike the other functions, it does not wait forever for MISO
+ *
+ * Return:
+ *  true if the chip reports a valid version
+ */
+bool cc1101_detect(void) 
+{
+  byte i = 250;
+  byte version;
+
+  cc1101_Select();                      // Select CC1101
+  // MISO goes low when the crystal is stable. 1ms is more than enough
+  while (READ(SPI_MISO))
+  {
+    if (!--i)
+    {
+      cc1101_Deselect();
+      return false;
+    }
+    _delay_us(4);
+  }
+  cc1101_Deselect();                    // Deselect CC1101
+
+  version = readStatusReg(CC1101_VERSION);
+  return (version != 0) && (version != 0xFF);
+}
+
 /**
  * cc1101_setDefaultRegs
  * 
@@ -278,6 +314,57 @@ void cc1101_setDefaultRegs(void)
   cc1101_writeReg(CC1101_TEST0,  CC1101_DEFVAL_TEST0);
 }
 
+/**
+ * cc1101_setFastModem
+ * 
+ * Switch between the default modem settings and the fast ones.
+ * Both sides of the link must use the same settings
+ * 
+ * 'fast'   true for the CC1101_FASTVAL_* settings
+ */
+void cc1101_setFastModem(bool fast) 
+{
+  setIdleState();                       // Enter IDLE state
+
+  cc1101_writeReg(CC1101_MDMCFG4,  fast ? CC1101_FASTVAL_MDMCFG4 : CC1101_DEFVAL_MDMCFG4);
+  cc1101_writeReg(CC1101_MDMCFG3,  fast ? CC1101_FASTVAL_MDMCFG3 : CC1101_DEFVAL_MDMCFG3);
+  cc1101_writeReg(CC1101_MDMCFG2,  fast ? CC1101_FASTVAL_MDMCFG2 : CC1101_DEFVAL_MDMCFG2);
+  cc1101_writeReg(CC1101_DEVIATN,  fast ? CC1101_FASTVAL_DEVIATN : CC1101_DEFVAL_DEVIATN);
+  cc1101_writeReg(CC1101_FOCCFG,  fast ? CC1101_FASTVAL_FOCCFG : CC1101_DEFVAL_FOCCFG);
+  cc1101_writeReg(CC1101_BSCFG,  fast ? CC1101_FASTVAL_BSCFG : CC1101_DEFVAL_BSCFG);
+  cc1101_writeReg(CC1101_AGCCTRL2,  fast ? CC1101_FASTVAL_AGCCTRL2 : CC1101_DEFVAL_AGCCTRL2);
+  cc1101_writeReg(CC1101_AGCCTRL1,  fast ? CC1101_FASTVAL_AGCCTRL1 : CC1101_DEFVAL_AGCCTRL1);
+  cc1101_writeReg(CC1101_AGCCTRL0,  fast ? CC1101_FASTVAL_AGCCTRL0 : CC1101_DEFVAL_AGCCTRL0);
+  cc1101_writeReg(CC1101_FREND1,  fast ? CC1101_FASTVAL_FREND1 : CC1101_DEFVAL_FREND1);
+  cc1101_writeReg(CC1101_FSCAL3,  fast ? CC1101_FASTVAL_FSCAL3 : CC1101_DEFVAL_FSCAL3);
+
+  flushRxFifo();                        // Flush Rx FIFO
+  setRxState();                         // Back to RX state (calibrates again)
+}
+
+/**
+ * cc1101_setFec
+ * 
+ * Hardware FEC with fixed length packets. Our packets still start with
+ * their length byte and the rest up to 'len' bytes is padding, so
+ * cc1101_sendData and cc1101_receiveData work as before.
+ * Both sides of the link must use the same settings
+ * 
+ * 'len'    the packet length (with the length byte), 0 for no FEC
+ */
+void cc1101_setFec(byte len) 
+{
+  setIdleState();                       // Enter IDLE state
+
+  cc1101_fecLen = len;
+  cc1101_writeReg(CC1101_MDMCFG1,  len ? CC1101_FECVAL_MDMCFG1 : CC1101_DEFVAL_MDMCFG1);
+  cc1101_writeReg(CC1101_PKTCTRL0,  len ? CC1101_FECVAL_PKTCTRL0 : CC1101_DEFVAL_PKTCTRL0);
+  cc1101_writeReg(CC1101_PKTLEN,  len ? len : CC1101_DEFVAL_PKTLEN);
+
+  flushRxFifo();                        // Flush Rx FIFO
+  setRxState();                         // Back to RX state (calibrates again)
+}
+
 /**
  * cc1101_init
  * 
@@ -456,42 +543,49 @@ void cc1101_setPowerDownState()
 }
 
 /**
- * cc1101_sendData
+ * cc1101_txStart
  * 
- * Send data packet via RF
+ * Start the transmission of a packet and return while it is on the air.
+ * The data goes from 'data' to the TX FIFO, so the buffer can be used
+ * again at once. The end of the packet is a falling edge of GDO0, and the
+ * CC1101 is in RX again (MCSM1 TXOFF_MODE). Nothing else may use the
+ * CC1101 until then
  * 
- * 'packet' Packet to be transmitted. First byte is the destination address
+ * 'data'   Packet to be transmitted
+ * 'len'    Its length, up to CC1101_DATA_LEN
  *
+ * The CC1101 must be in RX, as STX checks the channel (CCA) only there.
+ * After our last packet it is (MCSM1 TXOFF_MODE), and with RFBOOT_AUTO_RX
+ * after a received packet too. Otherwise it calibrates on its way to RX
+ * (cc1101_receiveData) and we return false at once, without a strobe or
+ * a delay. CCA_MODE (MCSM1) is "unless receiving a packet", which needs
+ * no settled RSSI
+ * 
  *  Return:
- *    True if the transmission succeeds
- *    False otherwise
+ *    True if the packet is on the air
+ *    False if the CC1101 is not in RX yet, or the channel is not clear
+ *    (CCA). Then the CC1101 is in RX again, or on its way there
  */
-bool cc1101_sendData(CCPACKET packet)
+bool cc1101_txStart(const byte *data, byte len)
 {
-  byte marcState;
-  bool res = false;
- 
-  // Declare to be in Tx state. This will avoid receiving packets whilst
-  // transmitting
-  //cc1101_rfState = RFSTATE_TX;
-
-  // Enter RX state
-  setRxState();
+  byte marcState = readStatusReg(CC1101_MARCSTATE) & 0x1F;
 
-  // Check that the RX state has been entered
-  while (((marcState = readStatusReg(CC1101_MARCSTATE)) & 0x1F) != 0x0D)
+  if (marcState != 0x0D)
   {
     if (marcState == 0x11)        // RX_OVERFLOW
       flushRxFifo();              // flush receive queue
+    if (marcState == 0x11 || marcState == 0x01)
+      setRxState();               // from IDLE, calibrates first
+    return false;
   }
 
-  //delayMicroseconds(500);
-  _delay_us(500);
-
   // Set data length at the first position of the TX FIFO
-  cc1101_writeReg(CC1101_TXFIFO,  packet.length);
+  cc1101_writeReg(CC1101_TXFIFO, len);
   // Write data into the TX FIFO
-  cc1101_writeBurstReg(CC1101_TXFIFO, packet.data, packet.length);
+  cc1101_writeBurstReg(CC1101_TXFIFO, (byte*)data, len);
+  // With the FEC the packet is padded to the fixed length
+  for (byte i = len + 1; i < cc1101_fecLen; i++)
+    cc1101_writeReg(CC1101_TXFIFO, 0);
 
   // CCA enabled: will enter TX state only if the channel is clear
   setTxState();
@@ -503,21 +597,28 @@ bool cc1101_sendData(CCPACKET packet)
     setIdleState();       // Enter IDLE state
     flushTxFifo();        // Flush Tx FIFO
     setRxState();         // Back to RX state
-
-    // Declare to be in Rx state
-    //cc1101_rfState = RFSTATE_RX;
     return false;
   }
 
-  // Wait for the sync word to be transmitted
-  wait_GDO0_high();
-
-  // Wait until the end of the packet transmission
-  wait_GDO0_low();
+  return true;
+}
 
+/**
+ * cc1101_txEnd
+ * 
+ * After the end of a packet of cc1101_txStart (GDO0 low). The CC1101 is
+ * in RX already (MCSM1 TXOFF_MODE), unless the TX FIFO underflowed : it
+ * stays in TXFIFO_UNDERFLOW until the FIFO is flushed. Only then we
+ * flush it and go back to RX, so a packet arriving now is not lost
+ *
+ *  Return:
+ *    True if the whole packet was sent
+ */
+bool cc1101_txEnd(void)
+{
   // Check that the TX FIFO is empty
-  if((readStatusReg(CC1101_TXBYTES) & 0x7F) == 0)
-    res = true;
+  if (readStatusReg(CC1101_TXBYTES) == 0)
+    return true;
 
   setIdleState();       // Enter IDLE state
   flushTxFifo();        // Flush Tx FIFO
@@ -525,16 +626,68 @@ bool cc1101_sendData(CCPACKET packet)
   // Enter back into RX state
   setRxState();
 
-  // Declare to be in Rx state
-  //cc1101_rfState = RFSTATE_RX;
+  return false;
+}
+
+/**
+ * cc1101_sendData
+ * 
+ * Send data packet via RF and wait until it is on the air
+ * 
+ * 'data'   Packet to be transmitted
+ * 'len'    Its length, up to CC1101_DATA_LEN
+ *
+ *  Return:
+ *    True if the transmission succeeds
+ *    False otherwise, also if the CC1101 is not in RX yet (cc1101_txStart)
+ */
+bool cc1101_sendData(const byte *data, byte len)
+{
+  if (!cc1101_txStart(data, len))
+    return false;
+
+  // Wait for the sync word to be transmitted
+  wait_GDO0_high();
+
+  // Wait until the end of the packet transmission
+  wait_GDO0_low();
+
+  return cc1101_txEnd();
+}
+
+/**
+ * cc1101_rxBytes
+ * 
+ * Number of bytes in the RX FIFO. The register is read until two reads
+ * agree, as the datasheet errata suggests. Bit 7 is the overflow
+ */
+static byte cc1101_rxBytes(void)
+{
+  byte val, last;
 
-  return res;
+  val = readStatusReg(CC1101_RXBYTES);
+  do
+  {
+    last = val;
+    val = readStatusReg(CC1101_RXBYTES);
+  } while (val != last);
+
+  return val;
 }
 
 /**
  * cc1101_receiveData
  * 
- * Read data packet from RX FIFO
+ * Read data packet from RX FIFO. If the packet is still arriving (GDO0
+ * high) we read the bytes as they come, so the packet can be longer
+ * than the FIFO. The last byte in the FIFO is read only at the end of
+ * the packet (datasheet errata)
+ *
+ * The CC1101 goes to IDLE after the packet (MCSM1 RXOFF_MODE), and back
+ * to RX it calibrates again (MCSM0 FS_AUTOCAL), ~800us without
+ * receiving. With RFBOOT_AUTO_RX it stays in RX and the next packet can
+ * follow in the FIFO, we read only this one. The FIFO is flushed only
+ * if we could not read a packet
  *
  * 'packet' Container for the packet received
  * 
@@ -544,20 +697,42 @@ bool cc1101_sendData(CCPACKET packet)
 byte cc1101_receiveData(CCPACKET * packet)
 {
   byte val;
-  byte rxBytes = readStatusReg(CC1101_RXBYTES);
-
-  // Any byte waiting to be read and no overflow?
-  if (rxBytes & 0x7F && !(rxBytes & 0x80))
+  byte rxBytes;
+  // -1 until we read the length byte
+  int16_t len = -1;
+  // The bytes after the length byte. More than len with the FEC (padding)
+  byte end = 0;
+  byte pos = 0;
+
+  packet->length = 0;
+  packet->crc_ok = 0;
+  while (true)
   {
-    // Read data length
-    packet->length = readConfigReg(CC1101_RXFIFO);
-    // If packet is too long
-    if (packet->length > CC1101_DATA_LEN)
-      packet->length = 0;   // Discard packet
-    else
+    // GDO0 first. When it is low the whole packet is in the FIFO
+    bool receiving = getGDO0state();
+    rxBytes = cc1101_rxBytes();
+    // Overflow
+    if (rxBytes & 0x80)
+      break;
+    rxBytes &= 0x7F;
+    if (len < 0)
     {
-      // Read data packet
-      cc1101_readBurstReg(packet->data, CC1101_RXFIFO, packet->length);
+      if (rxBytes > 1 || (rxBytes && !receiving))
+      {
+        // Read data length
+        len = readConfigReg(CC1101_RXFIFO);
+        end = cc1101_fecLen ? cc1101_fecLen - 1 : len;
+        // If packet is too long
+        if (len > CC1101_STREAM_LEN || len > end)
+          break;   // Discard packet
+      }
+      else if (!receiving)
+        break;     // Nothing received
+    }
+    // The rest of the data and the 2 status bytes are here
+    else if (rxBytes >= end - pos + 2)
+    {
+      cc1101_readBurstReg(packet->data + pos, CC1101_RXFIFO, end - pos);
       // Read RSSI
       packet->rssi = readConfigReg(CC1101_RXFIFO);
       // Read LQI and CRC_OK
@@ -565,10 +740,26 @@ byte cc1101_receiveData(CCPACKET * packet)
       packet->lqi = val & 0x7F;
       //packet->crc_ok = bitRead(val, 7);
       packet->crc_ok = (val>>7);
+      packet->length = len;
+      break;
+    }
+    // The packet ended (or was discarded) without all its bytes
+    else if (!receiving)
+      break;
+    else if (rxBytes > 1)
+    {
+      val = rxBytes - 1;
+      if (val > end - pos)
+        val = end - pos;
+      cc1101_readBurstReg(packet->data + pos, CC1101_RXFIFO, val);
+      pos += val;
     }
   }
-  else
-    packet->length = 0;
+
+#ifdef RFBOOT_AUTO_RX
+  if (packet->length)
+    return packet->length;
+#endif
 
   setIdleState();       // Enter IDLE state
   flushRxFifo();        // Flush Rx FIFO
@@ -579,4 +770,3 @@ byte cc1101_receiveData(CCPACKET * packet)
 
   return packet->length;
 }
-
@@ -35,6 +35,7 @@ rfboot. The licence remains the same LGPLv3 or later
 
 #include "spi.h"
 #include "ccpacket.h"
+#include "cc1101_modem.h"
 
 /**
  * Carrier frequencies
@@ -196,7 +197,7 @@ enum RFSTATE
  * Data format = Normal mode 
  * Length config = Variable packet length mode. Packet length configured by the first byte after sync word 
  * CRC enable = true 
- * Packet length = 255 
+ * Packet length = 130 (CC1101_STREAM_LEN) 
  * Device address = 1 
  * Address config = Enable address check
  * Append status = Append two status bytes to the payload of the packet. The status bytes contain RSSI and
@@ -216,7 +217,7 @@ enum RFSTATE
 #define CC1101_DEFVAL_FIFOTHR    0x07        // RX FIFO and TX FIFO Thresholds
 #define CC1101_DEFVAL_SYNC1      0xB5        // Synchronization word, high byte
 #define CC1101_DEFVAL_SYNC0      0x47        // Synchronization word, low byte
-#define CC1101_DEFVAL_PKTLEN     0x3D        // Packet Length
+#define CC1101_DEFVAL_PKTLEN     CC1101_STREAM_LEN        // Packet Length
 #define CC1101_DEFVAL_PKTCTRL1   0x06        // Packet Automation Control
 #define CC1101_DEFVAL_PKTCTRL0   0x05        // Packet Automation Control
 #define CC1101_DEFVAL_ADDR       0xFF        // Device Address
@@ -238,13 +239,19 @@ enum RFSTATE
 
 #define CC1101_DEFVAL_MDMCFG4    0xCA        // Modem Configuration
 #define CC1101_DEFVAL_MDMCFG3    0x83        // Modem Configuration
-#define CC1101_DEFVAL_MDMCFG2    0x93        // Modem Configuration
+// CC1101_DEFVAL_MDMCFG2 is in cc1101_modem.h, usb2rf uses the same
 #define CC1101_DEFVAL_MDMCFG1    0x22        // Modem Configuration
 #define CC1101_DEFVAL_MDMCFG0    0xF8        // Modem Configuration
 #define CC1101_DEFVAL_DEVIATN    0x35        // Modem Deviation Setting
 #define CC1101_DEFVAL_MCSM2      0x07        // Main Radio Control State Machine Configuration
 //#define CC1101_DEFVAL_MCSM1      0x30        // Main Radio Control State Machine Configuration
-#define CC1101_DEFVAL_MCSM1      0x20        // Main Radio Control State Machine Configuration
+// TXOFF_MODE is RX, the CC1101 goes back to RX after a packet we send (cc1101_txStart).
+// With RFBOOT_AUTO_RX also RXOFF_MODE, after a packet we receive (cc1101_receiveData)
+#ifdef RFBOOT_AUTO_RX
+#define CC1101_DEFVAL_MCSM1      0x2F        // Main Radio Control State Machine Configuration
+#else
+#define CC1101_DEFVAL_MCSM1      0x23        // Main Radio Control State Machine Configuration
+#endif
 #define CC1101_DEFVAL_MCSM0      0x18        // Main Radio Control State Machine Configuration
 #define CC1101_DEFVAL_FOCCFG     0x16        // Frequency Offset Compensation Configuration
 #define CC1101_DEFVAL_BSCFG      0x6C        // Bit Synchronization Configuration
@@ -269,6 +276,39 @@ enum RFSTATE
 #define CC1101_DEFVAL_TEST1      0x35        // Various Test Settings
 #define CC1101_DEFVAL_TEST0      0x09        // Various Test Settings
 
+/**
+ * Fast modem settings, used by rfboot after the handshake.
+ * Only the registers which differ from the defaults. SmartRF Studio:
+ *
+ * Data rate = 99.9756 Kbps
+ * Deviation = 47.607422
+ * RX filter BW = 325.000000
+ * Modulation format = GFSK
+ * DC blocking filter enabled
+ */
+#define CC1101_FASTVAL_MDMCFG4   0x5B        // Modem Configuration
+#define CC1101_FASTVAL_MDMCFG3   0xF8        // Modem Configuration
+// CC1101_FASTVAL_MDMCFG2 is in cc1101_modem.h
+#define CC1101_FASTVAL_DEVIATN   0x47        // Modem Deviation Setting
+#define CC1101_FASTVAL_FOCCFG    0x1D        // Frequency Offset Compensation Configuration
+#define CC1101_FASTVAL_BSCFG     0x1C        // Bit Synchronization Configuration
+#define CC1101_FASTVAL_AGCCTRL2  0xC7        // AGC Control
+#define CC1101_FASTVAL_AGCCTRL1  0x00        // AGC Control
+#define CC1101_FASTVAL_AGCCTRL0  0xB2        // AGC Control
+#define CC1101_FASTVAL_FREND1    0xB6        // Front End RX Configuration
+#define CC1101_FASTVAL_FSCAL3    0xEA        // Frequency Synthesizer Calibration
+
+/**
+ * FEC settings (cc1101_setFec). The FEC (with interleaving) needs
+ * the fixed packet length mode.
+ *
+ * FEC = enabled
+ * Length config = Fixed packet length mode. Length configured in PKTLEN register
+ * CRC enable = true
+ */
+#define CC1101_FECVAL_MDMCFG1    0xA2        // Modem Configuration
+#define CC1101_FECVAL_PKTCTRL0   0x04        // Packet Automation Control
+
 /**
  * Macros
  */
@@ -343,6 +383,21 @@ enum RFSTATE
      */
     void cc1101_setDefaultRegs(void);
 
+    /**
+     * cc1101_setFastModem
+     * 
+     * Switch between the default and the fast (CC1101_FASTVAL_*) modem settings
+     */
+    void cc1101_setFastModem(bool fast);
+
+    /**
+     * cc1101_setFec
+     *
+     * Hardware FEC with fixed length packets of 'len' bytes (the length
+     * byte is still sent, followed by padding). 0 turns the FEC off
+     */
+    void cc1101_setFec(byte len);
+
     /**
      * setRegsFromEeprom
      * 
@@ -436,6 +491,13 @@ enum RFSTATE
      */
     void cc1101_reset(void);
     
+    /**
+     * cc1101_detect
+     * 
+     * Check if a CC1101 is connected
+     */
+    bool cc1101_detect(void);
+
     /**
      * cc1101_init
      * 
@@ -501,22 +563,48 @@ enum RFSTATE
     void cc1101_setPowerDownState();
     
     /**
-     * cc1101_sendData
+     * cc1101_txStart
      * 
-     * Send data packet via RF
+     * Start the transmission of 'len' bytes from 'data' and return while
+     * the packet is on the air. At its end (the falling edge of GDO0) the
+     * CC1101 goes back to RX by itself (MCSM1 TXOFF_MODE). It does not wait
+     * for RX : if the CC1101 is still calibrating, it returns false at once
+     *
+     *  Return:
+     *    True if the packet is on the air
+     *    False if the CC1101 is not in RX yet or the channel is not clear (CCA)
+     */
+    bool cc1101_txStart(const byte *data, byte len);
+
+    /**
+     * cc1101_txEnd
      * 
-     * 'packet' Packet to be transmitted. First byte is the destination address
+     * After the end of a packet of cc1101_txStart. Checks that the whole
+     * packet was sent, and flushes the TX FIFO only after an underflow
      *
      *  Return:
+     *    True if the whole packet was sent
+     */
+    bool cc1101_txEnd(void);
+
+    /**
+     * cc1101_sendData
+     * 
+     * Send data packet via RF, cc1101_txStart and cc1101_txEnd with
+     * a busy wait for GDO0
+     * 
+     *  Return:
      *    True if the transmission succeeds
      *    False otherwise
      */
-    bool cc1101_sendData(CCPACKET packet);
+    bool cc1101_sendData(const byte *data, byte len);
 
     /**
      * cc1101_receiveData
      * 
-     * Read data packet from RX FIFO
+     * Read data packet from RX FIFO. Can be called as soon as the sync
+     * word is received (GDO0 high). The packet is read while it arrives,
+     * so it can be longer than the FIFO (up to CC1101_STREAM_LEN)
      * 
      * Return:
      *  Amount of bytes received
@@ -0,0 +1,28 @@
+/*
+Copyright (c) 2017 Panagiotis Karagiannis
+The licence is the same as cc1101.h, LGPLv3 or later
+*/
+
+/**
+ * The MDMCFG2 settings rfboot and usb2rf must agree on. usb2rf includes
+ * this file too (usb2rf.ino), so both sides use the same sync word
+ * detection and the same Manchester setting, with the default and the
+ * fast modem settings
+ */
+
+#ifndef _CC1101_MODEM_H
+#define _CC1101_MODEM_H
+
+// MDMCFG2 bits 2:0, SYNC_MODE. 30 of the 32 sync word bits, no carrier sense
+#define CC1101_MDMCFG2_SYNC_MODE    0x03
+// MDMCFG2 bit 3, MANCHESTER_EN. Off
+#define CC1101_MDMCFG2_MANCHESTER   0x00
+// MDMCFG2 bits 7:4, DEM_DCFILT_OFF and MOD_FORMAT. GFSK, the DC blocking
+// filter off at the default data rate and on at the fast one
+#define CC1101_MDMCFG2_DEFMOD       0x90
+#define CC1101_MDMCFG2_FASTMOD      0x10
+
+#define CC1101_DEFVAL_MDMCFG2    (CC1101_MDMCFG2_DEFMOD | CC1101_MDMCFG2_MANCHESTER | CC1101_MDMCFG2_SYNC_MODE)
+#define CC1101_FASTVAL_MDMCFG2   (CC1101_MDMCFG2_FASTMOD | CC1101_MDMCFG2_MANCHESTER | CC1101_MDMCFG2_SYNC_MODE)
+
+#endif
@@ -32,6 +32,9 @@
  */
 #define CC1101_BUFFER_LEN        64
 #define CC1101_DATA_LEN          CC1101_BUFFER_LEN - 3
+// Longer packets do not fit in the FIFO and are read while they
+// are received (see cc1101_receiveData). A whole SPM page and its idx
+#define CC1101_STREAM_LEN        130
 
 /**
  * Class: CCPACKET
@@ -50,7 +53,7 @@ typedef struct
     /**
      * Data buffer
      */
-    byte data[CC1101_DATA_LEN];
+    byte data[CC1101_STREAM_LEN];
 
     /**
      * CRC OK flag
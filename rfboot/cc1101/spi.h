@@ -45,6 +45,37 @@
 //#define SPI_MISO 12     // PB4 = MISO
 //#define SPI_SCK  13     // PB5 = SCK
 //#define GDO0     2        // PD2 = INT0
+#if defined(__AVR_ATmega1284P__)
+#define SPI_SS   B,4     // PB4 = SPI_SS
+#define SPI_MOSI B,5     // PB5 = MOSI
+#define SPI_MISO B,6     // PB6 = MISO
+#define SPI_SCK  B,7     // PB7 = SCK
+#define GDO0     D,2     // PD2 = INT0
+
+#define PORT_SPI_MISO  PINB
+#define BIT_SPI_MISO  6
+
+#define PORT_SPI_SS  PORTB
+#define BIT_SPI_SS   4
+
+#define PORT_GDO0  PIND
+#define BIT_GDO0  2
+#elif defined(__AVR_ATmega2560__)
+#define SPI_SS   B,0     // PB0 = SPI_SS (Arduino Mega 53)
+#define SPI_MOSI B,2     // PB2 = MOSI (51)
+#define SPI_MISO B,3     // PB3 = MISO (50)
+#define SPI_SCK  B,1     // PB1 = SCK (52)
+#define GDO0     D,0     // PD0 = INT0 (21)
+
+#define PORT_SPI_MISO  PINB
+#define BIT_SPI_MISO  3
+
+#define PORT_SPI_SS  PORTB
+#define BIT_SPI_SS   0
+
+#define PORT_GDO0  PIND
+#define BIT_GDO0  0
+#else
 #define SPI_SS   B,2     // PB2 = SPI_SS
 #define SPI_MOSI B,3     // PB3 = MOSI
 #define SPI_MISO B,4     // PB4 = MISO
@@ -59,6 +90,7 @@
 
 #define PORT_GDO0  PIND
 #define BIT_GDO0  2
+#endif
 
 /**
  * Macros
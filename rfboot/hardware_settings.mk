@@ -26,3 +26,78 @@
 # usbasp and usbtiny are supported.
 # "usbtiny" is in lower case
 #PROGRAMMER = usbtiny
+
+# Uncomment for the window upload mode (RFB_OPT_WINDOW, usb2rf version 5 or
+# later). rfboot requests whole SPM pages instead of single packets, ~45%
+# faster, and accepts the delta upload, resume, the fast modem and CTR mode.
+# Without it rfboot has only the packet by packet upload of the earlier
+# versions, and rftool uses it. COMPRESSION, MULTICAST, FEC, EEPROM, TELEMETRY
+# and BACKGROUND turn it on. "make" fails if rfboot no longer fits the 4096 bytes.
+# The atmega1284p and atmega2560 builds always have it.
+# Only "1" is accepted as true
+#WINDOW = 1
+
+# Uncomment to check the application with a CRC32 (RFB_OPT_CRC32), calculated
+# while the pages are read back after they are written, instead of the 2 CRC16
+# read from the whole flash at the end. EEPROM and BACKGROUND turn it on.
+# "make" fails if rfboot no longer fits the 4096 bytes.
+# Only "1" is accepted as true
+#CRC32 = 1
+
+# Uncomment to enable compressed uploads (RFB_OPT_PACKED).
+# rftool then sends the application LZ compressed, if this makes it smaller.
+# The decompressor needs ~200 bytes of flash and 512 bytes of RAM
+# (only during the upload). "make" fails if rfboot no longer fits the 4096 bytes.
+# Only "1" is accepted as true
+#COMPRESSION = 1
+
+# Uncomment for battery powered nodes with frequent power-on or brown-out resets.
+# After such a reset rfboot listens for ~15ms instead of 250ms, and if
+# nobody transmits, the application starts without the watchdog reset.
+# Also sets the fuses for a short start-up time. The application
+# starts less than 20ms after power-on. To measure it, set a pin high at the start
+# of the application and look at this pin and VCC with an oscilloscope.
+# Only "1" is accepted as true
+#FAST_BOOT = 1
+
+# Uncomment to accept multicast uploads (RFB_OPT_GROUP, "rftool group").
+# Many nodes with the same key and settings get the application from one
+# transmission, and only the units some node lost are sent again.
+# "make" fails if rfboot no longer fits the 4096 bytes.
+# Only "1" is accepted as true
+#MULTICAST = 1
+
+# Uncomment for long or obstructed links ("rftool upload SomeFirmware fec").
+# The CC1101 hardware FEC during the upload, and a parity packet per SPM page,
+# so one lost packet per page is rebuilt without a request.
+# "make" fails if rfboot no longer fits the 4096 bytes.
+# Only "1" is accepted as true
+#FEC = 1
+
+# Uncomment to accept the EEPROM image (the .eeprom section of the .elf)
+# in the same upload as the flash (RFB_OPT2_EEPROM). Only the bytes that
+# differ are written. "make" fails if rfboot no longer fits the 4096 bytes.
+# Only "1" is accepted as true
+#EEPROM = 1
+
+# Uncomment to keep a record of the last 3 uploads in DATA_PAGE (duration,
+# repeated requests, CRC errors, worst RSSI and LQI) and report them to
+# rftool at the end of the upload (RFB_OPT2_STATS). Uses Timer1 during
+# the upload. "make" fails if rfboot no longer fits the 4096 bytes.
+# Only "1" is accepted as true
+#TELEMETRY = 1
+
+# Uncomment to let the application receive the next application while it
+# runs ("rftool background SomeFirmware", see skel/rfboot_api.h). rfboot
+# installs it at the next reset, in ~2 sec. The applications must be smaller
+# than 14208 bytes, as the upper half of the flash keeps the new one.
+# Only on the atmega328p. "make" fails if rfboot no longer fits the 4096 bytes.
+# Only "1" is accepted as true
+#BACKGROUND = 1
+
+# Uncomment to keep the CC1101 in RX after every packet it receives
+# (MCSM1 RXOFF_MODE), instead of IDLE and a new calibration (~800us) before
+# the next packet. The next packet can follow at once, and there are no
+# strobes after a packet.
+# Only "1" is accepted as true
+#AUTO_RX = 1
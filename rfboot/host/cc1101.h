@@ -0,0 +1,71 @@
+// Host CC1101 (see hal_host.h). A packet radio with the functions of
+// cc1101/cc1101.h that rfboot.c uses, and the other side of the link :
+// radio_send() puts a packet on the air, and the packets of rfboot go to
+// radio_link.receive. The link decides which packets arrive (radio_link.pass)
+#ifndef _CC1101_H
+#define _CC1101_H
+
+#include "hal_host.h"
+#define byte uint8_t
+#include "../cc1101/ccpacket.h"
+
+#define CC1101_PKTSTATUS 0x38
+
+void spi_init(void);
+bool cc1101_detect(void);
+void cc1101_init(void);
+void cc1101_setChannel(byte chnl);
+void cc1101_setSyncWord(uint8_t syncH, uint8_t syncL);
+void cc1101_setFastModem(bool fast);
+void cc1101_setFec(byte len);
+void cc1101_setPowerDownState(void);
+bool cc1101_txStart(const byte* data, byte len);
+bool cc1101_txEnd(void);
+byte cc1101_receiveData(CCPACKET* packet);
+byte readStatusReg(byte regAddr);
+#define disableAddressCheck()
+
+// GDO0, high from the sync word to the end of the packet
+bool radio_gdo0(void);
+#define READ(pin) radio_gdo0()
+
+typedef struct radio_link {
+    // A packet from rfboot
+    void (*receive)(const uint8_t* data, uint8_t len, void* ctx);
+    // false if the packet is lost. Packets to rfboot arrive with a CRC
+    // error then, as the CC1101 (no CRC_AUTOFLUSH) reports them
+    bool (*pass)(bool to_rfboot, const uint8_t* data, uint8_t len, void* ctx);
+    void* ctx;
+} radio_link;
+
+void radio_set_link(const radio_link* link);
+
+// The other side transmits at "t" or when the air is free. Returns when
+// the packet ends. "fast" is the modem setting (cc1101_setFastModem) and
+// "fec" the FEC packet length (cc1101_setFec), rfboot gets only packets
+// with its own settings
+uint64_t radio_send(const uint8_t* data, uint8_t len, uint64_t t, bool fast, uint8_t fec);
+
+// The air time of a packet with "len" bytes
+uint64_t radio_air_time(uint8_t len, bool fast, uint8_t fec);
+// From the start of a packet until the receivers hear it (the sync word)
+uint64_t radio_sync_air_time(bool fast);
+
+// The other side cannot receive while it transmits (until radio_peer_busy),
+// and hears only packets with its own settings
+extern uint64_t radio_peer_busy;
+extern bool radio_peer_fast;
+extern uint8_t radio_peer_fec;
+
+// Packets rfboot sent, and the ones it missed
+extern unsigned radio_rfboot_tx;
+extern unsigned radio_rfboot_missed;
+
+// The time (ns) from the end of a packet until rfboot can receive again,
+// the sum for the packets rfboot received and for the ones it sent
+extern uint64_t radio_rx_turnaround;
+extern unsigned radio_rx_turnarounds;
+extern uint64_t radio_tx_turnaround;
+extern unsigned radio_tx_turnarounds;
+
+#endif
@@ -0,0 +1,306 @@
+// Host CC1101, see cc1101.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "cc1101.h"
+
+// Preamble (4 bytes) and sync word (twice, MDMCFG2 SYNC_MODE=3)
+#define AIR_SYNC_BYTES 8
+// The receiver must be in RX before the sync word starts
+#define AIR_PREAMBLE_BYTES 4
+// The length byte and the CRC
+#define AIR_EXTRA_BYTES 3
+// One SPI byte at F_CPU/4 with the driver code around it
+#define SPI_BYTE_NS (5*HAL_US)
+// The registers of a send or a receive (status reads, strobes)
+#define SPI_OVERHEAD_BYTES 8
+// SIDLE, SFRX and SRX after a received packet, not with RFBOOT_AUTO_RX
+#define SPI_RX_STROBES 3
+// From IDLE to RX the CC1101 calibrates (MCSM0 FS_AUTOCAL) and does not
+// receive. From TX to RX (MCSM1 TXOFF_MODE) there is no calibration.
+// CC1101 datasheet, state transition times
+#define RX_CAL_NS (800*HAL_US)
+#define TX_RX_NS (22*HAL_US)
+// Packets on the air at the same time (usb2rf sends a whole SPM page back to back)
+#define AIR_SLOTS 32
+
+// RSSI and LQI of every packet, a good link (see LONG_PKT_RSSI in rfboot.c)
+#define AIR_RSSI 0x20
+#define AIR_LQI 0x04
+
+unsigned radio_rfboot_tx;
+unsigned radio_rfboot_missed;
+uint64_t radio_rx_turnaround;
+unsigned radio_rx_turnarounds;
+uint64_t radio_tx_turnaround;
+unsigned radio_tx_turnarounds;
+uint64_t radio_peer_busy;
+bool radio_peer_fast;
+uint8_t radio_peer_fec;
+
+static const radio_link* link;
+
+static enum { R_IDLE, R_RX, R_TX } state;
+// In RX, but the CC1101 receives only from this time
+static uint64_t rx_ready;
+// A received packet put the CC1101 in IDLE at this time, and it is not
+// in RX again yet
+static bool rx_off;
+static uint64_t rx_off_since;
+static bool fast_modem;
+static uint8_t fec_len;
+
+typedef struct air_packet {
+    bool used;
+    bool fast;
+    uint8_t fec;
+    bool ok;
+    uint8_t len;
+    uint8_t data[CC1101_STREAM_LEN];
+    uint64_t start;
+    uint64_t end;
+} air_packet;
+
+static air_packet air[AIR_SLOTS];
+// When the other side can transmit again
+static uint64_t air_free;
+// The packet rfboot receives, NULL if none
+static air_packet* receiving;
+// A received packet in the RX FIFO
+static CCPACKET fifo;
+static bool fifo_full;
+
+void radio_set_link(const radio_link* l) {
+    link = l;
+}
+
+// DRATE 38383 (default) and 99975 (fast) bits per second
+static uint64_t byte_ns(bool fast) {
+    return fast ? 80020 : 208425;
+}
+
+// With the FEC the packet has a fixed length, and the length, the data and
+// the CRC take twice the time (the code has rate 1/2)
+uint64_t radio_air_time(uint8_t len, bool fast, uint8_t fec) {
+    if (fec) return (AIR_SYNC_BYTES + 2*(fec + AIR_EXTRA_BYTES - 1ull)) * byte_ns(fast);
+    return (AIR_SYNC_BYTES + AIR_EXTRA_BYTES + (uint64_t)len) * byte_ns(fast);
+}
+
+uint64_t radio_sync_air_time(bool fast) {
+    return AIR_SYNC_BYTES*byte_ns(fast);
+}
+
+static uint64_t sync_time(const air_packet* p) {
+    return p->start + AIR_SYNC_BYTES*byte_ns(p->fast);
+}
+
+bool radio_gdo0(void) {
+    return (receiving && hal_now>=sync_time(receiving)) || state==R_TX;
+}
+
+// SIDLE. A packet arriving is lost, and GDO0 goes low
+static void radio_idle(void) {
+    if (receiving) {
+        bool gdo0 = radio_gdo0();
+        receiving = NULL;
+        radio_rfboot_missed++;
+        if (gdo0) hal_int0_edge();
+    }
+    state = R_IDLE;
+}
+
+static void radio_rx(void) {
+    if (state!=R_IDLE) return;
+    state = R_RX;
+    rx_ready = hal_now + RX_CAL_NS;
+    if (rx_off) {
+        rx_off = false;
+        radio_rx_turnaround += rx_ready - rx_off_since;
+        radio_rx_turnarounds++;
+    }
+}
+
+static void air_end(void* arg) {
+    air_packet* p = arg;
+    p->used = false;
+    if (receiving != p) return;
+    receiving = NULL;
+    fifo.length = p->len;
+    memcpy(fifo.data, p->data, p->len);
+    fifo.crc_ok = p->ok;
+    fifo.rssi = AIR_RSSI;
+    fifo.lqi = AIR_LQI;
+    fifo_full = true;
+    #ifdef RFBOOT_AUTO_RX
+    // MCSM1 RXOFF_MODE is RX, the next packet can follow at once
+    radio_rx_turnarounds++;
+    #else
+    // MCSM1 RXOFF_MODE is IDLE
+    state = R_IDLE;
+    rx_off = true;
+    rx_off_since = hal_now;
+    #endif
+    hal_int0_edge();
+}
+
+static void air_start(void* arg) {
+    air_packet* p = arg;
+    radio_peer_busy = p->end;
+}
+
+// Only in RX, with the same modem settings, one packet at a time
+static void air_sync(void* arg) {
+    air_packet* p = arg;
+    if (state!=R_RX || hal_now<rx_ready || receiving || fifo_full || p->fast!=fast_modem || p->fec!=fec_len) {
+        radio_rfboot_missed++;
+        return;
+    }
+    p->ok = !link || !link->pass || link->pass(true, p->data, p->len, link->ctx);
+    receiving = p;
+}
+
+uint64_t radio_send(const uint8_t* data, uint8_t len, uint64_t t, bool fast, uint8_t fec) {
+    air_packet* p = NULL;
+    for (int i=0; i<AIR_SLOTS; i++) {
+        if (!air[i].used) {
+            p = air+i;
+            break;
+        }
+    }
+    if (!p || len>CC1101_STREAM_LEN || (fec && len>=fec)) {
+        fprintf(stderr, "radio_send: no room for the packet\n");
+        abort();
+    }
+    if (t<air_free) t = air_free;
+    p->used = true;
+    p->fast = fast;
+    p->fec = fec;
+    p->len = len;
+    memcpy(p->data, data, len);
+    p->start = t;
+    p->end = t + radio_air_time(len, fast, fec);
+    air_free = p->end;
+    hal_event(p->start, air_start, p);
+    hal_event(p->start + AIR_PREAMBLE_BYTES*byte_ns(fast), air_sync, p);
+    hal_event(p->end, air_end, p);
+    return p->end;
+}
+
+// The functions rfboot.c uses
+
+void spi_init(void) {
+}
+
+bool cc1101_detect(void) {
+    return true;
+}
+
+void cc1101_init(void) {
+    radio_idle();
+    fast_modem = false;
+    fec_len = 0;
+    fifo_full = false;
+}
+
+void cc1101_setChannel(byte chnl) {
+}
+
+void cc1101_setSyncWord(uint8_t syncH, uint8_t syncL) {
+}
+
+void cc1101_setFastModem(bool fast) {
+    radio_idle();
+    fast_modem = fast;
+    fifo_full = false;
+    radio_rx();
+}
+
+void cc1101_setFec(byte len) {
+    radio_idle();
+    fec_len = len;
+    fifo_full = false;
+    radio_rx();
+}
+
+void cc1101_setPowerDownState(void) {
+    radio_idle();
+}
+
+byte readStatusReg(byte regAddr) {
+    // PKTSTATUS, CS (carrier sense) is bit 6
+    if (regAddr==CC1101_PKTSTATUS) return receiving ? 0x40 : 0;
+    return 0;
+}
+
+// The packet is read while it arrives, so it is ready soon after its end
+byte cc1101_receiveData(CCPACKET* packet) {
+    packet->length = 0;
+    packet->crc_ok = 0;
+    if (receiving && radio_gdo0()) hal_advance(receiving->end-hal_now);
+    #ifdef RFBOOT_AUTO_RX
+    // The CC1101 is still in RX. The FIFO is flushed only if there was no packet
+    if (fifo_full) {
+        hal_advance((SPI_OVERHEAD_BYTES-SPI_RX_STROBES)*SPI_BYTE_NS);
+        *packet = fifo;
+        fifo_full = false;
+        return packet->length;
+    }
+    #endif
+    hal_advance(SPI_OVERHEAD_BYTES*SPI_BYTE_NS);
+    if (fifo_full) {
+        *packet = fifo;
+        fifo_full = false;
+    }
+    radio_idle();
+    radio_rx();
+    return packet->length;
+}
+
+// The packet rfboot sends. The TX FIFO has a copy, rfboot can change
+// its buffer while the packet is on the air
+static uint8_t tx_data[CC1101_STREAM_LEN];
+static uint8_t tx_len;
+static uint64_t tx_start;
+
+// GDO0 goes low at the end of the packet. MCSM1 TXOFF_MODE is RX
+static void tx_end(void* arg) {
+    radio_rfboot_tx++;
+    state = R_RX;
+    rx_ready = hal_now + TX_RX_NS;
+    radio_tx_turnaround += TX_RX_NS;
+    radio_tx_turnarounds++;
+    hal_int0_edge();
+    // The other side does not hear us while it transmits
+    bool heard = radio_peer_busy<=tx_start && radio_peer_fast==fast_modem && radio_peer_fec==fec_len;
+    if (heard && link && link->pass) heard = link->pass(false, tx_data, tx_len, link->ctx);
+    if (heard && link && link->receive) link->receive(tx_data, tx_len, link->ctx);
+}
+
+bool cc1101_txStart(const byte* data, byte len) {
+    // The driver reads MARCSTATE (2 SPI bytes) and returns if it is not
+    // RX yet, rfboot calls it again
+    hal_advance(2*SPI_BYTE_NS);
+    if (state!=R_RX || rx_ready>hal_now) {
+        if (state==R_IDLE) radio_rx();
+        return false;
+    }
+    hal_advance((SPI_OVERHEAD_BYTES-2+(fec_len ? fec_len : len))*SPI_BYTE_NS);
+    // CCA, not while a packet arrives
+    if (receiving || state!=R_RX) {
+        radio_idle();
+        radio_rx();
+        return false;
+    }
+    memcpy(tx_data, data, len);
+    tx_len = len;
+    tx_start = hal_now;
+    state = R_TX;
+    hal_event(hal_now + radio_air_time(len, fast_modem, fec_len), tx_end, NULL);
+    return true;
+}
+
+// The TX FIFO is always empty here, the CC1101 is in RX already
+bool cc1101_txEnd(void) {
+    hal_advance((SPI_OVERHEAD_BYTES+1)*SPI_BYTE_NS);
+    return true;
+}
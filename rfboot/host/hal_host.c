@@ -0,0 +1,296 @@
+// Host HAL for rfboot.c, see hal_host.h
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "hal_host.h"
+
+uint64_t hal_now;
+unsigned hal_violations;
+
+volatile uint8_t MCUSR, MCUCR, EICRA, EIMSK, EIFR, SPCR, SPSR,
+    PORTB, DDRB, OSCCAL, GPIOR0, TCCR1B;
+
+// Counts from time 0. rfboot uses only the difference of two reads
+uint16_t hal_tcnt1(void) {
+    if (!TCCR1B) return 0;
+    return hal_now / (1024*1000000000ull/F_CPU);
+}
+
+// The cost of every poll (a register read and a branch, about 2 cycles)
+#define HAL_POLL_NS 250
+// SPM erase and write time, datasheet 3.7-4.5ms
+#define HAL_SPM_NS (4500*HAL_US)
+// EEPROM write time (erase and write), datasheet 3.3ms
+#define HAL_EEPROM_NS (3300*HAL_US)
+
+static jmp_buf hal_exit;
+static uint64_t hal_limit;
+
+// The watchdog fires at this time, 0 if off
+static uint64_t wdt_deadline;
+static uint64_t wdt_period;
+
+static bool sreg_i;
+static bool atomic_i;
+static bool int0_pending;
+static bool in_isr;
+static bool int0_flag;
+static bool tx_flag;
+
+// The events, not sorted. There are only a few at any time
+#define HAL_EVENTS 64
+static struct {
+    uint64_t t;
+    hal_event_cb cb;
+    void* arg;
+} events[HAL_EVENTS];
+static int event_count;
+// The time of the first event, so most calls of hal_advance (every poll)
+// do not search the events
+static uint64_t event_first = UINT64_MAX;
+
+static void hal_end(int how) __attribute__ ((__noreturn__));
+static void hal_end(int how) {
+    longjmp(hal_exit, how);
+}
+
+void hal_event(uint64_t t, hal_event_cb cb, void* arg) {
+    if (event_count == HAL_EVENTS) {
+        fprintf(stderr, "hal_event: too many events\n");
+        abort();
+    }
+    events[event_count].t = t;
+    events[event_count].cb = cb;
+    events[event_count].arg = arg;
+    event_count++;
+    if (t<event_first) event_first = t;
+}
+
+// Runs the first event due until "t". Returns false if there is none
+static bool hal_next_event(uint64_t t) {
+    if (event_first>t) return false;
+    int first = 0;
+    for (int i=1; i<event_count; i++) {
+        if (events[i].t<events[first].t) first = i;
+    }
+    uint64_t et = events[first].t;
+    hal_event_cb cb = events[first].cb;
+    void* arg = events[first].arg;
+    events[first] = events[--event_count];
+    event_first = UINT64_MAX;
+    for (int i=0; i<event_count; i++) {
+        if (events[i].t<event_first) event_first = events[i].t;
+    }
+    if (et>hal_now) hal_now = et;
+    cb(arg);
+    return true;
+}
+
+void hal_advance(uint64_t ns) {
+    uint64_t t = hal_now + ns;
+    bool reset = wdt_deadline && wdt_deadline<=t;
+    if (reset) t = wdt_deadline;
+    while (hal_next_event(t));
+    hal_now = t;
+    if (reset) hal_end(HAL_RESET);
+    if (hal_now>=hal_limit) hal_end(HAL_TIMEOUT);
+}
+
+// Interrupts
+
+static void hal_int0_run(void) {
+    if (!sreg_i || !int0_pending || in_isr) return;
+    int0_pending = false;
+    in_isr = true;
+    hal_int0_isr();
+    in_isr = false;
+}
+
+void hal_cli(void) {
+    sreg_i = false;
+}
+
+void hal_sei(void) {
+    sreg_i = true;
+    hal_int0_run();
+}
+
+uint8_t hal_atomic_begin(void) {
+    atomic_i = sreg_i;
+    sreg_i = false;
+    return 1;
+}
+
+uint8_t hal_atomic_end(uint8_t forceon) {
+    if (forceon || atomic_i) hal_sei();
+    return 0;
+}
+
+// INT0 on the falling edge (EICRA ISC01), as radio_init sets it
+void hal_int0_edge(void) {
+    if (!(EIMSK & 1)) return;
+    int0_pending = true;
+    hal_int0_run();
+}
+
+bool* hal_int0_flag(void) {
+    if (!in_isr) hal_advance(HAL_POLL_NS);
+    return &int0_flag;
+}
+
+bool* hal_tx_flag(void) {
+    if (!in_isr) hal_advance(HAL_POLL_NS);
+    return &tx_flag;
+}
+
+// Flash
+
+uint8_t hal_flash[HAL_FLASH_SIZE];
+uint8_t hal_signature[0x20];
+static uint8_t spm_buf[HAL_SPM_PAGESIZE];
+static uint64_t spm_end;
+static bool rww_enabled = true;
+
+static uint8_t flash_byte(uint32_t addr) {
+    addr %= HAL_FLASH_SIZE;
+    if (addr<HAL_RWW_END && !rww_enabled) {
+        hal_violations++;
+        return 0xff;
+    }
+    return hal_flash[addr];
+}
+
+uint8_t hal_pgm_read_byte(uint32_t addr) {
+    return flash_byte(addr);
+}
+
+uint16_t hal_pgm_read_word(uint32_t addr) {
+    return flash_byte(addr) | (flash_byte(addr+1)<<8);
+}
+
+void hal_memcpy_P(void* dst, uint32_t src, uint16_t n) {
+    uint8_t* d = dst;
+    while (n--) *d++ = flash_byte(src++);
+}
+
+int hal_memcmp_P(const void* s, uint32_t addr, uint16_t n) {
+    const uint8_t* p = s;
+    while (n--) {
+        uint8_t b = flash_byte(addr++);
+        if (*p != b) return *p<b ? -1 : 1;
+        p++;
+    }
+    return 0;
+}
+
+static uint64_t eeprom_end;
+
+static void spm_start(uint32_t addr) {
+    if (hal_now<spm_end || hal_now<eeprom_end) hal_violations++;
+    spm_end = hal_now + HAL_SPM_NS;
+    if (addr<HAL_RWW_END) rww_enabled = false;
+}
+
+void hal_page_fill(uint32_t addr, uint16_t w) {
+    if (hal_now<spm_end) hal_violations++;
+    addr %= HAL_SPM_PAGESIZE;
+    spm_buf[addr&~1] = w;
+    spm_buf[addr|1] = w>>8;
+}
+
+void hal_page_erase(uint32_t addr) {
+    addr = addr/HAL_SPM_PAGESIZE*HAL_SPM_PAGESIZE;
+    spm_start(addr);
+    memset(hal_flash+addr, 0xff, HAL_SPM_PAGESIZE);
+}
+
+// The programming can only clear bits. The page buffer is
+// erased after the write. rfboot programs a word only once after
+// the erase (see todo_done), a second time is a violation
+void hal_page_write(uint32_t addr) {
+    addr = addr/HAL_SPM_PAGESIZE*HAL_SPM_PAGESIZE;
+    spm_start(addr);
+    for (int i=0; i<HAL_SPM_PAGESIZE; i+=2) {
+        if ( (spm_buf[i]&spm_buf[i+1])!=0xff && (hal_flash[addr+i]&hal_flash[addr+i+1])!=0xff ) hal_violations++;
+    }
+    for (int i=0; i<HAL_SPM_PAGESIZE; i++) hal_flash[addr+i] &= spm_buf[i];
+    memset(spm_buf, 0xff, sizeof(spm_buf));
+}
+
+void hal_rww_enable(void) {
+    if (hal_now<spm_end) hal_violations++;
+    else rww_enabled = true;
+}
+
+// A loop that only polls the SPM (nothing else advanced the time since
+// the last poll) waits until the SPM or an event (a packet) ends, we go
+// there at once
+static uint64_t spm_polled;
+
+bool hal_spm_busy(void) {
+    uint64_t t = spm_end<event_first ? spm_end : event_first;
+    if (hal_now==spm_polled && t>hal_now+HAL_POLL_NS) hal_advance(t-hal_now);
+    else hal_advance(HAL_POLL_NS);
+    spm_polled = hal_now;
+    return hal_now<spm_end;
+}
+
+void hal_spm_busy_wait(void) {
+    if (hal_now<spm_end) hal_advance(spm_end-hal_now);
+}
+
+// EEPROM
+
+uint8_t hal_eeprom[HAL_EEPROM_SIZE];
+unsigned hal_eeprom_writes;
+
+void hal_eeprom_busy_wait(void) {
+    if (hal_now<eeprom_end) hal_advance(eeprom_end-hal_now);
+}
+
+uint8_t hal_eeprom_read_byte(uint16_t addr) {
+    hal_eeprom_busy_wait();
+    return hal_eeprom[addr%HAL_EEPROM_SIZE];
+}
+
+void hal_eeprom_update_byte(uint16_t addr, uint8_t b) {
+    if (hal_eeprom_read_byte(addr) == b) return;
+    if (hal_now<spm_end) hal_violations++;
+    hal_eeprom[addr%HAL_EEPROM_SIZE] = b;
+    eeprom_end = hal_now + HAL_EEPROM_NS;
+    hal_eeprom_writes++;
+}
+
+// Watchdog, the timeout is 16ms<<WDTO_xx
+
+void hal_wdt_enable(uint8_t timeout) {
+    wdt_period = (16*HAL_MS)<<timeout;
+    wdt_deadline = hal_now + wdt_period;
+}
+
+void hal_wdt_reset(void) {
+    if (wdt_deadline) wdt_deadline = hal_now + wdt_period;
+}
+
+void hal_start_app(void) {
+    hal_end(HAL_APP_START);
+}
+
+void hal_wait_watchdog(void) {
+    if (!wdt_deadline) hal_end(HAL_TIMEOUT);
+    hal_advance(wdt_deadline-hal_now);
+    hal_end(HAL_RESET);
+}
+
+int hal_run(void (*entry)(void), uint64_t limit) {
+    hal_limit = limit;
+    int how = setjmp(hal_exit);
+    if (how) return how;
+    memset(spm_buf, 0xff, sizeof(spm_buf));
+    // The reset stops Timer1
+    TCCR1B = 0;
+    tx_flag = false;
+    entry();
+    return HAL_RESET;
+}
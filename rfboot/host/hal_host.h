@@ -0,0 +1,112 @@
+// Host HAL for rfboot.c (-DRFBOOT_HOST, see README.md)
+//
+// The avr-libc headers rfboot.c includes are replaced by the ones in
+// host/include, which call the functions below. The flash is an array,
+// the CC1101 is a packet radio (host/cc1101.h) and the time is virtual :
+// it passes only in the delays, the SPM operations, the radio and a small
+// cost for every poll. The code itself takes no time, the simavr benchmark
+// (sim/) measures it.
+#ifndef HAL_HOST_H
+#define HAL_HOST_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+// The atmega328p. The Makefile sets the atmega1284p with MCU=atmega1284p
+#ifndef HAL_FLASH_SIZE
+#define HAL_FLASH_SIZE 0x8000
+#endif
+#ifndef HAL_SPM_PAGESIZE
+#define HAL_SPM_PAGESIZE 128
+#endif
+// The RWW section, the application and DATA_PAGE
+#ifndef HAL_RWW_END
+#define HAL_RWW_END 0x7000
+#endif
+#ifndef HAL_EEPROM_SIZE
+#define HAL_EEPROM_SIZE 1024
+#endif
+// The clock, for Timer1
+#ifndef F_CPU
+#define F_CPU 8000000UL
+#endif
+
+// Virtual time in ns
+extern uint64_t hal_now;
+#define HAL_US 1000ull
+#define HAL_MS 1000000ull
+
+// Advances the time and runs the events on the way (packets, interrupts,
+// the watchdog)
+void hal_advance(uint64_t ns);
+
+// Events, for the radio and for the other side of the link
+typedef void (*hal_event_cb)(void* arg);
+void hal_event(uint64_t t, hal_event_cb cb, void* arg);
+
+// The I/O registers rfboot.c uses
+extern volatile uint8_t MCUSR, MCUCR, EICRA, EIMSK, EIFR, SPCR, SPSR,
+    PORTB, DDRB, OSCCAL, GPIOR0;
+
+// Timer1 at F_CPU/1024 (TCCR1B), only TCNT1 is read (RFBOOT_TELEMETRY)
+extern volatile uint8_t TCCR1B;
+uint16_t hal_tcnt1(void);
+
+// Interrupts. INT0 is the only one
+void hal_cli(void);
+void hal_sei(void);
+uint8_t hal_atomic_begin(void);
+uint8_t hal_atomic_end(uint8_t forceon);
+void hal_int0_isr(void);
+// GDO0 went low
+void hal_int0_edge(void);
+
+// data_ready of rfboot.c. Every read polls the events
+bool* hal_int0_flag(void);
+// tx_pending of rfboot.c, the same way. A reset clears it
+bool* hal_tx_flag(void);
+
+// The flash and the SPM
+extern uint8_t hal_flash[HAL_FLASH_SIZE];
+// The addresses have 32 bits, for the far reads above 64KB
+uint8_t hal_pgm_read_byte(uint32_t addr);
+uint16_t hal_pgm_read_word(uint32_t addr);
+void hal_memcpy_P(void* dst, uint32_t src, uint16_t n);
+int hal_memcmp_P(const void* s, uint32_t addr, uint16_t n);
+void hal_page_fill(uint32_t addr, uint16_t w);
+void hal_page_erase(uint32_t addr);
+void hal_page_write(uint32_t addr);
+void hal_rww_enable(void);
+bool hal_spm_busy(void);
+void hal_spm_busy_wait(void);
+// The signature row (boot_signature_byte_get), 0x0E-0x17 is the serial number
+extern uint8_t hal_signature[0x20];
+
+// The EEPROM. A write takes 3.3ms and the reads wait for it, as the
+// avr-libc functions do. hal_eeprom_writes counts the bytes written
+extern uint8_t hal_eeprom[HAL_EEPROM_SIZE];
+extern unsigned hal_eeprom_writes;
+uint8_t hal_eeprom_read_byte(uint16_t addr);
+void hal_eeprom_update_byte(uint16_t addr, uint8_t b);
+void hal_eeprom_busy_wait(void);
+
+// The watchdog. A reset ends the run (hal_run)
+void hal_wdt_enable(uint8_t timeout);
+void hal_wdt_reset(void);
+
+// How a run ends
+enum { HAL_RUNNING, HAL_RESET, HAL_APP_START, HAL_TIMEOUT };
+void hal_start_app(void) __attribute__ ((__noreturn__));
+void hal_wait_watchdog(void) __attribute__ ((__noreturn__));
+
+// Runs "entry" (the main() of rfboot) until it resets the MCU or starts
+// the application. Returns HAL_RESET or HAL_APP_START, or HAL_TIMEOUT
+// if the virtual time reaches "limit"
+int hal_run(void (*entry)(void), uint64_t limit);
+
+// Things rfboot should never do : SPM while the SPM or the EEPROM is busy,
+// reading the RWW section while it is disabled
+extern unsigned hal_violations;
+
+#endif
@@ -0,0 +1,15 @@
+// Host version of <avr/boot.h>, see host/hal_host.h
+#ifndef HOST_AVR_BOOT_H
+#define HOST_AVR_BOOT_H
+
+#include "hal_host.h"
+
+#define boot_page_fill(addr, w) hal_page_fill((uint32_t)(addr), (w))
+#define boot_page_erase(addr) hal_page_erase((uint32_t)(addr))
+#define boot_page_write(addr) hal_page_write((uint32_t)(addr))
+#define boot_rww_enable() hal_rww_enable()
+#define boot_spm_busy() hal_spm_busy()
+#define boot_spm_busy_wait() hal_spm_busy_wait()
+#define boot_signature_byte_get(addr) hal_signature[(addr)]
+
+#endif
@@ -0,0 +1,12 @@
+// Host version of <avr/eeprom.h>, see host/hal_host.h
+#ifndef HOST_AVR_EEPROM_H
+#define HOST_AVR_EEPROM_H
+
+#include <stdint.h>
+#include "hal_host.h"
+
+#define eeprom_read_byte(addr) hal_eeprom_read_byte((uint16_t)(uintptr_t)(addr))
+#define eeprom_update_byte(addr, b) hal_eeprom_update_byte((uint16_t)(uintptr_t)(addr), (b))
+#define eeprom_busy_wait() hal_eeprom_busy_wait()
+
+#endif
@@ -0,0 +1,12 @@
+// Host version of <avr/interrupt.h>, see host/hal_host.h
+#ifndef HOST_AVR_INTERRUPT_H
+#define HOST_AVR_INTERRUPT_H
+
+#include "hal_host.h"
+
+#define cli() hal_cli()
+#define sei() hal_sei()
+#define INT0_vect hal_int0_isr
+#define ISR(vector) void vector(void)
+
+#endif
@@ -0,0 +1,30 @@
+// Host version of <avr/io.h>, see host/hal_host.h
+#ifndef HOST_AVR_IO_H
+#define HOST_AVR_IO_H
+
+#include "hal_host.h"
+
+#define _BV(bit) (1 << (bit))
+
+#define SPM_PAGESIZE HAL_SPM_PAGESIZE
+#define FLASHEND (HAL_FLASH_SIZE-1)
+#define E2END (HAL_EEPROM_SIZE-1)
+
+// MCUSR
+#define PORF 0
+#define EXTRF 1
+#define BORF 2
+#define WDRF 3
+// MCUCR
+#define IVCE 0
+#define IVSEL 1
+// TCCR1B
+#define CS10 0
+#define CS12 2
+#define TCNT1 hal_tcnt1()
+// EICRA EIMSK EIFR
+#define ISC01 1
+#define INT0 0
+#define INTF0 0
+
+#endif
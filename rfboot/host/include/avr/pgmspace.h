@@ -0,0 +1,18 @@
+// Host version of <avr/pgmspace.h>, see host/hal_host.h
+// The near flash addresses are 16 bit, as on the atmega328p. The _far
+// and _PF functions take 32 bit addresses
+#ifndef HOST_AVR_PGMSPACE_H
+#define HOST_AVR_PGMSPACE_H
+
+#include <stdint.h>
+#include "hal_host.h"
+
+#define pgm_read_byte(addr) hal_pgm_read_byte((uint16_t)(uintptr_t)(addr))
+#define pgm_read_word(addr) hal_pgm_read_word((uint16_t)(uintptr_t)(addr))
+#define memcpy_P(dst, src, n) hal_memcpy_P((dst), (uint16_t)(uintptr_t)(src), (n))
+#define memcmp_P(s, addr, n) hal_memcmp_P((s), (uint16_t)(uintptr_t)(addr), (n))
+#define pgm_read_byte_far(addr) hal_pgm_read_byte((uint32_t)(addr))
+#define memcpy_PF(dst, src, n) hal_memcpy_P((dst), (uint32_t)(src), (n))
+#define memcmp_PF(s, addr, n) hal_memcmp_P((s), (uint32_t)(addr), (n))
+
+#endif
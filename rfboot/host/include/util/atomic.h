@@ -0,0 +1,11 @@
+// Host version of <util/atomic.h>, see host/hal_host.h
+#ifndef HOST_UTIL_ATOMIC_H
+#define HOST_UTIL_ATOMIC_H
+
+#include "hal_host.h"
+
+#define ATOMIC_RESTORESTATE 0
+#define ATOMIC_FORCEON 1
+#define ATOMIC_BLOCK(type) for (uint8_t __todo = hal_atomic_begin(); __todo; __todo = hal_atomic_end(type))
+
+#endif
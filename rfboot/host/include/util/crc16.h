@@ -0,0 +1,29 @@
+// Host version of <util/crc16.h>, the same as the avr-libc C equivalent
+#ifndef HOST_UTIL_CRC16_H
+#define HOST_UTIL_CRC16_H
+
+#include <stdint.h>
+
+static inline uint16_t _crc16_update(uint16_t crc, uint8_t a) {
+    crc ^= a;
+    for (int i = 0; i < 8; ++i) {
+        if (crc & 1)
+            crc = (crc >> 1) ^ 0xA001;
+        else
+            crc = (crc >> 1);
+    }
+    return crc;
+}
+
+static inline uint8_t _crc8_ccitt_update(uint8_t crc, uint8_t data) {
+    crc ^= data;
+    for (int i = 0; i < 8; ++i) {
+        if (crc & 0x80)
+            crc = (crc << 1) ^ 0x07;
+        else
+            crc <<= 1;
+    }
+    return crc;
+}
+
+#endif
@@ -0,0 +1,10 @@
+// Host version of <util/delay.h>, the virtual time passes
+#ifndef HOST_UTIL_DELAY_H
+#define HOST_UTIL_DELAY_H
+
+#include "hal_host.h"
+
+#define _delay_us(us) hal_advance((uint64_t)((us)*HAL_US))
+#define _delay_ms(ms) hal_advance((uint64_t)((ms)*HAL_MS))
+
+#endif
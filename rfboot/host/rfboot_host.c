@@ -0,0 +1,902 @@
+/*
+ * rfboot protocol benchmark on the host
+ *
+ * rfboot.c runs on Linux with the host HAL (hal_host.c, cc1101_host.c) and
+ * this program is the other side of the link, rftool and usb2rf : it pings
+ * rfboot, sends the header and answers RFB_SEND_PKT (packet by packet upload)
+ * or RFB_SEND_PAGE (window mode) as usb2rf does. The link loses packets
+ * and reorders the packets of a page at the rates we ask for.
+ *
+ * Every upload is a separate process (fork), so rfboot starts with
+ * its .data and .bss initialized, as after a reset. The time is virtual,
+ * see hal_host.h
+ *
+ * rfboot_host [-n uploads] [-o options] [-f options2] [-s size] [-e size]
+ *             [-E change%] [-l loss%] [-u loss%] [-r reorder%] [-d duplicate%]
+ *             [-m ok%] [-S seed] [-b] [-g nodes] [-v]
+ *
+ * With -b (make FEATURES=-DRFBOOT_BACKGROUND) the application has downloaded
+ * the image into slot B and resets, and we measure the time until the new
+ * application starts. -l is then the % of the images with a corrupted byte,
+ * which rfboot must not install. After an install the next download must be
+ * installed, and the first one sent again must not
+ *
+ * With -g (make FEATURES=-DRFBOOT_MULTICAST) only the NACKs of a multicast
+ * upload, see group_nacks
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include <avr/io.h>
+#include "hal_host.h"
+#include "cc1101.h"
+#include "xtea.h"
+
+#define PAYLOAD 32
+#define UNIT 16
+#define PAGE_UNITS (HAL_SPM_PAGESIZE/UNIT)
+// The length byte of the CC1101, the pages of 256 bytes take 2 packets
+#define MAX_PKT_UNITS (PAGE_UNITS>8 ? 8 : PAGE_UNITS)
+#define START_SIGNATURE 0xd20f6cdf
+// DATA_PAGE, the application must end before it
+#define MAX_SIZE (HAL_RWW_END-HAL_SPM_PAGESIZE)
+
+// The status codes and options of rfboot (rfboot.c)
+#define RFB_SEND_PKT 4
+#define RFB_SUCCESS 6
+#define RFB_SEND_PAGE 7
+#define RFB_OPTIONS 10
+#define RFB_FAST 12
+#define RFB_FEC 13
+#define RFB_OPT_WINDOW 1
+#define RFB_OPT_DELTA 2
+#define RFB_OPT_PACKED 4
+#define RFB_OPT_CRC32 8
+#define RFB_OPT_FAST 32
+#define RFB_OPT_CTR 64
+#define RFB_OPT2_FEC 1
+#define RFB_OPT2_PARITY 2
+#define RFB_OPT2_FAR 4
+#define RFB_OPT2_EEPROM 8
+#define RFB_OPT2_STATS 16
+// The session records of RFB_OPT2_STATS, and where DATA_PAGE has them.
+// The record of the last upload is in STATS_FINISHED, history[0] is
+// STATS_STARTED then
+#define STATS_REC 8
+#define STATS_LEN (3*STATS_REC)
+// (after app_size, 4 bytes with more than 64KB of flash, 3 CRCs and todo)
+#define STATS_OFFSET ((HAL_FLASH_SIZE>0x10000 ? 4 : 2)+6+28)
+#define STATS_FINISHED (STATS_OFFSET+STATS_LEN)
+// The FEC packet length of rfboot (FEC_PKTLEN)
+#define FEC_PKTLEN (1+2+PAYLOAD)
+
+// rftool -> usb2rf -> air, for the header and every legacy packet
+#define USB_LATENCY (2*HAL_MS)
+// usb2rf before each packet it sends (tx_start, send_long_packet) : the
+// GDO0 interrupt of the last packet took the CC1101 through IDLE, so it
+// calibrates again (rx_wait), then usb2rf fills the TX FIFO
+#define USB2RF_CAL (800*HAL_US)
+#define USB2RF_SPI_BYTE (5*HAL_US)
+// The CC1101 TX FIFO, send_long_packet refills it while on the air
+#define USB2RF_FIFO 63
+// rftool pings every 10ms and sends the header every 100ms
+#define PING_PERIOD (10*HAL_MS)
+#define HEADER_PERIOD (100*HAL_MS)
+// The EEPROM packets, rftool answers through usb2rf : the USB and
+// 32 bytes at 38400 baud
+#define EEPROM_LATENCY (10*HAL_MS)
+// Virtual time limit of an upload
+#define UPLOAD_LIMIT (120000*HAL_MS)
+// Slot B of the background download (rfboot.c BG_SLOT)
+#define BG_SLOT ((HAL_RWW_END-HAL_SPM_PAGESIZE)/2/HAL_SPM_PAGESIZE*HAL_SPM_PAGESIZE)
+#define BG_IMAGE (BG_SLOT+HAL_SPM_PAGESIZE)
+
+// rfboot.c, compiled with -Dmain=rfboot_main, and rfboot_settings.h
+int rfboot_main(void);
+extern uint8_t mcusr_mirror;
+extern uint32_t XTEA_KEY[4];
+extern const uint32_t PING_SIGNATURE;
+// Only with -DRFBOOT_BACKGROUND
+uint8_t rfboot_bg_write(uint16_t addr, const uint8_t* buf) __attribute__ ((weak));
+// Only with -DRFBOOT_MULTICAST
+uint16_t node_hash(void) __attribute__ ((weak));
+uint8_t nack_next(uint16_t* seed) __attribute__ ((weak));
+
+static int uploads = 100;
+static uint8_t options = 0;
+static uint8_t options2 = 0;
+static int size = 14336;
+// The EEPROM image, and the % of its bytes the EEPROM has different
+static int eeprom_size = 0;
+static double eeprom_change = 25;
+static double loss_down = 0;
+static double loss_up = 0;
+static double reorder = 0;
+// The % of the EEPROM packets sent twice
+static double duplicate = 0;
+// The % of the uploads that must succeed for the exit code 0
+static double min_ok = 100;
+static unsigned seed = 1;
+static int group_nodes = 0;
+static bool verbose = false;
+static bool background = false;
+
+static uint8_t image[MAX_SIZE];
+static uint8_t eeprom_image[HAL_EEPROM_SIZE];
+
+// The result of one upload, written by the child process
+typedef struct upload_result {
+    int how;
+    int reply;
+    bool flash_ok;
+    bool eeprom_ok;
+    unsigned eeprom_writes;
+    uint64_t contact;
+    uint64_t end;
+    // When the run ended
+    uint64_t stop;
+    unsigned requests;
+    unsigned packets;
+    // Reported by rfboot with RFB_OPT2_PARITY
+    unsigned repaired;
+    // Reported by rfboot with RFB_OPT2_STATS, and if DATA_PAGE has the same
+    uint8_t stats[STATS_LEN];
+    bool stats_got;
+    bool stats_saved;
+    unsigned rfboot_tx;
+    unsigned rfboot_missed;
+    uint64_t rx_turnaround;
+    unsigned rx_turnarounds;
+    uint64_t tx_turnaround;
+    unsigned tx_turnarounds;
+    unsigned violations;
+    // -b, the image was corrupted on purpose
+    bool corrupted;
+    // -b, after the install : the next download (a higher counter) was
+    // installed, and the first one (recorded) was sent again and installed
+    bool replay_tested;
+    bool next_installed;
+    bool replay_installed;
+} upload_result;
+
+static upload_result* result;
+
+// The other side of the link
+static struct {
+    enum { P_PING, P_HEADER, P_UPLOAD, P_DONE } state;
+    uint8_t accepted;
+    uint8_t accepted2;
+    uint8_t header[PAYLOAD];
+    // The encrypted application, at its flash addresses
+    uint8_t enc[MAX_SIZE];
+    // The encrypted EEPROM image (RFB_OPT2_EEPROM), padded to PAYLOAD
+    uint8_t eeprom_enc[HAL_EEPROM_SIZE+PAYLOAD];
+    // The IV after the header, the EEPROM packets in CTR mode follow it
+    uint32_t header_iv[2];
+    uint32_t rnd;
+} peer;
+
+static uint32_t rnd(void) {
+    // xorshift32
+    peer.rnd ^= peer.rnd << 13;
+    peer.rnd ^= peer.rnd >> 17;
+    peer.rnd ^= peer.rnd << 5;
+    return peer.rnd;
+}
+
+static bool chance(double percent) {
+    return percent>0 && (rnd()%10000) < percent*100;
+}
+
+static uint16_t crc16_update(uint16_t crc, uint8_t a) {
+    crc ^= a;
+    for (int i=0; i<8; i++) {
+        if (crc & 1) crc = (crc>>1) ^ 0xA001;
+        else crc = crc>>1;
+    }
+    return crc;
+}
+
+static uint32_t crc32_update(uint32_t crc, uint8_t b) {
+    crc ^= b;
+    for (int i=0; i<8; i++) crc = (crc>>1) ^ (0xEDB88320 & -(crc&1));
+    return crc;
+}
+
+static void put16(uint8_t* p, uint16_t v) {
+    p[0]=v; p[1]=v>>8;
+}
+
+static uint16_t get16(const uint8_t* p) {
+    return p[0] | (p[1]<<8);
+}
+
+static void put32(uint8_t* p, uint32_t v) {
+    put16(p, v); put16(p+2, v>>16);
+}
+
+static void encipher_cbc(uint8_t* buf, int len, uint32_t iv[2]) {
+    for (int i=0; i<len; i+=8) {
+        uint32_t v[2];
+        memcpy(v, buf+i, 8);
+        xtea_encipher_cbc(v, XTEA_KEY, iv);
+        memcpy(buf+i, v, 8);
+    }
+}
+
+// The same image every time. The first word is a "jmp", never 0xffff
+static void make_image(void) {
+    uint32_t x = 12345;
+    for (int i=0; i<size; i++) {
+        x = x*1103515245 + 12345;
+        image[i] = x>>16;
+    }
+    image[0] = 0x0c;
+    image[1] = 0x94;
+    for (int i=0; i<eeprom_size; i++) {
+        x = x*1103515245 + 12345;
+        eeprom_image[i] = x>>16;
+    }
+}
+
+// The EEPROM packets, CBC after the packets of the application
+static void encrypt_eeprom(uint32_t iv[2]) {
+    int padded = (eeprom_size+PAYLOAD-1)/PAYLOAD*PAYLOAD;
+    memset(peer.eeprom_enc, 0xff, sizeof(peer.eeprom_enc));
+    memcpy(peer.eeprom_enc, eeprom_image, eeprom_size);
+    for (int i=padded; i>0; i-=PAYLOAD) encipher_cbc(peer.eeprom_enc+i-PAYLOAD, PAYLOAD, iv);
+}
+
+// The header and the packets, as rftool encrypts them. CBC from the
+// header to the first bytes of the application, the packets of 32 bytes
+// from the last to the first. CTR uses the IV rfboot sent
+static void encrypt_upload(const uint32_t session_iv[2]) {
+    uint32_t iv[2] = { session_iv[0], session_iv[1] };
+    uint16_t crc=0, crc2=0;
+    uint32_t crc32=0xffffffff;
+    for (int i=0; i<size; i++) {
+        crc = crc16_update(crc, image[i]);
+        crc2 = crc16_update(crc2, image[size-1-i]);
+        crc32 = crc32_update(crc32, image[size-1-i]);
+    }
+    // The EEPROM continues the CRC32 of the application
+    uint32_t eeprom_crc32 = crc32;
+    for (int i=eeprom_size-1; i>=0; i--) eeprom_crc32 = crc32_update(eeprom_crc32, eeprom_image[i]);
+    memset(peer.header, 0, sizeof(peer.header));
+    put32(peer.header, START_SIGNATURE);
+    put16(peer.header+4, size);
+    put16(peer.header+6, crc);
+    put16(peer.header+8, crc2);
+    put32(peer.header+12, START_SIGNATURE);
+    peer.header[16] = options;
+    put32(peer.header+17, ~crc32);
+    peer.header[21] = options2;
+    peer.header[22] = size>>16;
+    put16(peer.header+23, eeprom_size);
+    put32(peer.header+25, ~eeprom_crc32);
+    encipher_cbc(peer.header, PAYLOAD, iv);
+    memcpy(peer.header_iv, iv, sizeof(peer.header_iv));
+    memcpy(peer.enc, image, size);
+    for (int i=size; i>0; i-=PAYLOAD) encipher_cbc(peer.enc+i-PAYLOAD, PAYLOAD, iv);
+    encrypt_eeprom(iv);
+}
+
+// CTR mode, used only if rfboot accepts it
+static void encrypt_ctr(const uint32_t session_iv[2]) {
+    memcpy(peer.enc, image, size);
+    for (int a=0; a<size; a+=8) {
+        uint32_t k[2] = { session_iv[0] | 0x80000000, session_iv[1]^a };
+        xtea_encipher(k, XTEA_KEY);
+        uint8_t ks[8];
+        put32(ks, k[0]);
+        put32(ks+4, k[1]);
+        for (int j=0; j<8; j++) peer.enc[a+j] ^= ks[j];
+    }
+    uint32_t iv[2] = { peer.header_iv[0], peer.header_iv[1] };
+    encrypt_eeprom(iv);
+}
+
+static uint32_t session_iv[2];
+
+// When a packet usb2rf starts at "t" goes on the air
+static uint64_t usb2rf_start(uint64_t t, uint8_t len) {
+    uint8_t size = radio_peer_fec ? radio_peer_fec-1 : len;
+    if (size>USB2RF_FIFO) size = USB2RF_FIFO;
+    return t + USB2RF_CAL + (1+size)*USB2RF_SPI_BYTE;
+}
+
+static void send(const uint8_t* data, uint8_t len, uint64_t t) {
+    result->packets++;
+    radio_send(data, len, usb2rf_start(t, len), radio_peer_fast, radio_peer_fec);
+}
+
+static void ping(void* arg) {
+    if (peer.state != P_PING) return;
+    uint8_t p[4];
+    put32(p, PING_SIGNATURE);
+    send(p, 4, hal_now);
+    hal_event(hal_now+PING_PERIOD, ping, NULL);
+}
+
+static void header(void* arg) {
+    if (peer.state != P_HEADER) return;
+    send(peer.header, PAYLOAD, hal_now);
+    hal_event(hal_now+HEADER_PERIOD, header, NULL);
+}
+
+// As usb2rf page_upload : the missing units from the last to the first,
+// consecutive ones in the same packet, "units" at most. With RFB_OPT2_PARITY
+// the parity packet of the page follows, if we send more than one packet
+static void send_page(uint32_t idx, uint16_t mask, uint8_t units) {
+    uint32_t spm_page = (idx-1)/HAL_SPM_PAGESIZE*HAL_SPM_PAGESIZE;
+    uint8_t pkts[PAGE_UNITS+1][2+MAX_PKT_UNITS*UNIT];
+    uint8_t lens[PAGE_UNITS+1];
+    int count = 0;
+    if (units>MAX_PKT_UNITS) units = MAX_PKT_UNITS;
+    while (idx>spm_page) {
+        uint8_t n=0;
+        while ( (n<units) && (idx-n*UNIT>spm_page) &&
+        (mask & (1u<<((idx-n*UNIT-1)%HAL_SPM_PAGESIZE/UNIT))) ) n++;
+        if (n==0) {
+            idx-=UNIT;
+            continue;
+        }
+        put16(pkts[count], idx);
+        memcpy(pkts[count]+2, peer.enc+idx-n*UNIT, n*UNIT);
+        lens[count++] = 2+n*UNIT;
+        idx -= n*UNIT;
+    }
+    if ( (peer.accepted2 & RFB_OPT2_PARITY) && count>1 ) {
+        uint8_t* parity = pkts[count];
+        memset(parity, 0, 2+PAYLOAD);
+        put16(parity, spm_page+1);
+        for (int a=spm_page; a<spm_page+HAL_SPM_PAGESIZE && a<size; a++)
+            parity[2+a%PAYLOAD] ^= peer.enc[a];
+        lens[count++] = 2+PAYLOAD;
+    }
+    // The link can reorder the packets of a page
+    for (int i=0; i+1<count; i++) {
+        if (chance(reorder)) {
+            uint8_t tmp[2+MAX_PKT_UNITS*UNIT];
+            uint8_t l = lens[i];
+            memcpy(tmp, pkts[i], sizeof(tmp));
+            memcpy(pkts[i], pkts[i+1], sizeof(tmp));
+            memcpy(pkts[i+1], tmp, sizeof(tmp));
+            lens[i] = lens[i+1];
+            lens[i+1] = l;
+        }
+    }
+    // usb2rf has the packets of the page already, it answers at once.
+    // Each packet starts after the end of the last one
+    uint64_t t = hal_now;
+    for (int i=0; i<count; i++) {
+        t = radio_send(pkts[i], lens[i], usb2rf_start(t, lens[i]), radio_peer_fast, radio_peer_fec);
+        result->packets++;
+    }
+}
+
+// A packet from rfboot
+static void receive(const uint8_t* data, uint8_t len, void* ctx) {
+    if (peer.state == P_DONE) return;
+    if (peer.state == P_PING) {
+        if (len != 8) return;
+        memcpy(session_iv, data, 8);
+        encrypt_upload(session_iv);
+        peer.state = P_HEADER;
+        result->contact = hal_now;
+        hal_event(hal_now+USB_LATENCY, header, NULL);
+        return;
+    }
+    if (len < 3) return;
+    uint32_t idx = data[1] | (data[2]<<8);
+    if (verbose) fprintf(stderr, "%10.3f ms : %d %u (%d bytes)\n", hal_now/1e6, data[0], (unsigned)idx, len);
+    if (data[0] == RFB_OPTIONS) {
+        peer.state = P_UPLOAD;
+        peer.accepted = data[1];
+        peer.accepted2 = data[2];
+        if (peer.accepted & RFB_OPT_CTR) encrypt_ctr(session_iv);
+        if (peer.accepted & RFB_OPT_FAST) radio_peer_fast = true;
+        if (peer.accepted2 & RFB_OPT2_FEC) radio_peer_fec = FEC_PKTLEN;
+    }
+    else if (data[0] == RFB_FAST) {
+        uint8_t ack[3] = { RFB_FAST, 0, 0 };
+        send(ack, 3, hal_now);
+    }
+    else if (data[0] == RFB_FEC) {
+        uint8_t ack[3] = { RFB_FEC, 0, 0 };
+        send(ack, 3, hal_now);
+    }
+    else if (data[0] == RFB_SEND_PKT && (peer.accepted & RFB_OPT_WINDOW) && (peer.accepted2 & RFB_OPT2_EEPROM)) {
+        // The EEPROM after the pages, the idx and the 32 bytes. -d sends
+        // some of them again, late
+        result->requests++;
+        if (idx>=PAYLOAD && idx<eeprom_size+PAYLOAD && idx%PAYLOAD==0) {
+            uint8_t p[2+PAYLOAD];
+            put16(p, idx);
+            memcpy(p+2, peer.eeprom_enc+idx-PAYLOAD, PAYLOAD);
+            uint64_t t = hal_now+EEPROM_LATENCY;
+            send(p, sizeof(p), t);
+            if (chance(duplicate)) send(p, sizeof(p), t+EEPROM_LATENCY);
+        }
+    }
+    else if (data[0] == RFB_SEND_PKT) {
+        peer.state = P_UPLOAD;
+        result->requests++;
+        if (idx>=PAYLOAD && idx<=size && idx%PAYLOAD==0)
+            send(peer.enc+idx-PAYLOAD, PAYLOAD, hal_now+USB_LATENCY);
+    }
+    else if (data[0] == RFB_SEND_PAGE && len == 5) {
+        peer.state = P_UPLOAD;
+        result->requests++;
+        if (idx>0 && idx<=size && idx%UNIT==0) send_page(idx, data[3], data[4]);
+    }
+    else if (data[0] == RFB_SEND_PAGE && len == 7 && (peer.accepted2 & RFB_OPT2_FAR)) {
+        // The high byte of the mask, and bits 16-23 of idx
+        peer.state = P_UPLOAD;
+        result->requests++;
+        idx |= (uint32_t)data[6]<<16;
+        if (idx>0 && idx<=size && idx%UNIT==0) send_page(idx, data[3]|(data[5]<<8), data[4]);
+    }
+    else {
+        result->reply = data[0];
+        if (len >= 4) result->repaired = data[3];
+        if (len == 4+STATS_LEN) {
+            memcpy(result->stats, data+4, STATS_LEN);
+            result->stats_got = true;
+        }
+        result->end = hal_now;
+        peer.state = P_DONE;
+    }
+}
+
+static bool pass(bool to_rfboot, const uint8_t* data, uint8_t len, void* ctx) {
+    return !chance(to_rfboot ? loss_down : loss_up);
+}
+
+static void rfboot_entry(void) {
+    rfboot_main();
+}
+
+// -b : the application, which got the packets of rftool. The image pages
+// and bg_info last, as rfboot_api.h writes them
+static void bg_download(void) {
+    uint8_t page[HAL_SPM_PAGESIZE];
+    for (int a=0; a<size; a+=HAL_SPM_PAGESIZE) {
+        memset(page, 0xff, sizeof(page));
+        memcpy(page, peer.enc+a, size-a<HAL_SPM_PAGESIZE ? size-a : HAL_SPM_PAGESIZE);
+        if (!rfboot_bg_write(BG_IMAGE+a, page)) hal_violations++;
+    }
+    memset(page, 0xff, sizeof(page));
+    memcpy(page, session_iv, 8);
+    memcpy(page+8, peer.header, PAYLOAD);
+    if (!rfboot_bg_write(BG_SLOT, page)) hal_violations++;
+}
+
+// The download of the counter "counter", as rftool makes it
+static void bg_encrypt(uint16_t counter) {
+    uint32_t giv[2] = { counter, START_SIGNATURE };
+    xtea_encipher(giv, XTEA_KEY);
+    memcpy(session_iv, giv, sizeof(session_iv));
+    encrypt_upload(session_iv);
+    encrypt_ctr(session_iv);
+}
+
+// The counter rfboot_api.h reports ('C'), from DATA_PAGE
+static uint16_t bg_counter(void) {
+    return get16(hal_flash+HAL_RWW_END-HAL_SPM_PAGESIZE+6);
+}
+
+// The application resets after the download, rfboot installs it (or not)
+// and resets, and the application starts
+static int bg_reset(void) {
+    mcusr_mirror = _BV(WDRF);
+    hal_run(rfboot_entry, hal_now+UPLOAD_LIMIT);
+    mcusr_mirror = _BV(WDRF);
+    return hal_run(rfboot_entry, hal_now+UPLOAD_LIMIT);
+}
+
+static void background_install(int n) {
+    static const radio_link link = { receive, pass, NULL };
+    memset(result, 0, sizeof(*result));
+    result->reply = -1;
+    peer.state = P_DONE;
+    peer.rnd = seed*2654435761u + n + 1;
+    radio_set_link(&link);
+    // The application that runs now, uploaded by rftool (its size and the
+    // upload counter in DATA_PAGE), and the counter plus 1, as rftool asks for
+    memset(hal_flash, 0xff, sizeof(hal_flash));
+    for (int i=0; i<size; i++) hal_flash[i] = image[i]^0x55;
+    uint8_t* data_page = hal_flash+HAL_RWW_END-HAL_SPM_PAGESIZE;
+    put16(data_page, size);
+    put16(data_page+6, 41);
+    bg_encrypt(42);
+    result->corrupted = chance(loss_down);
+    if (result->corrupted) peer.enc[rnd()%size] ^= 1+rnd()%255;
+    hal_run(bg_download, UPLOAD_LIMIT);
+    uint64_t start = hal_now;
+    result->how = bg_reset();
+    // The application must not find the key or the round keys in RAM
+    if (result->how == HAL_APP_START) {
+        static const uint32_t zero[64];
+        if (memcmp(XTEA_KEY, zero, 16) || memcmp(xtea_rk, zero, sizeof(xtea_rk))) hal_violations++;
+    }
+    result->contact = start;
+    result->end = result->stop = hal_now;
+    result->flash_ok = !memcmp(hal_flash, image, size);
+    // Slot B is erased, installed or not
+    if (hal_flash[BG_SLOT] != 0xff) hal_violations++;
+    if (result->corrupted) {
+        for (int i=0; i<size; i++) {
+            if (hal_flash[i] != (image[i]^0x55)) {
+                hal_violations++;
+                break;
+            }
+        }
+    }
+    // rftool asks the application for the counter and uses the next one,
+    // for another application. The download of 42, recorded, must not
+    // bring back the first one after it
+    if (result->how == HAL_APP_START && result->flash_ok && !result->corrupted) {
+        result->replay_tested = true;
+        image[size-1] ^= 0xff;
+        bg_encrypt(bg_counter()+1);
+        hal_run(bg_download, UPLOAD_LIMIT);
+        result->next_installed = bg_reset() == HAL_APP_START && !memcmp(hal_flash, image, size);
+        image[size-1] ^= 0xff;
+        bg_encrypt(42);
+        hal_run(bg_download, UPLOAD_LIMIT);
+        result->replay_installed = bg_reset() == HAL_APP_START && !memcmp(hal_flash, image, size);
+    }
+    result->eeprom_ok = true;
+    result->violations = hal_violations;
+}
+
+static void upload(int n) {
+    static const radio_link link = { receive, pass, NULL };
+    memset(result, 0, sizeof(*result));
+    result->reply = -1;
+    peer.state = P_PING;
+    peer.rnd = seed*2654435761u + n + 1;
+    radio_set_link(&link);
+    memset(hal_flash, 0xff, sizeof(hal_flash));
+    // The EEPROM of the node has the image, with some bytes different
+    memcpy(hal_eeprom, eeprom_image, sizeof(hal_eeprom));
+    for (int i=0; i<eeprom_size; i++) {
+        if (chance(eeprom_change)) hal_eeprom[i] ^= 0x5a;
+    }
+    mcusr_mirror = _BV(EXTRF);
+    hal_event(PING_PERIOD, ping, NULL);
+    result->how = hal_run(rfboot_entry, UPLOAD_LIMIT);
+    result->stop = hal_now;
+    result->flash_ok = !memcmp(hal_flash, image, size);
+    result->eeprom_ok = !memcmp(hal_eeprom, eeprom_image, eeprom_size);
+    result->eeprom_writes = hal_eeprom_writes;
+    // rfboot gave up in the EEPROM : the application must not start
+    if (eeprom_size && !result->eeprom_ok && (hal_flash[0]!=0xff || hal_flash[1]!=0xff)) hal_violations++;
+    result->rfboot_tx = radio_rfboot_tx;
+    result->rfboot_missed = radio_rfboot_missed;
+    result->rx_turnaround = radio_rx_turnaround;
+    result->rx_turnarounds = radio_rx_turnarounds;
+    result->tx_turnaround = radio_tx_turnaround;
+    result->tx_turnarounds = radio_tx_turnarounds;
+    result->violations = hal_violations;
+    const uint8_t* data_page = hal_flash+HAL_RWW_END-HAL_SPM_PAGESIZE;
+    result->stats_saved = result->stats_got &&
+        !memcmp(data_page+STATS_FINISHED, result->stats, STATS_REC) &&
+        !memcmp(data_page+STATS_OFFSET+STATS_REC, result->stats+STATS_REC, STATS_LEN-STATS_REC);
+}
+
+// -g : the NACKs of a multicast upload, not the upload itself. The nodes
+// (random serial numbers) lost the same unit of a page at the same time,
+// and send RFB_SEND_PAGE in the slots of rfboot.c (node_hash, nack_next)
+// until usb2rf receives it, 9 times at most (rfboot resets then). A node
+// that hears a NACK (its sync word) waits until it ends, as cc1101_txStart,
+// and calibrates. The NACKs on the air at the same time are lost. At the
+// end every node sends the final reply once, after its slot in ms
+#define GROUP_MAX_NODES 64
+#define GROUP_NACKS 9
+#define GROUP_STEP (500*HAL_US)
+#define GROUP_RESULT_LEN 3
+
+typedef struct group_tx {
+    int node;
+    uint64_t start;
+    uint64_t end;
+    bool lost;
+} group_tx;
+
+// Sends the packet of "node" at "t", or later if another one is on the air.
+// Returns where it is in "tx", -1 if it waits until "*t"
+static int group_send(group_tx* tx, int* txs, int node, uint64_t* t, uint64_t air) {
+    bool fast = options & RFB_OPT_FAST;
+    for (int j=0; j<*txs; j++) {
+        if (tx[j].start+radio_sync_air_time(fast)<=*t && *t<tx[j].end) {
+            *t = tx[j].end + USB2RF_CAL;
+            return -1;
+        }
+    }
+    group_tx* p = tx + *txs;
+    p->node = node;
+    p->start = *t;
+    p->end = *t + air;
+    p->lost = false;
+    for (int j=0; j<*txs; j++) {
+        if (tx[j].end>*t) tx[j].lost = p->lost = true;
+    }
+    return (*txs)++;
+}
+
+static int group_nacks(void) {
+    static group_tx tx[GROUP_MAX_NODES*(GROUP_NACKS+1)*2];
+    uint16_t hash[GROUP_MAX_NODES], lcg[GROUP_MAX_NODES];
+    uint8_t slot[GROUP_MAX_NODES], sent[GROUP_MAX_NODES];
+    uint64_t next[GROUP_MAX_NODES];
+    // 0 waits, 1 rftool got the NACK, 2 gave up
+    uint8_t state[GROUP_MAX_NODES];
+    bool fast = options & RFB_OPT_FAST;
+    uint8_t fec = (options2 & RFB_OPT2_FEC) ? FEC_PKTLEN : 0;
+    uint64_t nack_air = radio_air_time(5, fast, fec);
+    uint64_t result_air = radio_air_time(GROUP_RESULT_LEN, fast, fec);
+    unsigned through=0, gave_up=0, collisions=0, results=0, same_hash=0;
+    double nacks=0, t_sum=0, t_max=0;
+    for (int n=0; n<uploads; n++) {
+        peer.rnd = seed*2654435761u + n + 1;
+        for (int k=0; k<group_nodes; k++) {
+            for (int a=0x0E; a<=0x17; a++) hal_signature[a] = rnd();
+            hash[k] = node_hash();
+            for (int j=0; j<k; j++) if (hash[j]==hash[k]) same_hash++;
+            // The first request of the page starts with i=40*10-1-nack_slot,
+            // the first NACK is at i=40*9
+            lcg[k] = hash[k];
+            slot[k] = nack_next(&lcg[k]);
+            next[k] = (39-slot[k])*GROUP_STEP;
+            sent[k] = 0;
+            state[k] = 0;
+        }
+        int txs = 0;
+        uint64_t last = 0;
+        while (true) {
+            int k = -1;
+            for (int j=0; j<group_nodes; j++) {
+                if (!state[j] && (k<0 || next[j]<next[k])) k = j;
+            }
+            if (k<0) break;
+            // The NACKs that ended before are through or lost
+            for (int j=0; j<txs; j++) {
+                if (tx[j].end<=next[k] && !tx[j].lost && !state[tx[j].node]) {
+                    state[tx[j].node] = 1;
+                    through++;
+                    if (tx[j].end>last) last = tx[j].end;
+                }
+            }
+            if (state[k]) continue;
+            if (sent[k]==GROUP_NACKS) {
+                state[k] = 2;
+                gave_up++;
+                continue;
+            }
+            int j = group_send(tx, &txs, k, &next[k], nack_air);
+            if (j<0) continue;
+            sent[k]++;
+            nacks++;
+            if (verbose) printf("round %d : node %d (hash %04x) NACK %d at %.2f ms\n", n, k, hash[k], sent[k], tx[j].start/1e6);
+            // rfboot.c : i stops for nack_wait steps, after 40 steps
+            slot[k] = nack_next(&lcg[k]);
+            next[k] = tx[j].end + (39+slot[k])*GROUP_STEP;
+        }
+        for (int j=0; j<txs; j++) if (tx[j].lost) collisions++;
+        t_sum += last/1e6;
+        if (last/1e6>t_max) t_max = last/1e6;
+        // The final replies, after the last packet of the upload
+        txs = 0;
+        for (int k=0; k<group_nodes; k++) {
+            next[k] = slot[k]*HAL_MS;
+            state[k] = 0;
+        }
+        for (int waiting=group_nodes; waiting; ) {
+            int k = -1;
+            for (int j=0; j<group_nodes; j++) {
+                if (!state[j] && (k<0 || next[j]<next[k])) k = j;
+            }
+            if (group_send(tx, &txs, k, &next[k], result_air)>=0) {
+                state[k] = 1;
+                waiting--;
+            }
+        }
+        for (int j=0; j<txs; j++) if (!tx[j].lost) results++;
+    }
+    printf("%d multicast NACK rounds, %d nodes lost units of the same page, %s%s\n", uploads, group_nodes,
+        fast ? "fast" : "default data rate", fec ? ", FEC" : "");
+    printf("NACKs through %u of %u, nodes that gave up %u, %.1f NACKs and %.1f collisions per round\n",
+        through, uploads*group_nodes, gave_up, nacks/uploads, (double)collisions/uploads);
+    printf("last NACK through ms : mean %.1f max %.1f, nodes with the same hash %u\n",
+        t_sum/uploads, t_max, same_hash);
+    printf("final replies through %u of %u\n", results, uploads*group_nodes);
+    return through*100.0 >= min_ok*uploads*group_nodes ? 0 : 1;
+}
+
+int main(int argc, char* argv[]) {
+    int c;
+    while ( (c = getopt(argc, argv, "n:o:f:s:e:E:l:u:r:d:m:S:bg:v")) != -1 ) {
+        switch (c) {
+        case 'n': uploads = atoi(optarg); break;
+        case 'o': options = strtol(optarg, NULL, 0); break;
+        case 'f': options2 = strtol(optarg, NULL, 0); break;
+        case 's': size = atoi(optarg); break;
+        case 'e': eeprom_size = atoi(optarg); break;
+        case 'E': eeprom_change = atof(optarg); break;
+        case 'l': loss_down = atof(optarg); break;
+        case 'u': loss_up = atof(optarg); break;
+        case 'r': reorder = atof(optarg); break;
+        case 'd': duplicate = atof(optarg); break;
+        case 'm': min_ok = atof(optarg); break;
+        case 'S': seed = atoi(optarg); break;
+        case 'b': background = true; break;
+        case 'g': group_nodes = atoi(optarg); break;
+        case 'v': verbose = true; break;
+        default:
+            fprintf(stderr, "usage: %s [-n uploads] [-o options] [-f options2] [-s size] [-e size] [-E change%%] [-l loss%%] [-u loss%%] [-r reorder%%] [-d duplicate%%] [-m ok%%] [-S seed] [-b] [-g nodes] [-v]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (group_nodes) {
+        if (!node_hash) {
+            fprintf(stderr, "The multicast NACKs need make FEATURES=-DRFBOOT_MULTICAST\n");
+            return 2;
+        }
+        if (group_nodes<0 || group_nodes>GROUP_MAX_NODES) {
+            fprintf(stderr, "The nodes must be up to %d\n", GROUP_MAX_NODES);
+            return 2;
+        }
+        return group_nacks();
+    }
+    // The page CRCs and the map (delta upload), and the compression of
+    // rftool are not here
+    if (options & (RFB_OPT_DELTA|RFB_OPT_PACKED)) {
+        fprintf(stderr, "The delta upload and the compression are not supported\n");
+        return 2;
+    }
+    if (size<PAYLOAD || size>MAX_SIZE || size%PAYLOAD) {
+        fprintf(stderr, "The size must be a multiple of %d, up to %d\n", PAYLOAD, MAX_SIZE);
+        return 2;
+    }
+    if (eeprom_size<0 || eeprom_size>HAL_EEPROM_SIZE) {
+        fprintf(stderr, "The EEPROM size must be up to %d\n", HAL_EEPROM_SIZE);
+        return 2;
+    }
+    if (background && !rfboot_bg_write) {
+        fprintf(stderr, "The background download needs make FEATURES=-DRFBOOT_BACKGROUND\n");
+        return 2;
+    }
+    if (background && (size>BG_SLOT || eeprom_size)) {
+        fprintf(stderr, "The background download needs a size up to %d, and no EEPROM\n", BG_SLOT);
+        return 2;
+    }
+    if (background) options = RFB_OPT_CRC32;
+    if (eeprom_size) options2 |= RFB_OPT2_EEPROM;
+    #if HAL_FLASH_SIZE > 0x10000
+    // rfboot needs it on these MCUs, as rftool sets it
+    options2 |= RFB_OPT2_FAR;
+    #endif
+    make_image();
+    result = mmap(NULL, sizeof(*result), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (result == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    unsigned ok=0, flash_ok=0, failed=0, resets=0, timeouts=0, violations=0;
+    double t_sum=0, t_min=1e30, t_max=0;
+    double packets=0, requests=0, tx=0, missed=0, repaired=0, eeprom_writes=0;
+    unsigned eeprom_ok=0, rejected=0;
+    // -b : the downloads after an install, and the replays of the first one
+    unsigned replay_tests=0, next_installed=0, replays_installed=0;
+    // RFB_OPT2_STATS, as rfboot counts them
+    double duration=0, resends=0, crc_errors=0;
+    unsigned stats_got=0, stats_saved=0;
+    // The radio turnarounds (ns)
+    double rx_turnaround=0, tx_turnaround=0, rx_turnarounds=0, tx_turnarounds=0;
+    for (int n=0; n<uploads; n++) {
+        pid_t pid = fork();
+        if (pid<0) {
+            perror("fork");
+            return 1;
+        }
+        if (pid==0) {
+            if (background) background_install(n);
+            else upload(n);
+            _exit(0);
+        }
+        int status;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+            fprintf(stderr, "upload %d : the process failed\n", n);
+            return 1;
+        }
+        if (result->flash_ok) flash_ok++;
+        if (result->eeprom_ok) eeprom_ok++;
+        eeprom_writes += result->eeprom_writes;
+        if (result->how == HAL_TIMEOUT) timeouts++;
+        violations += result->violations;
+        packets += result->packets;
+        requests += result->requests;
+        repaired += result->repaired;
+        if (result->stats_got) {
+            stats_got++;
+            duration += get16(result->stats)*100.0;
+            resends += get16(result->stats+2);
+            crc_errors += result->stats[4];
+        }
+        if (result->stats_saved) stats_saved++;
+        tx += result->rfboot_tx;
+        missed += result->rfboot_missed;
+        rx_turnaround += result->rx_turnaround;
+        rx_turnarounds += result->rx_turnarounds;
+        tx_turnaround += result->tx_turnaround;
+        tx_turnarounds += result->tx_turnarounds;
+        if (result->replay_tested) {
+            replay_tests++;
+            if (result->next_installed) next_installed++;
+            if (result->replay_installed) replays_installed++;
+        }
+        if (background && result->corrupted && result->how == HAL_APP_START && !result->violations) {
+            // The application that was running starts again
+            rejected++;
+        }
+        else if (background ? (result->how == HAL_APP_START && result->flash_ok && !result->violations) :
+        (result->reply == RFB_SUCCESS && result->flash_ok && result->eeprom_ok)) {
+            double t = (result->end - result->contact)/1e6;
+            ok++;
+            t_sum += t;
+            if (t<t_min) t_min = t;
+            if (t>t_max) t_max = t;
+        }
+        else {
+            failed++;
+            if (result->how == HAL_RESET) resets++;
+            if (verbose) fprintf(stderr, "upload %d : end %d at %.1f ms, reply %d flash %s\n", n, result->how, result->stop/1e6, result->reply, result->flash_ok ? "OK" : "different");
+        }
+    }
+
+    if (background) {
+        printf("%d background downloads of %d bytes, %.1f%% corrupted\n", uploads, size, loss_down);
+        printf("installed %u, corrupted and not installed %u, failed %u, HAL violations %u\n",
+            ok, rejected, failed, violations);
+        // From the reset of the application to the start of the new one
+        if (ok) printf("downtime ms : mean %.1f min %.1f max %.1f\n", t_sum/ok, t_min, t_max);
+        printf("after %u installs : next download installed %u, recorded download installed again %u\n",
+            replay_tests, next_installed, replays_installed);
+        return (ok+rejected==(unsigned)uploads && next_installed==replay_tests && !replays_installed) ? 0 : 1;
+    }
+    printf("%d uploads of %d bytes, options %d/%d, loss %.1f%% to rfboot %.1f%% from rfboot, reorder %.1f%%\n",
+        uploads, size, options, options2, loss_down, loss_up, reorder);
+    // A reset of rfboot (it lost the contact) ends the upload, rftool
+    // would start it again
+    printf("success %u, flash OK %u, failed %u (%u rfboot resets, %u timeouts), HAL violations %u\n",
+        ok, flash_ok, failed, resets, timeouts, violations);
+    if (ok) {
+        double mean = t_sum/ok;
+        printf("upload time ms : mean %.1f min %.1f max %.1f, %.0f bytes/s\n",
+            mean, t_min, t_max, size*1000.0/mean);
+    }
+    printf("per upload : %.1f packets to rfboot (%.1f missed), %.1f requests, %.1f packets from rfboot\n",
+        packets/uploads, missed/uploads, requests/uploads, tx/uploads);
+    // Until the CC1101 receives again. Calibrating from IDLE, or nothing
+    // with RFBOOT_AUTO_RX
+    if (rx_turnarounds && tx_turnarounds) {
+        printf("radio turnaround us : %.1f after a packet to rfboot, %.1f after a packet from rfboot\n",
+            rx_turnaround/1e3/rx_turnarounds, tx_turnaround/1e3/tx_turnarounds);
+    }
+    if (eeprom_size) printf("EEPROM of %d bytes : OK %u, %.1f bytes written per upload\n", eeprom_size, eeprom_ok, eeprom_writes/uploads);
+    if (options2 & RFB_OPT2_PARITY) printf("per upload : %.1f packets rebuilt from the parity packets\n", repaired/uploads);
+    if ((options2 & RFB_OPT2_STATS) && stats_got) {
+        printf("telemetry of %u uploads (%u in DATA_PAGE) : %.1f resends, %.1f CRC errors, %.0f ms\n",
+            stats_got, stats_saved, resends/stats_got, crc_errors/stats_got, duration/stats_got);
+    }
+    return ok*100.0 >= min_ok*uploads ? 0 : 1;
+}
@@ -0,0 +1,8 @@
+// Fixed settings for the host build (host/Makefile). Never use them
+// for a real bootloader, rftool creates random ones for every project.
+// XTEA_KEY is not const here : rfboot.c erases it before the application
+// starts, which is fine in the atmega RAM but not in the host .rodata
+const uint8_t RFBOOT_CHANNEL = 0;
+const uint8_t RFBOOT_SYNCWORD[] = {110,43};
+uint32_t XTEA_KEY[] = {0x6c1f2d3a, 0x93b4e805, 0x2a7c41d9, 0xe05b96f3};
+const uint32_t PING_SIGNATURE = 0x5a3c96e1u;
@@ -30,7 +30,6 @@
  * https://github.com/pkarsy/rfboot/blob/master/help/Encryption.md
  *
  * TODO cc1101 reset before app start
- * TODO if cc1101 is not detected proceed immediatelly to application code
  * */
 
 #include <avr/io.h>
@@ -42,14 +41,59 @@
 #include <avr/pgmspace.h>
 
 #include <avr/wdt.h>
+#include <avr/eeprom.h>
 #include <util/atomic.h>
 #include <util/crc16.h>
+#include <stddef.h>
 
 #include "xtea.h"
 
+// The simavr benchmark (sim/Makefile) counts the cycles between these
+// markers. Without RFBOOT_SIM they are empty
+#ifdef RFBOOT_SIM
+#include "sim_marks.h"
+#else
+#define SIM_MARK(m)
+#endif
+
+// The host build (host/Makefile) runs this file on Linux, with the
+// avr-libc headers of host/include. The application start and the wait
+// for the watchdog reset end the run there
+#ifdef RFBOOT_HOST
+#define start_app() hal_start_app()
+#define wait_watchdog() hal_wait_watchdog()
+#else
+#define start_app() asm("jmp 0")
+#define wait_watchdog() while(1)
+#endif
+
 
 #define byte uint8_t
 
+// Flash addresses. The atmega1284p and the atmega2560 have more than 64KB
+// of flash, which is read with ELPM (the _far functions set RAMPZ). The
+// SPM macros of avr/boot.h use RAMPZ by themselves on these MCUs
+#if FLASHEND > 0xffff
+#define RFBOOT_FAR
+// The upload needs window mode (RFB_OPT2_FAR), and the 8KB section has
+// room for it and the CRC32 without WINDOW=1 and CRC32=1
+#ifndef RFBOOT_WINDOW
+#define RFBOOT_WINDOW
+#endif
+#ifndef RFBOOT_CRC32
+#define RFBOOT_CRC32
+#endif
+typedef uint32_t addr_t;
+#define flash_read(addr) pgm_read_byte_far(addr)
+#define flash_memcpy(dst, addr, n) memcpy_PF(dst, addr, n)
+#define flash_memcmp(s, addr, n) memcmp_PF(s, addr, n)
+#else
+typedef uint16_t addr_t;
+#define flash_read(addr) pgm_read_byte(addr)
+#define flash_memcpy(dst, addr, n) memcpy_P(dst, (const void*)(uintptr_t)(addr), n)
+#define flash_memcmp(s, addr, n) memcmp_P(s, (const void*)(uintptr_t)(addr), n)
+#endif
+
 
 // Parameters that are different in every rfboot project
 // RF Channel , Syncword , XTEA key
@@ -61,6 +105,31 @@
 // long packets have greater probability to be corrupted
 #define PAYLOAD 32
 
+// Window mode packets contain 1 to PAGE_UNITS units of 16 bytes (2 XTEA blocks).
+// They start with 32 bytes (PAYLOAD) and rfboot asks for 48 bytes
+// after LONG_PKT_COUNT packets with RSSI and LQI better than below,
+// and for the whole SPM page in one packet after LONG_PKT_COUNT more.
+// The first CRC error or lost packet brings them back to 32 bytes.
+// A packet never crosses an SPM page, so 56 byte packets (7 blocks)
+// would need 3 packets per SPM page, the same as 48.
+// Packets longer than the CC1101 FIFO are read while they arrive
+// (cc1101_receiveData). usb2rf before version 5 sends 48 bytes at most
+#define UNIT 16
+#define LONG_PKT_UNITS 3
+#define PAGE_UNITS (SPM_PAGESIZE/UNIT)
+// The longest packet is 8 units (130 bytes). The SPM pages of 256 bytes
+// are sent in 2 packets, as the length byte of the CC1101 is 255 at most
+#if SPM_PAGESIZE > 8*UNIT
+#define MAX_PKT_UNITS 8
+#else
+#define MAX_PKT_UNITS PAGE_UNITS
+#endif
+#define LONG_PKT_COUNT 8
+// RSSI register value, about -80dBm
+#define LONG_PKT_RSSI (-12)
+// LQI is lower for better links
+#define LONG_PKT_LQI 16
+
 // this is a random enough number contained in the first packet.
 // the programmer sends it and rfboot requires this number to be
 // in the start of the header in order to continue. This protects
@@ -74,34 +143,268 @@
 #define XTEA_BLOCK_SIZE 8
 
 // rfboot is designed to be a little smaller than this size
-// AVR FUSES for this bootloader size are set from Makefile
+// AVR FUSES for this bootloader size are set from Makefile. The Makefile
+// sets 8192 for the MCUs with more than 64KB of flash
+#ifndef BOOTLOADER_SECTION_SIZE
 #define BOOTLOADER_SECTION_SIZE 4096
+#endif
 
 // this is the structure of the first packet and contains the header.
-// Total is 11 bytes. the other 21 bytes are unused.
-// TODO require the 21 bytes to be 0
-struct start_packet {
+// Total is 29 bytes. the other 3 bytes are unused.
+// TODO require the 11 bytes to be 0
+// Packed for the host build (host/), the AVR has no padding anyway
+struct __attribute__ ((__packed__)) start_packet {
     uint32_t start_signature1;
     uint16_t app_size;
     uint16_t app_crc;
     uint16_t app_crc2;
     uint16_t counter;
     uint32_t start_signature2;
+    // Earlier rftool versions send 0 here, and earlier rfboot versions
+    // ignore this byte. So an option is used only if both sides know about it.
+    uint8_t options;
+    // Only with RFB_OPT_CRC32
+    uint32_t app_crc32;
+    // More options, as "options" above. Earlier rftool versions send 0
+    uint8_t options2;
+    // Bits 16-23 of app_size, with RFB_OPT2_FAR
+    uint8_t app_size_hi;
+    // The bytes of the EEPROM image, with RFB_OPT2_EEPROM
+    uint16_t eeprom_size;
+    // app_crc32 continued with the EEPROM image, see RFB_OPT2_EEPROM
+    uint32_t eeprom_crc32;
+};
+
+// Option bits for start_packet.options
+// rftool sets RFB_OPT_WINDOW if the usb2rf module can send all packets of an
+// SPM page back to back. rfboot then requests pages (RFB_SEND_PAGE) instead
+// of packets (RFB_SEND_PKT) and rftool knows the option is accepted.
+const uint8_t RFB_OPT_WINDOW = 1;
+// Delta upload (needs window mode). rfboot reports a CRC16 for every SPM page
+// already in flash (RFB_PAGE_HASH) and asks for the page map (RFB_SEND_MAP).
+// Then it requests only the pages the map contains.
+const uint8_t RFB_OPT_DELTA = 2;
+// Compressed upload (needs window mode). The packets contain the LZ compressed
+// application (see lz_feed), which rfboot decompresses into the flash.
+// The packets are requested as they were the last bytes of the application,
+// and the first 2 bytes of the stream are the bytes rftool sends (packed_end)
+// Only if rfboot is compiled with COMPRESSION=1 (hardware_settings.mk)
+const uint8_t RFB_OPT_PACKED = 4;
+
+// Every SPM page is read back and compared after it is written, and
+// rewritten if needed. The whole application is checked with
+// app_crc32 (calculated while the pages are checked) instead of the 2 CRC16.
+// Works with the packet by packet upload too
+const uint8_t RFB_OPT_CRC32 = 8;
+// Resume an interrupted upload (needs window mode). If the application is the
+// same as the last upload (size and CRCs in DATA_PAGE), rfboot reports the
+// pages already written (RFB_RESUME_MAP) and asks for the page map
+// (RFB_SEND_MAP) as with the delta upload, which is not used.
+// rfboot accepts the option only if the application is the same
+const uint8_t RFB_OPT_RESUME = 16;
+// Fast modem settings (cc1101_setFastModem) after the handshake. rfboot
+// sends RFB_FAST with the new settings until rftool (usb2rf) answers with
+// the same 3 byte packet. If rftool does not answer, rfboot goes back to
+// the default settings and continues without the option.
+// Needs window mode
+const uint8_t RFB_OPT_FAST = 32;
+// The application packets use CTR mode instead of CBC (the header and the
+// page map are still CBC). The keystream of the 8 byte block at flash
+// address "a" is xtea_decipher({iv[0], iv[1]^a}), with the IV rfboot sends.
+// rfboot calculates it while it waits for packets, and decrypts with XOR.
+// Needs window mode
+const uint8_t RFB_OPT_CTR = 64;
+// Multicast upload to many nodes with the same key (needs window mode).
+// rftool starts it with a group ping, which contains the IV of the session
+// (see the ping below), and the nodes do not answer. rftool sends every page
+// once, and the nodes send RFB_SEND_PAGE only for the units they lost (a NACK
+// with the mask). rftool repeats the units of all NACKs it gets.
+// Delta upload, resume and the fast modem are not used, as they need answers.
+// Only if rfboot is compiled with MULTICAST=1 (hardware_settings.mk)
+const uint8_t RFB_OPT_GROUP = 128;
+
+// Option bits for start_packet.options2
+// The CC1101 hardware FEC (with interleaving) for the application packets.
+// The FEC needs fixed length packets (FEC_PKTLEN), so the window packets
+// have 32 bytes. After RFB_OPTIONS rfboot sends RFB_FEC with the FEC on
+// (and the fast settings with RFB_OPT_FAST) until rftool (usb2rf) answers
+// with the same 3 byte packet, instead of RFB_FAST. Needs window mode
+const uint8_t RFB_OPT2_FEC = 1;
+// usb2rf sends a parity packet after the packets of a page. It is the XOR
+// of the 32 byte packets of the page, and its idx is the start of the page
+// plus 1. If one packet of the page is lost, rfboot rebuilds it from the
+// others and the parity, without a request. The window packets have
+// 32 bytes. Needs window mode
+const uint8_t RFB_OPT2_PARITY = 2;
+// The MCUs with more than 64KB of flash (atmega1284p, atmega2560) and
+// SPM pages of 256 bytes. The application size has 24 bits (app_size_hi)
+// and RFB_SEND_PAGE has 7 bytes : the mask has 16 bits (the high byte is
+// the 6th byte) and the 7th byte is bits 16-23 of idx. The window packets
+// still start with the low 16 bits of idx, rfboot knows the rest, so the
+// packets are not longer. These rfboot builds need the option and window
+// mode, and do not support the delta upload, resume, compression and multicast
+const uint8_t RFB_OPT2_FAR = 4;
+// The EEPROM image (start_packet.eeprom_size bytes from address 0) after the
+// flash pages. rfboot requests its packets one by one with RFB_SEND_PKT,
+// from the last to the first, and rftool answers them itself (usb2rf
+// ends the page upload when it gets RFB_SEND_PKT), only if the application
+// passed its CRC32. As the window packets they start with the 16 bit idx
+// of the request (34 bytes, rftool sends them with the framed link), so a
+// late or repeated packet is ignored. The packets are CBC encrypted after the application
+// packets, and the EEPROM bytes, read back from the last to the first,
+// continue the CRC32 of the application (eeprom_crc32). Only the bytes that
+// differ are written (~3.3ms each). Needs window mode and RFB_OPT_CRC32
+const uint8_t RFB_OPT2_EEPROM = 8;
+// Link telemetry (TELEMETRY=1). The final reply (RFB_SUCCESS,
+// RFB_IDENTICAL_CODE, RFB_WRONG_CRC) has 4+8*STATS_HISTORY bytes : the
+// packets rebuilt from the parity (0 without RFB_OPT2_PARITY) and the
+// session records of DATA_PAGE, this upload first (struct session_stats).
+// The EEPROM requests (RFB_SEND_PKT) have 2 more bytes, the RSSI and the
+// LQI of the last packet we got. Needs window mode
+const uint8_t RFB_OPT2_STATS = 16;
+
+// The options this rfboot build accepts. If rftool asks for any option,
+// rfboot reports the accepted ones with RFB_OPTIONS, right after the header.
+// options2 is the high byte of RFB_OPTIONS
+// Without WINDOW=1 and CRC32=1 (hardware_settings.mk) rfboot has only the
+// packet by packet upload and the 2 CRC16, as the earlier versions, and
+// fits the 4096 bytes of the atmega328p with room to spare
+#if !defined(RFBOOT_WINDOW) && ( defined(RFBOOT_COMPRESSION) || defined(RFBOOT_MULTICAST) || \
+    defined(RFBOOT_FEC) || defined(RFBOOT_EEPROM) || defined(RFBOOT_TELEMETRY) || defined(RFBOOT_BACKGROUND) )
+#error "COMPRESSION, MULTICAST, FEC, EEPROM, TELEMETRY and BACKGROUND need WINDOW=1"
+#endif
+#if !defined(RFBOOT_CRC32) && ( defined(RFBOOT_EEPROM) || defined(RFBOOT_BACKGROUND) )
+#error "EEPROM and BACKGROUND need CRC32=1"
+#endif
+#ifdef RFBOOT_WINDOW
+#define RFB_WINDOW_OPTIONS (RFB_OPT_WINDOW|RFB_OPT_DELTA|RFB_OPT_RESUME|RFB_OPT_FAST|RFB_OPT_CTR)
+#else
+#define RFB_WINDOW_OPTIONS 0
+#endif
+#ifdef RFBOOT_CRC32
+#define RFB_CRC32_OPTIONS RFB_OPT_CRC32
+#else
+#define RFB_CRC32_OPTIONS 0
+#endif
+#ifdef RFBOOT_MULTICAST
+#define RFB_GROUP_OPTIONS RFB_OPT_GROUP
+#else
+#define RFB_GROUP_OPTIONS 0
+#endif
+#ifdef RFBOOT_FEC
+#define RFB_FEC_OPTIONS2 (RFB_OPT2_FEC|RFB_OPT2_PARITY)
+#else
+#define RFB_FEC_OPTIONS2 0
+#endif
+#ifdef RFBOOT_EEPROM
+#define RFB_EEPROM_OPTIONS2 RFB_OPT2_EEPROM
+#else
+#define RFB_EEPROM_OPTIONS2 0
+#endif
+#ifdef RFBOOT_TELEMETRY
+#define RFB_STATS_OPTIONS2 RFB_OPT2_STATS
+#else
+#define RFB_STATS_OPTIONS2 0
+#endif
+#if defined(RFBOOT_FAR) && defined(RFBOOT_BACKGROUND)
+#error "BACKGROUND is only supported on the atmega328p"
+#endif
+#ifdef RFBOOT_FAR
+#if defined(RFBOOT_COMPRESSION) || defined(RFBOOT_MULTICAST)
+#error "COMPRESSION and MULTICAST are not supported on MCUs with more than 64KB of flash"
+#endif
+// The page CRCs and the page map have one byte per page (delta upload, resume)
+#define RFB_SUPPORTED_OPTIONS (RFB_OPT_WINDOW|RFB_OPT_CRC32|RFB_OPT_FAST|RFB_OPT_CTR)
+#define RFB_SUPPORTED_OPTIONS2 (RFB_FEC_OPTIONS2|RFB_EEPROM_OPTIONS2|RFB_STATS_OPTIONS2|RFB_OPT2_FAR)
+#elif defined(RFBOOT_COMPRESSION)
+#define RFB_SUPPORTED_OPTIONS (RFB_WINDOW_OPTIONS|RFB_OPT_PACKED|RFB_CRC32_OPTIONS|RFB_GROUP_OPTIONS)
+#define RFB_SUPPORTED_OPTIONS2 (RFB_FEC_OPTIONS2|RFB_EEPROM_OPTIONS2|RFB_STATS_OPTIONS2)
+#else
+#define RFB_SUPPORTED_OPTIONS (RFB_WINDOW_OPTIONS|RFB_CRC32_OPTIONS|RFB_GROUP_OPTIONS)
+#define RFB_SUPPORTED_OPTIONS2 (RFB_FEC_OPTIONS2|RFB_EEPROM_OPTIONS2|RFB_STATS_OPTIONS2)
+#endif
+
+// In window mode every 16 byte unit of an SPM page is one bit in a mask.
+// bit 0 is the unit with the lowest flash address.
+// "idx" is the flash address where the unit ends, exactly as
+// RFB_SEND_PKT uses it.
+#define UNIT_BIT(idx) (1u<<(((idx)-1)%SPM_PAGESIZE/UNIT))
+// All units of the SPM page, up to (and including) the unit "idx".
+// Only the first page rftool sends (the last in flash) can be partially filled
+#define PAGE_MASK(idx) ((UNIT_BIT(idx)<<1)-1)
+// The masks have 16 bits with SPM pages of 256 bytes
+#if PAGE_UNITS > 8
+typedef uint16_t mask_t;
+#else
+typedef uint8_t mask_t;
+#endif
+
+// A RFB_PAGE_HASH packet contains up to 28 CRC16 (61 bytes at most).
+// With FEC=1 up to 15, to fit in the FEC packets (see FEC_PKTLEN)
+#ifdef RFBOOT_FEC
+#define HASHES_PER_PKT 15
+#else
+#define HASHES_PER_PKT 28
+#endif
+
+#ifdef RFBOOT_TELEMETRY
+// One upload, as rfboot saw the link (TELEMETRY=1). DATA_PAGE keeps the
+// last STATS_HISTORY of them, and the final reply reports them all
+struct session_stats {
+    // From the header to the final reply, in 100ms units
+    uint16_t duration;
+    // The requests we repeated after a timeout (lost packets)
+    uint16_t resends;
+    // Packets with a wrong CRC, up to 255
+    uint8_t crc_errors;
+    // The weakest packet, the CC1101 RSSI register
+    int8_t rssi;
+    // The worst LQI (lower is better)
+    uint8_t lqi;
+    // RFB_SUCCESS, RFB_IDENTICAL_CODE or RFB_WRONG_CRC. STATS_STARTED if the
+    // upload did not finish, 0xff if the record was never used
+    uint8_t status;
 };
+// At most 3, so the final reply fits in a FEC packet (see FEC_PKTLEN)
+#define STATS_HISTORY 3
+// history[0] of an upload that did not finish
+#define STATS_STARTED 0x7f
+#endif
 
 struct flash_info_struct {
     //uint16_t signature;
-    uint16_t app_size;
+    addr_t app_size;
     uint16_t app_crc;
     uint16_t app_crc2;
     uint16_t counter;
+    // The SPM pages not written yet, in the same format as page_map.
+    // The page map of the upload, todo_done has the bytes done since
+    byte todo[28];
+    #ifdef RFBOOT_TELEMETRY
+    // The last uploads, the latest first. Earlier rfboot versions left it 0xff
+    struct session_stats history[STATS_HISTORY];
+    // The record of this upload when it finishes (stats_save), 0xff before.
+    // history[0] is STATS_STARTED then
+    struct session_stats finished;
+    #endif
+    // 0 when all pages of the same byte of todo are written. The journal
+    // is not erased after data_write : each word is programmed once, in
+    // the 0xff left by the erase (at most 28 writes of DATA_PAGE for an
+    // upload, instead of one for every page). The page has 10000 erase
+    // cycles, one for each upload. Earlier rfboot versions left it 0xff
+    uint16_t todo_done[28];
 } data;
 
 byte last_page_buf[SPM_PAGESIZE];
+
+// One bit per SPM page, set if rftool is going to send this page.
+// Without delta upload all pages are sent.
+// The map packet is 28 bytes + START_SIGNATURE, enough for 224 pages
+byte page_map[PAYLOAD-4];
 //memcpy_P( last_page_buf, FLASHEND+1-sizeof(last_page_buf), SPM_PAGESIZE );
-const uint16_t BOOTLOADER_ADDR = FLASHEND-BOOTLOADER_SECTION_SIZE+1;
+const addr_t BOOTLOADER_ADDR = FLASHEND-BOOTLOADER_SECTION_SIZE+1;
 
-const uint16_t DATA_PAGE = FLASHEND - BOOTLOADER_SECTION_SIZE +1 - SPM_PAGESIZE;
+const addr_t DATA_PAGE = FLASHEND - BOOTLOADER_SECTION_SIZE +1 - SPM_PAGESIZE;
 
 //const last_page_addr = FLASHEND-BOOTLOADER_SECTION_SIZE+1-SPM_PAGESIZE;
 //struct flash_info_struct *flash_info=FLASHEND+1-sizeof(struct flash_info_struct);
@@ -116,6 +419,13 @@ const uint8_t RFB_IDENTICAL_CODE = 3;
 const uint8_t RFB_SEND_PKT = 4;
 const uint8_t RFB_WRONG_CRC=5;
 const uint8_t RFB_SUCCESS=6;
+const uint8_t RFB_SEND_PAGE=7;
+const uint8_t RFB_PAGE_HASH=8;
+const uint8_t RFB_SEND_MAP=9;
+const uint8_t RFB_OPTIONS=10;
+const uint8_t RFB_RESUME_MAP=11;
+const uint8_t RFB_FAST=12;
+const uint8_t RFB_FEC=13;
 
 // rfboot approach to start the application code is to trigger a Watchdog Reset
 // and after this the application
@@ -151,6 +461,10 @@ volatile uint8_t previous_reset_cause __attribute__ ((section (".noinit")));
 //  __asm__ __volatile__ ("mov r2, %0\n" :: "r" (mcusr_mirror));
 // inside function reset_mcu();
 // right before jmp
+#ifdef RFBOOT_HOST
+// The host sets it before every run
+uint8_t mcusr_mirror;
+#else
 register uint8_t mcusr_mirror asm("r2") __attribute__ ((section (".noinit")));
 
 // recommended code from avr-libc documentation
@@ -160,6 +474,7 @@ void get_mcusr(void) {
     mcusr_mirror = MCUSR;
     MCUSR = 0;
 }
+#endif
 
 //#ifdef USE_ENTROPY
 //    #include "entropy.h"
@@ -169,22 +484,100 @@ void get_mcusr(void) {
 
 // a flag that a wireless packet has been received
 
+#ifdef RFBOOT_HOST
+// Every read lets the (virtual) time pass, and the interrupt come
+#define data_ready (*hal_int0_flag())
+#else
 register bool data_ready asm("r3") __attribute__ ((section (".noinit")));
+#endif
 
 // in this packet we store data coming from RF
 CCPACKET ccpacket __attribute__ ((section (".noinit")));
 uint8_t* packet = ccpacket.data;
 
-// Generated by CC1101 when receives SyncWord (or sends a packet)
+// One of our packets is on the air (tx_start), until the interrupt at
+// its end. Then the CC1101 is in RX by itself (MCSM1 TXOFF_MODE), and
+// until then nothing else uses it. tx_done : the packet ended and
+// tx_poll did not check the TX FIFO yet
+#ifdef RFBOOT_HOST
+#define tx_pending (*hal_tx_flag())
+#else
+volatile bool tx_pending;
+#endif
+volatile bool tx_done;
+
+// Generated by CC1101 at the end of a packet, received or sent
 ISR (INT0_vect)
 {
     /* interrupt code here */
-    data_ready = true;
+    if (tx_pending) {
+        tx_pending = false;
+        tx_done = true;
+    }
+    else data_ready = true;
 }
 
-#define get_data() cc1101_receiveData(&ccpacket)
+// Called while waiting, as flash_poll. After a TX FIFO underflow the
+// CC1101 does not return to RX, cc1101_txEnd flushes the FIFO. Normally
+// it only reads TXBYTES
+void tx_poll(void) {
+    if (tx_done) {
+        tx_done = false;
+        cc1101_txEnd();
+    }
+}
+
+#define tx_wait() do { while (tx_pending) ; tx_poll(); } while (0)
+
+static inline uint8_t get_data(void) {
+    tx_wait();
+    return cc1101_receiveData(&ccpacket);
+}
+
+// With FAST_BOOT=1 (hardware_settings.mk) after a power-on or brown-out
+// reset rfboot listens only this time (ms). If there is no carrier and no
+// packet, the application starts immediately. rftool pings every ~10ms
+#ifndef FAST_BOOT_MS
+#define FAST_BOOT_MS 15
+#endif
+
+// Every start of the application erases the key and the round keys of
+// xtea_set_key first. Althrough XTEA_KEY is read only, the RAM can be
+// written, as atmega does not enforce any RAM protection
+void key_wipe(void) {
+    memset((void*)XTEA_KEY,0,sizeof(XTEA_KEY));
+    memset(xtea_rk,0,sizeof(xtea_rk));
+}
+
+// Starts the application without the watchdog reset, when there is no
+// reason to wait for rftool. We restore what rfboot changed
+// (SPI, INT0, interrupt vectors), everything else is still at reset state.
+// mcusr_mirror ("r2") already contains the reset cause
+void fast_start(void) __attribute__ ((__noreturn__));
+void fast_start(void) {
+    // No application, we wait for the watchdog as before
+    if (pgm_read_word(0) == 0xffff) wait_watchdog();
+    cli();
+    EIMSK = 0;
+    EICRA = 0;
+    EIFR = _BV(INTF0);
+    SPCR = 0;
+    SPSR = 0;
+    PORTB = 0;
+    DDRB = 0;
+    MCUCR = (1<<IVCE);
+    MCUCR = 0;
+    // The same as the normal application start, see main()
+    reset_origin = 0;
+    key_wipe();
+    start_app();
+    while(1);
+}
 
 void radio_init(void) {
+    spi_init();
+    // Without a CC1101 there is nothing to wait for
+    if (!cc1101_detect()) fast_start();
     cc1101_init();
     // default is 433Mhz
     cc1101_setChannel(RFBOOT_CHANNEL);
@@ -207,28 +600,165 @@ void radio_init(void) {
 // in and out packets
 // TODO low priority
 CCPACKET outpkt;
-void send_pkt(uint8_t msg, uint16_t data) {
 
-    outpkt.length=3;
+void flash_poll(void);
+
+// The packet goes to the TX FIFO and we return while it is on the air,
+// outpkt can be used again. Where we use the CC1101 after it, we wait
+// for the end (tx_wait). If the last packet is still on the air, the
+// SPM work goes on while we wait for it. The next packet is not loaded
+// into the TX FIFO before that : cc1101_txEnd takes bytes left in the FIFO
+// for an underflow, and usb2rf streams page packets longer than the FIFO
+void tx_start(uint8_t len) {
+    while (tx_pending) flash_poll();
+    tx_poll();
+    // After a packet we received the CC1101 calibrates for ~800us before
+    // RX, and if a packet is arriving it does not transmit (CCA). We try
+    // again until it is in RX and the channel is clear
+    while (! cc1101_txStart(outpkt.data, len));
+    tx_pending = true;
+}
+
+void send_outpkt(uint8_t len) {
+    tx_start(len);
+    tx_wait();
+}
+
+// The requests do not wait for the end of the packet. In the upload
+// we decrypt and write the last packet while the next request is on the air
+void send_pkt(uint8_t msg, uint16_t data) {
     outpkt.data[0]= msg ;
     outpkt.data[1]= data & 0xff ;
     outpkt.data[2]= data >> 8 ;
-    cc1101_sendData(outpkt);
-    while (! data_ready);
-    data_ready = false;
+    tx_start(3);
+}
+
+#ifdef RFBOOT_WINDOW
+// The units a window packet can contain (see LONG_PKT_UNITS)
+uint8_t units = PAYLOAD/UNIT;
+uint8_t good_pkts;
+#else
+const uint8_t units = PAYLOAD/UNIT;
+#endif
+
+// With RFB_OPT2_FEC and RFB_OPT2_PARITY the packets have always 32 bytes
+#ifdef RFBOOT_FEC
+bool short_pkts;
+#else
+const bool short_pkts = false;
+#endif
+
+#ifdef RFBOOT_WINDOW
+void link_lost(void) {
+    good_pkts = 0;
+    units = PAYLOAD/UNIT;
 }
 
+#ifdef RFBOOT_TELEMETRY
+// TELEMETRY=1. The upload we receive now
+struct session_stats stats;
+// Timer1 runs at F_CPU/1024 during the upload, and we count its 100ms
+// steps with every packet and request. It wraps after ~8 sec at 8MHz, and
+// we never wait so long
+#define CLOCK_TICKS (F_CPU/1024/10)
+uint16_t clock_last;
+
+void clock_poll(void) {
+    while ( (uint16_t)(TCNT1-clock_last) >= CLOCK_TICKS ) {
+        clock_last += CLOCK_TICKS;
+        stats.duration++;
+    }
+}
+
+// With the header, the first packet of the upload
+void stats_start(void) {
+    TCCR1B = _BV(CS12)|_BV(CS10);
+    clock_last = TCNT1;
+    stats.rssi = ccpacket.rssi;
+    stats.lqi = ccpacket.lqi;
+}
+
+// Called for every packet we get after the header
+void stats_packet(void) {
+    if (!ccpacket.crc_ok && stats.crc_errors<255) stats.crc_errors++;
+    if ((int8_t)ccpacket.rssi < stats.rssi) stats.rssi = ccpacket.rssi;
+    if (ccpacket.lqi > stats.lqi) stats.lqi = ccpacket.lqi;
+    clock_poll();
+}
+
+// A request we send again, as we got nothing
+void stats_resend(void) {
+    stats.resends++;
+    clock_poll();
+}
+#endif
+
+// Called for every packet we get while receiving the application
+void link_quality(void) {
+    #ifdef RFBOOT_TELEMETRY
+    stats_packet();
+    #endif
+    if ( ccpacket.crc_ok && ((int8_t)ccpacket.rssi > LONG_PKT_RSSI) &&
+    (ccpacket.lqi < LONG_PKT_LQI) && !short_pkts ) {
+        if (good_pkts < 2*LONG_PKT_COUNT) good_pkts++;
+        if (good_pkts >= LONG_PKT_COUNT) units = LONG_PKT_UNITS;
+        if (good_pkts >= 2*LONG_PKT_COUNT) units = MAX_PKT_UNITS;
+    }
+    else link_lost();
+}
+
+// Window mode request. "mask" has the units of the SPM page
+// (ending at "idx") rfboot still needs. usb2rf sends them back to back
+// in packets of "units" units at most.
+void send_page(addr_t idx, mask_t mask) {
+    outpkt.data[3]= mask ;
+    outpkt.data[4]= units ;
+    outpkt.data[0]= RFB_SEND_PAGE ;
+    outpkt.data[1]= idx & 0xff ;
+    outpkt.data[2]= idx >> 8 ;
+    #ifdef RFBOOT_FAR
+    // RFB_OPT2_FAR
+    outpkt.data[5]= mask >> 8 ;
+    outpkt.data[6]= idx >> 16 ;
+    tx_start(7);
+    #else
+    tx_start(5);
+    #endif
+}
+
+// When both sides change the radio settings (RFB_OPT_FAST, RFB_OPT2_FEC).
+// We send "msg" every 20ms until rftool (usb2rf) answers with the same
+// 3 byte packet. false if there is no answer in ~300ms
+bool wait_echo(uint8_t msg) {
+    uint16_t i=40*15;
+    do {
+        if ( (i%40)==0) {
+            send_pkt(msg, 0);
+            // With the FEC the packet takes longer than 20ms
+            tx_wait();
+        }
+        if (data_ready) {
+            data_ready = false;
+            if ( (get_data()==3) && ccpacket.crc_ok && (packet[0]==msg) ) return true;
+        }
+        _delay_us(500);
+    } while (--i);
+    return false;
+}
+#endif
+
 void  send_iv(const uint32_t* iv) {
-    outpkt.length=8;
     memcpy(outpkt.data,(byte*)iv,8);
-    cc1101_sendData(outpkt);
-    while (! data_ready);
-    data_ready = false;
+    send_outpkt(8);
 }
 
 // Never returns, so "naked" and "noreturn" attributes don't hurt and reduce
 // code size
+#ifdef RFBOOT_HOST
+void reset_mcu() __attribute__ ((__noreturn__));
+#else
 void reset_mcu() __attribute__ ((naked))  __attribute__ ((__noreturn__));
+#endif
 void reset_mcu() {
 
     // rfboot will boot in a while
@@ -242,14 +772,30 @@ void reset_mcu() {
     // to the r2 register before it gives control to the application
     previous_reset_cause = mcusr_mirror;
 
+    // The last packet must end first
+    tx_wait();
     // we enable watchdog at 15ms
     wdt_enable(WDTO_15MS);
     // we stay here until watchdog resets MCU
-    while(1);
+    wait_watchdog();
+}
+
+// Returns where the first SPM page (from idx and below) rftool is going to
+// send ends. 0 means there is no such page. Without the delta upload
+// and resume (RFBOOT_FAR, no WINDOW=1) rftool sends every page
+addr_t next_page(addr_t idx) {
+    #if defined(RFBOOT_WINDOW) && !defined(RFBOOT_FAR)
+    while (idx) {
+        uint8_t p = (idx-1)/SPM_PAGESIZE;
+        if (page_map[p/8] & (1<<(p%8))) break;
+        idx = p*SPM_PAGESIZE;
+    }
+    #endif
+    return idx;
 }
 
 // we did it a function as we call the same thing a lot of times
-void page_erase(uint16_t page) {
+void page_erase(addr_t page) {
     ATOMIC_BLOCK(ATOMIC_FORCEON) {
         boot_spm_busy_wait();
         boot_page_erase(page);
@@ -264,6 +810,569 @@ void flash_read_enable() {
     }
 }
 
+// Writes "data" to DATA_PAGE
+void data_write(void) {
+    page_erase(DATA_PAGE);
+    ATOMIC_BLOCK(ATOMIC_FORCEON) {
+        boot_spm_busy_wait();
+        uint16_t *j=(uint16_t*)&data;
+        addr_t flash_idx = DATA_PAGE;
+        do {
+            boot_page_fill(flash_idx, *j);
+            flash_idx+=2;
+            j++;
+        } while( flash_idx< DATA_PAGE+sizeof(data) );
+        boot_spm_busy_wait();
+        boot_page_write(DATA_PAGE);
+    }
+}
+
+#ifdef RFBOOT_TELEMETRY
+// The record of this upload goes to data.finished, which data_write left
+// 0xff. Without erase, as todo_done, so DATA_PAGE is never without the counter
+void stats_save(uint8_t status) {
+    clock_poll();
+    stats.status = status;
+    data.history[0] = stats;
+    ATOMIC_BLOCK(ATOMIC_FORCEON) {
+        boot_spm_busy_wait();
+        uint8_t j=0;
+        do {
+            boot_page_fill(DATA_PAGE+offsetof(struct flash_info_struct, finished)+j, *(uint16_t*)((byte*)&stats+j));
+            j+=2;
+        } while (j<sizeof(stats));
+        boot_page_write(DATA_PAGE);
+        boot_spm_busy_wait();
+    }
+    flash_read_enable();
+}
+#endif
+
+// The SPM pages are programmed with double buffering. A full page moves
+// from out_buf to spm_buf, and is erased and written while we receive the
+// next page. Erase and write take ~4ms each, and rfboot can receive
+// packets only if it does not wait for them.
+byte out_buf[SPM_PAGESIZE];
+byte spm_buf[SPM_PAGESIZE];
+// The flash address of the page in spm_buf
+addr_t spm_addr;
+// What happens with the page in spm_buf
+const uint8_t SPM_IDLE = 0;
+const uint8_t SPM_ERASING = 1;
+const uint8_t SPM_WRITING = 2;
+const uint8_t SPM_MARKING = 3;
+uint8_t spm_state;
+// A page which fails the check is erased and written again, at most 3 times.
+// After this it is not added to flash_crc32, so the upload fails
+uint8_t spm_tries;
+
+#ifdef RFBOOT_CRC32
+// CRC32 (the same as zlib) of the application, from the last byte to the first.
+// Starts with 0xffffffff and rftool sends the inverted value
+uint32_t flash_crc32;
+
+uint32_t crc32_update(uint32_t crc, uint8_t b) {
+    crc ^= b;
+    for (uint8_t i=8; i; i--) {
+        crc = (crc>>1) ^ (0xEDB88320 & -(crc&1));
+    }
+    return crc;
+}
+
+// Adds the flash bytes from "to"-1 down to "from" to flash_crc32
+void crc_fold(addr_t from, addr_t to) {
+    while (to>from) {
+        to--;
+        flash_crc32 = crc32_update(flash_crc32, flash_read(to));
+    }
+}
+#endif
+
+// When the erase is finished we fill the SPM buffer and start the
+// write, and when the write is finished we check the page and mark it
+// as written in DATA_PAGE.
+// We do not wait for anything. Called while waiting for packets
+void flash_poll(void) {
+    if ( (spm_state==SPM_IDLE) || boot_spm_busy() ) return;
+    if (spm_state==SPM_MARKING) {
+        flash_read_enable();
+        spm_state = SPM_IDLE;
+    }
+    else if (spm_state==SPM_ERASING) {
+        // the following code is basically what avr-gcc documentation
+        // suggests
+        SIM_MARK(SIM_FILL);
+        ATOMIC_BLOCK(ATOMIC_FORCEON) {
+            // words, as a page of 256 bytes does not fit in uint8_t
+            uint8_t j=0;
+            do {
+                boot_page_fill(spm_addr+2*j, ((uint16_t*)spm_buf)[j]);
+                j++;
+            } while (j<SPM_PAGESIZE/2);
+            boot_page_write(spm_addr);
+        }
+        SIM_MARK(SIM_FILL+1);
+        spm_state = SPM_WRITING;
+    }
+    else {
+        // The page is written, we compare it with spm_buf
+        SIM_MARK(SIM_VERIFY);
+        flash_read_enable();
+        spm_state = SPM_IDLE;
+        if ( flash_memcmp(spm_buf, spm_addr, SPM_PAGESIZE) ) {
+            if (++spm_tries<=3) {
+                page_erase(spm_addr);
+                spm_state = SPM_ERASING;
+            }
+        }
+        else {
+            // The page is OK. We also add the pages rftool does not
+            // send (delta upload), down to the next page we write.
+            #ifdef RFBOOT_CRC32
+            addr_t end = spm_addr+SPM_PAGESIZE;
+            if (end>data.app_size) end=data.app_size;
+            crc_fold(next_page(spm_addr), end);
+            #endif
+            // We clear the bit of the page in data.todo, and write its
+            // word of todo_done when the byte is 0. The other words of
+            // the SPM buffer are 0xffff and do not change the flash.
+            // RFBOOT_FAR does not resume, and has more pages than bits
+            #if defined(RFBOOT_WINDOW) && !defined(RFBOOT_FAR)
+            uint8_t p = spm_addr/SPM_PAGESIZE;
+            data.todo[p/8] &= ~(1<<(p%8));
+            if (!data.todo[p/8]) {
+                ATOMIC_BLOCK(ATOMIC_FORCEON) {
+                    boot_page_fill(DATA_PAGE+offsetof(struct flash_info_struct, todo_done)+2*(p/8), 0);
+                    boot_page_write(DATA_PAGE);
+                }
+                spm_state = SPM_MARKING;
+            }
+            #endif
+        }
+        SIM_MARK(SIM_VERIFY+1);
+    }
+}
+
+// Waits until spm_buf can be used again
+void flash_sync(void) {
+    while (spm_state) flash_poll();
+}
+
+#ifdef RFBOOT_WINDOW
+// CTR mode (RFB_OPT_CTR). The IV we sent to rftool
+uint32_t ctr_iv[2];
+// The keystream block of flash address a is the encryption of
+// {ctr_iv[0] | CTR_DOMAIN, ctr_iv[1] ^ a}. The plain IVs are {counter, ...}
+// with a 16 bit counter, so a keystream block is never the encryption of
+// an IV and cannot be found from the IVs sent on the air
+#define CTR_DOMAIN 0x80000000UL
+// The keystream of the SPM page we receive (ks_page). It is ready from
+// ks_idx to the end of the page, and we calculate one block per call
+// while we wait for packets
+byte ks_buf[SPM_PAGESIZE];
+addr_t ks_page;
+addr_t ks_idx;
+
+bool ctr_poll(void) {
+    if (ks_idx==ks_page) return false;
+    ks_idx -= XTEA_BLOCK_SIZE;
+    uint32_t* block = (uint32_t*)(ks_buf+ks_idx-ks_page);
+    block[0] = ctr_iv[0] | CTR_DOMAIN;
+    block[1] = ctr_iv[1] ^ ks_idx;
+    xtea_encipher_rk(block);
+    return true;
+}
+#endif
+
+// The (decrypted and decompressed) application arrives here
+// byte by byte, from the last byte to the first.
+// out_idx is the flash location after the byte to be written, and becomes 0
+// when the last SPM page (the 0-127) is written.
+addr_t out_idx;
+
+void out_byte(uint8_t b) {
+    if (!out_idx) return;
+    out_idx--;
+    out_buf[out_idx%SPM_PAGESIZE] = b;
+    //
+    // Now we filled a full SPM page we have to burn it in flash
+    //
+    if (out_idx%SPM_PAGESIZE==0) {
+        // Normally the previous page is already written
+        flash_sync();
+        memcpy(spm_buf, out_buf, SPM_PAGESIZE);
+        spm_addr = out_idx;
+        // We erase the page unless it is the 0-127 page,
+        // which is erased before the upload starts
+        if (out_idx) page_erase(out_idx);
+        spm_state = SPM_ERASING;
+        spm_tries = 0;
+        // The next page, skipping the pages rftool does
+        // not send (delta upload).
+        out_idx = next_page(out_idx);
+    }
+}
+
+#ifdef RFBOOT_FEC
+// With FEC=1 (hardware_settings.mk) the packets are padded to this length
+// (the length byte, idx and 32 bytes)
+#define FEC_PKTLEN (1+2+PAYLOAD)
+
+// RFB_OPT2_PARITY. The XOR of the packets of the page we received, and
+// of the parity packet. If only one packet is missing, this is the packet
+byte parity_buf[PAYLOAD];
+bool parity_got;
+// usb2rf sends a parity packet after each request of the page, and we
+// wait for it before we send anything
+bool parity_due;
+// The packets we rebuilt, reported at the end
+uint8_t repaired;
+
+// If only one packet of the page (ending at spm_page+SPM_PAGESIZE) is
+// missing, parity_buf is this packet. We put it in the received packet and
+// return where it ends, as it was received. 0 if we cannot rebuild it
+addr_t parity_packet(addr_t spm_page, mask_t missing) {
+    if (!parity_got) return 0;
+    addr_t idx = spm_page+PAYLOAD;
+    while ( (idx<spm_page+SPM_PAGESIZE) && !(missing & UNIT_BIT(idx)) ) idx+=PAYLOAD;
+    if ( missing != (UNIT_BIT(idx)|UNIT_BIT(idx-UNIT)) ) return 0;
+    memcpy(packet+2, parity_buf, PAYLOAD);
+    repaired++;
+    return idx;
+}
+
+// The parity packet follows the last packet of the page, and we should
+// not send the next request over it. It starts in ~2ms if it is not lost
+void skip_parity(void) {
+    for (uint8_t i=16; i; i--) {
+        if ( !tx_pending && (data_ready || READ(GDO0)) ) {
+            get_data();
+            data_ready = false;
+            break;
+        }
+        _delay_us(250);
+    }
+}
+#endif
+
+#ifdef RFBOOT_MULTICAST
+// The nodes of a multicast upload have the same settings and key, and
+// often about the same RSSI. The signature row of the chip is not the same :
+// 0x0E-0x17 are the lot, wafer and position on the wafer (the serial number
+// of the atmega328pb). A hash of them chooses the NACK slots (nack_next)
+uint16_t node_hash(void) {
+    uint16_t h = 0;
+    for (uint8_t a=0x0E; a<=0x17; a++) h = _crc16_update(h, boot_signature_byte_get(a));
+    return h;
+}
+
+// The slot (0-31, 0.5ms each) of the next NACK. "seed" starts as the
+// node_hash, and steps through the same sequence (an LCG with period 65536)
+// on every node, at different places. So two nodes that sent in the same
+// slot are in different slots the next time. Not a CRC, two CRC sequences
+// differ by the same XOR every time
+uint8_t nack_next(uint16_t* seed) {
+    *seed = *seed*25173u + 13849u;
+    return *seed >> 11;
+}
+#endif
+
+// The final reply. With RFB_OPT2_PARITY it also has the packets we rebuilt
+// from the parity packets, and with RFB_OPT2_STATS the session records
+void send_result(uint8_t msg, uint16_t value, uint8_t options2) {
+    uint8_t len = 3;
+    outpkt.data[0]= msg ;
+    outpkt.data[1]= value & 0xff ;
+    outpkt.data[2]= value >> 8 ;
+    outpkt.data[3]= 0 ;
+    #ifdef RFBOOT_FEC
+    outpkt.data[3]= repaired ;
+    if (options2 & RFB_OPT2_PARITY) len = 4;
+    #endif
+    #ifdef RFBOOT_TELEMETRY
+    if (options2 & RFB_OPT2_STATS) {
+        memcpy(outpkt.data+4, data.history, sizeof(data.history));
+        len = 4+sizeof(data.history);
+    }
+    #endif
+    send_outpkt(len);
+}
+
+#ifdef RFBOOT_EEPROM
+// RFB_OPT2_EEPROM. The packets are requested one by one, from the last to
+// the first, and every byte is read back into flash_crc32. The request of
+// the next packet goes before the writes, so the packet waits in the
+// CC1101 while we write. usb2rf is a plain bridge now and rftool answers
+// the requests itself, so we ask again after 50ms
+// With RFB_OPT2_STATS the requests also have the RSSI and the LQI of the
+// last packet
+void eeprom_request(uint16_t ee_idx, bool stats_reply) {
+    #ifdef RFBOOT_TELEMETRY
+    if (stats_reply) {
+        outpkt.data[0]= RFB_SEND_PKT ;
+        outpkt.data[1]= ee_idx & 0xff ;
+        outpkt.data[2]= ee_idx >> 8 ;
+        outpkt.data[3]= ccpacket.rssi ;
+        outpkt.data[4]= ccpacket.lqi ;
+        send_outpkt(5);
+        return;
+    }
+    #endif
+    send_pkt(RFB_SEND_PKT, ee_idx);
+    tx_wait();
+}
+
+void eeprom_upload(uint16_t eeprom_size, uint32_t* iv, bool stats_reply) {
+    uint16_t ee_idx = (eeprom_size+PAYLOAD-1)/PAYLOAD*PAYLOAD;
+    eeprom_request(ee_idx, stats_reply);
+    while (ee_idx) {
+        {
+            uint16_t i=100*10;
+            while (true) {
+                i--;
+                if (i==0) {
+                    // The application passed its CRC32, but it must not
+                    // start with half of the EEPROM
+                    page_erase(0);
+                    flash_read_enable();
+                    reset_mcu();
+                }
+                if ( (i%100)==0 ) {
+                    #ifdef RFBOOT_TELEMETRY
+                    stats_resend();
+                    #endif
+                    eeprom_request(ee_idx, stats_reply);
+                }
+                if (data_ready) {
+                    data_ready = false;
+                    uint8_t len = get_data();
+                    #ifdef RFBOOT_TELEMETRY
+                    stats_packet();
+                    #endif
+                    // Only the packet we asked for, a repeated one would
+                    // break the CBC chain
+                    if ( len == 2+PAYLOAD && ccpacket.crc_ok && *(uint16_t*)packet == ee_idx) break;
+                }
+                _delay_us(500);
+            }
+        }
+        wdt_reset();
+        byte* ee_data = packet+2;
+        for (uint8_t i=0; i<=3; i++) {
+            xtea_decipher_cbc_rk( (uint32_t*)(ee_data+i*XTEA_BLOCK_SIZE), iv );
+        }
+        ee_idx -= PAYLOAD;
+        if (ee_idx) eeprom_request(ee_idx, stats_reply);
+        // The bytes after the image are padding
+        uint8_t j=PAYLOAD;
+        do {
+            j--;
+            uint8_t* addr = (uint8_t*)(uintptr_t)(ee_idx+j);
+            if ((uintptr_t)addr < eeprom_size) {
+                eeprom_update_byte(addr, ee_data[j]);
+                flash_crc32 = crc32_update(flash_crc32, eeprom_read_byte(addr));
+            }
+        } while (j);
+    }
+}
+#endif
+
+#ifdef RFBOOT_BACKGROUND
+// Background download (BACKGROUND=1). The running application receives
+// the next one into slot B, the upper half of the application section, and
+// rfboot installs it at the next start. The application cannot decrypt
+// (it has no key) nor program the flash (SPM runs only from the bootloader
+// section), so it stores the packets as they arrive, with rfboot_bg_write.
+// Slot B is the first SPM page (bg_info) and the image, CTR encrypted as
+// with RFB_OPT_CTR, at BG_IMAGE plus its flash address.
+// Macros and not "const", rfboot_bg_write runs with the RAM of the application
+#define BG_SLOT ((FLASHEND-BOOTLOADER_SECTION_SIZE+1-SPM_PAGESIZE)/2/SPM_PAGESIZE*SPM_PAGESIZE)
+#define BG_IMAGE (BG_SLOT+SPM_PAGESIZE)
+// The IV is {counter, START_SIGNATURE} encrypted, as the group ping. rftool
+// gets data.counter from the application (DATA_PAGE can be read from the
+// application section) and uses a higher one, so a recorded download
+// cannot install an earlier application. The header is CBC after the IV,
+// as in an upload, and has the CRC32 (the options are ignored)
+struct bg_info {
+    uint32_t iv[2];
+    byte header[PAYLOAD];
+};
+
+// The entry of the application (skel/rfboot_api.h). Writes the SPM page
+// "addr" of slot B with the 128 bytes of "buf", and returns 0 if "addr" is
+// not a page of slot B, so the application cannot overwrite itself, DATA_PAGE
+// or the bootloader. The application section cannot be read while the page is
+// erased and written, so the interrupts (their vectors are in the application)
+// are off for ~9ms. No global variables, the RAM belongs to the application
+uint8_t rfboot_bg_write(uint16_t addr, const byte* buf) __attribute__ ((used, noinline));
+uint8_t rfboot_bg_write(uint16_t addr, const byte* buf) {
+    if ( (addr<BG_SLOT) || (addr>=FLASHEND-BOOTLOADER_SECTION_SIZE+1-SPM_PAGESIZE) || (addr%SPM_PAGESIZE) ) return 0;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        eeprom_busy_wait();
+        boot_spm_busy_wait();
+        boot_page_erase(addr);
+        boot_spm_busy_wait();
+        for (uint8_t j=0; j<SPM_PAGESIZE/2; j++) {
+            boot_page_fill(addr+2*j, ((const uint16_t*)buf)[j]);
+        }
+        boot_page_write(addr);
+        boot_spm_busy_wait();
+        boot_rww_enable();
+    }
+    return 1;
+}
+
+#ifndef RFBOOT_HOST
+// At a fixed address, the last word of the flash (see the Makefile), so the
+// application finds it in any rfboot build
+void rfboot_api(void) __attribute__ ((naked, used, section(".rfboot_api")));
+void rfboot_api(void) {
+    asm volatile ("jmp rfboot_bg_write");
+}
+#endif
+
+// Decrypts the 8 bytes of the image at "a" (in "buf")
+void bg_block(addr_t a, const uint32_t* iv, byte* buf) {
+    uint32_t ks[2] = { iv[0] | CTR_DOMAIN, iv[1]^a };
+    xtea_encipher_rk(ks);
+    for (uint8_t j=0; j<XTEA_BLOCK_SIZE; j++) buf[j] ^= ((byte*)ks)[j];
+}
+
+// Installs the application of slot B, if there is one. It is decrypted once
+// for the CRC32, and only if it is correct a second time into slot A, with
+// the page checks of an upload. Slot B cannot be read while a page of slot A
+// is written, so we read the next page (last_page_buf) before the SPM and
+// decrypt it (ks_buf) during the SPM. Page 0 is erased first and slot B is
+// erased last, so after a power loss the copy starts again. Returns if there
+// is nothing to install, and starts the new application otherwise
+void bg_install(void) {
+    // An application uploaded by rftool can be in slot B
+    if (data.app_size>BG_SLOT) return;
+    struct bg_info info;
+    flash_memcpy(&info, BG_SLOT, sizeof(info));
+    if ( (info.iv[0]==0xffffffff) && (info.iv[1]==0xffffffff) ) return;
+    xtea_set_key(XTEA_KEY);
+    uint32_t giv[2];
+    memcpy(giv, info.iv, sizeof(giv));
+    xtea_decipher_rk(giv);
+    uint32_t iv[2];
+    memcpy(iv, info.iv, sizeof(iv));
+    for (uint8_t i=0; i<=3; i++) {
+        xtea_decipher_cbc_rk( (uint32_t*)(info.header+i*XTEA_BLOCK_SIZE), iv );
+    }
+    struct start_packet *h = (struct start_packet*)info.header;
+    addr_t app_size = h->app_size;
+    // data.counter is already increased by 1
+    bool ok = (giv[1] == START_SIGNATURE) && ((int16_t)((uint16_t)giv[0]-data.counter) >= 0) &&
+        (h->start_signature1 == START_SIGNATURE) && (h->start_signature2 == START_SIGNATURE) &&
+        app_size && (app_size%PAYLOAD==0) && (app_size<=BG_SLOT);
+    byte b[XTEA_BLOCK_SIZE];
+    if (ok) {
+        uint32_t crc = 0xffffffff;
+        addr_t a = app_size;
+        while (a) {
+            if (a%SPM_PAGESIZE==0) wdt_reset();
+            a -= XTEA_BLOCK_SIZE;
+            flash_memcpy(b, BG_IMAGE+a, XTEA_BLOCK_SIZE);
+            bg_block(a, info.iv, b);
+            uint8_t j=XTEA_BLOCK_SIZE;
+            do {
+                j--;
+                crc = crc32_update(crc, b[j]);
+            } while (j);
+        }
+        ok = (~crc == h->app_crc32);
+    }
+    if (ok) {
+        // As an upload of all pages. The counter stays below the IV until
+        // the copy is checked, so an interrupted copy is accepted again
+        data.app_size = app_size;
+        data.app_crc = h->app_crc;
+        data.app_crc2 = h->app_crc2;
+        data.counter = giv[0]-1;
+        memset(page_map, 0xff, sizeof(page_map));
+        memcpy(data.todo, page_map, sizeof(data.todo));
+        data_write();
+        page_erase(0);
+        out_idx = app_size;
+        flash_crc32 = 0xffffffff;
+        addr_t a = app_size;
+        addr_t page = (a-1)/SPM_PAGESIZE*SPM_PAGESIZE;
+        flash_read_enable();
+        flash_memcpy(last_page_buf, BG_IMAGE+page, a-page);
+        while (a) {
+            wdt_reset();
+            page = (a-1)/SPM_PAGESIZE*SPM_PAGESIZE;
+            memcpy(ks_buf, last_page_buf, SPM_PAGESIZE);
+            addr_t i = a;
+            while (i>page) {
+                i -= XTEA_BLOCK_SIZE;
+                bg_block(i, info.iv, ks_buf+i-page);
+                flash_poll();
+            }
+            flash_sync();
+            if (page) flash_memcpy(last_page_buf, BG_IMAGE+page-SPM_PAGESIZE, SPM_PAGESIZE);
+            while (a>page) {
+                a--;
+                out_byte(ks_buf[a-page]);
+            }
+        }
+        flash_sync();
+        ok = (~flash_crc32 == h->app_crc32);
+        if (!ok) page_erase(0);
+        else {
+            // Page 0 is written and checked. Now the counter is the one of
+            // the IV, so rftool uses a higher one for the next download
+            // and this one is not accepted again
+            data.counter = giv[0];
+            data_write();
+        }
+    }
+    // The image is used once. Its round keys must not stay in RAM, as
+    // fast_start can follow (XTEA_KEY is still needed for the upload)
+    page_erase(BG_SLOT);
+    flash_read_enable();
+    memset(xtea_rk,0,sizeof(xtea_rk));
+    if (ok) reset_mcu();
+}
+#endif
+
+#ifdef RFBOOT_COMPRESSION
+// LZ decompressor for RFB_OPT_PACKED. The compressed stream is fed
+// byte by byte, and the format is :
+// 0LLLLLLL          : L+1 literal bytes follow
+// 1LLLLLLH OOOOOOOO : copy L+3 bytes, starting (H*256+O+1) bytes back
+// The last LZ_WINDOW bytes we output are kept in RAM, so there is
+// no need to read the flash (the RWW section is busy while writing)
+#define LZ_WINDOW 512
+byte lz_hist[LZ_WINDOW];
+uint16_t lz_pos;
+uint8_t lz_lit;
+uint8_t lz_tok;
+
+void lz_out(uint8_t b) {
+    lz_hist[lz_pos++ % LZ_WINDOW] = b;
+    out_byte(b);
+}
+
+void lz_feed(uint8_t b) {
+    if (lz_lit) {
+        lz_lit--;
+        lz_out(b);
+    }
+    else if (lz_tok) {
+        uint16_t from = lz_pos - ( ((lz_tok&1)<<8) | b ) - 1;
+        uint8_t len = ((lz_tok>>1) & 0x3f) + 3;
+        lz_tok = 0;
+        do {
+            lz_out(lz_hist[from++ % LZ_WINDOW]);
+        } while (--len);
+    }
+    else if (b & 0x80) lz_tok = b;
+    else lz_lit = b+1;
+}
+#endif
+
 int main(void) {
     // rfboot does always enables a 2 sec Watchdog timer.
     // The application at normal operation will
@@ -285,7 +1394,16 @@ int main(void) {
     // Disable interrupts.
     cli();
 
-    memcpy_P( &data, DATA_PAGE, sizeof(data) );
+    flash_memcpy( &data, DATA_PAGE, sizeof(data) );
+    // The journal goes into data, and is erased (0xff) for data_write
+    for (uint8_t i=0; i<sizeof(data.todo); i++) {
+        if (!data.todo_done[i]) data.todo[i] = 0;
+    }
+    memset(data.todo_done, 0xff, sizeof(data.todo_done));
+    #ifdef RFBOOT_TELEMETRY
+    if (data.finished.status!=0xff) data.history[0] = data.finished;
+    memset(&data.finished, 0xff, sizeof(data.finished));
+    #endif
 
     /*
     // Only HW reset allowed (from settings)
@@ -303,9 +1421,8 @@ int main(void) {
         }
         else { // Reset cause was no HW reset, and flash seems to have application written
 
-            // Althrough XTEA_KEY is read only, the RAM can be written
             // We erase XTEA_KEY
-            memset((void*)XTEA_KEY,0,sizeof(XTEA_KEY));
+            key_wipe();
 
             // Jump to the application
             asm("jmp 0");
@@ -346,11 +1463,8 @@ int main(void) {
         // will see as reset cause always WDOG
         mcusr_mirror = previous_reset_cause;
 
-        // Althrough XTEA_KEY is read only, the RAM can be written
-        // As atmega does not enforce any RAM protection. Maybe on other
-        // cpu/mcu this command fails.
-        // We erase XTEA_KEY
-        memset((void*)XTEA_KEY,0,sizeof(XTEA_KEY));
+        // We erase XTEA_KEY and the round keys, see key_wipe
+        key_wipe();
 
         // finally we start the application
         // note that we come from a WDOG reset
@@ -358,7 +1472,7 @@ int main(void) {
         // The app has responsibility of initialize the rf module
         // the application must reset the watchdog every 2 secs at least
         // or to change watchdog settings
-        asm("jmp 0");
+        start_app();
     }
     //#endif
 
@@ -387,11 +1501,49 @@ int main(void) {
     iv[0]=data.counter;
     iv[1]=COMPILE_TIME;
     // We encrypt it
-    xtea_encipher( (byte*)iv,XTEA_KEY);
+    xtea_encipher(iv,XTEA_KEY);
+    #ifdef RFBOOT_WINDOW
+    memcpy(ctr_iv, iv, sizeof(ctr_iv));
+    #endif
+
+    #ifdef RFBOOT_BACKGROUND
+    // A new application in slot B is installed before anything else
+    bg_install();
+    #endif
 
     // here we set RF channel, SyncWord etc
     radio_init();
     // no need for sei() : radio_init() does it
+
+    #ifdef RFBOOT_FAST_BOOT
+    // Nobody is going to upload code after a power-on or brown-out,
+    // unless rftool is already transmitting
+    if ( mcusr_mirror & (_BV(PORF)|_BV(BORF)) ) {
+        uint16_t i=FAST_BOOT_MS*4;
+        // CS (carrier sense) is bit 6 of PKTSTATUS
+        while ( (!data_ready) && !(readStatusReg(CC1101_PKTSTATUS) & 0x40) ) {
+            i--;
+            if (!i) {
+                cc1101_setPowerDownState();
+                fast_start();
+            }
+            _delay_us(250);
+        }
+    }
+    #endif
+
+    // Multicast upload (RFB_OPT_GROUP). The node that lost a unit sends
+    // its NACK in its own slot of the 20ms (see nack_next), so the nodes
+    // do not answer at the same time
+    #ifdef RFBOOT_MULTICAST
+    bool group = false;
+    uint16_t node = 0;
+    uint8_t nack_slot = 0;
+    #else
+    const bool group = false;
+    const uint8_t nack_slot = 0;
+    #endif
+
     {
         // 250 iterations before give up
         // about 250ms wait time
@@ -399,10 +1551,35 @@ int main(void) {
         while(1) {
             if (data_ready) {
                 data_ready = false;
-                if ( get_data() == 4 && ccpacket.crc_ok) {
-                    uint32_t* p = packet;
+                uint8_t len = get_data();
+                uint32_t* p = (uint32_t*)packet;
+                if ( len == 4 && ccpacket.crc_ok) {
                     if (*p == PING_SIGNATURE) break;
                 }
+                #ifdef RFBOOT_MULTICAST
+                // The group ping : PING_SIGNATURE and the IV rftool chose for
+                // all nodes. The IV is {counter, START_SIGNATURE} encrypted,
+                // and we accept it only if the counter is not lower than ours.
+                // So a recorded group upload cannot be replayed, as data.counter
+                // grows with every start of rfboot
+                if ( len == 12 && ccpacket.crc_ok && (*p == PING_SIGNATURE) ) {
+                    uint32_t giv[2];
+                    memcpy(giv, p+1, sizeof(giv));
+                    xtea_set_key(XTEA_KEY);
+                    xtea_decipher_rk(giv);
+                    if ( (giv[1] == START_SIGNATURE) && ((int16_t)((uint16_t)giv[0]-data.counter) >= 0) ) {
+                        group = true;
+                        data.counter = giv[0];
+                        memcpy(iv, p+1, sizeof(iv));
+                        memcpy(ctr_iv, iv, sizeof(ctr_iv));
+                        node = node_hash();
+                        nack_slot = nack_next(&node);
+                        break;
+                    }
+                    // rftool needs a higher counter, it gets ours from the IV
+                    break;
+                }
+                #endif
             }
             i--;
             if (!i) reset_mcu();
@@ -410,10 +1587,10 @@ int main(void) {
         }
     }
 
-    send_iv(iv);
+    if (!group) send_iv(iv);
 
     // the struct is used to extract upload parameters from the first packet
-    struct start_packet *spacket = packet;
+    struct start_packet *spacket = (struct start_packet*)packet;
 
     {
         uint8_t i=250;
@@ -437,6 +1614,10 @@ int main(void) {
 
     // reset watchdog to be sure
     wdt_reset();
+    SIM_MARK(SIM_UPLOAD);
+    #ifdef RFBOOT_TELEMETRY
+    stats_start();
+    #endif
 
     // We check if the first packet contains the correct signature
     // The signature is 32 bit, and transmitted in 2 places in the packet
@@ -444,8 +1625,13 @@ int main(void) {
     // packet send by mistake (from an earlier upload for example)
     // to confuse the bootloader
 
+    // The round keys are calculated once, the decryption is in the
+    // receive path. They are in .bss, so the next rfboot start (the
+    // watchdog reset) clears them before the application runs
+    xtea_set_key(XTEA_KEY);
+
     for (uint8_t i=0; i<=3; i++) {
-        xtea_decipher_cbc( (uint32_t*)(packet+i*XTEA_BLOCK_SIZE) , XTEA_KEY,iv );
+        xtea_decipher_cbc_rk( (uint32_t*)(packet+i*XTEA_BLOCK_SIZE), iv );
     }
 
     if ( (spacket->start_signature1 == START_SIGNATURE) && (spacket->start_signature2 == START_SIGNATURE) ) {
@@ -461,7 +1647,10 @@ int main(void) {
     // We store here the size of the incoming application
     // this info is in the first packet
     // now using spacket pointer we extract info from the packet
-    uint16_t app_size = spacket->app_size;
+    addr_t app_size = spacket->app_size;
+    #ifdef RFBOOT_FAR
+    app_size |= (addr_t)spacket->app_size_hi << 16;
+    #endif
 
     // Here some basic checks for a valid app size.
     // app_size is always a multiple
@@ -486,78 +1675,379 @@ int main(void) {
     // better error detection
     uint16_t remote_crc2 = spacket->app_crc2;
 
-    // This variable will point to the flash location to be written
-    uint16_t app_idx=app_size;
+    #ifdef RFBOOT_CRC32
+    // Only with RFB_OPT_CRC32
+    uint32_t remote_crc32 = spacket->app_crc32;
+    #endif
 
+    // The options rftool asks for and we support
+    uint8_t options = spacket->options & RFB_SUPPORTED_OPTIONS;
+    // Delta upload, compression, resume, the fast modem, CTR and multicast need window mode
+    if (!(options & RFB_OPT_WINDOW)) options &= RFB_OPT_CRC32;
+    #ifdef RFBOOT_MULTICAST
+    // In a multicast upload rftool cannot know the options of every node,
+    // so a node that does not support all of them gives up
+    if (group) {
+        options &= ~(RFB_OPT_DELTA|RFB_OPT_RESUME|RFB_OPT_FAST);
+        if ( (options != spacket->options) || spacket->options2 ) {
+            send_pkt(RFB_OPTIONS,options);
+            reset_mcu();
+        }
+    }
+    else options &= ~RFB_OPT_GROUP;
+    #endif
+    #if defined(RFBOOT_FEC) || defined(RFBOOT_FAR) || defined(RFBOOT_EEPROM) || defined(RFBOOT_TELEMETRY)
+    // The FEC, the parity packet, the 24 bit addresses, the EEPROM and the telemetry need window mode too
+    uint8_t options2 = (options & RFB_OPT_WINDOW) ? (spacket->options2 & RFB_SUPPORTED_OPTIONS2) : 0;
+    #else
+    const uint8_t options2 = 0;
+    #endif
+    #ifdef RFBOOT_EEPROM
+    // The EEPROM is checked with the CRC32 only
+    if (!(options & RFB_OPT_CRC32)) options2 &= ~RFB_OPT2_EEPROM;
+    uint16_t eeprom_size = (options2 & RFB_OPT2_EEPROM) ? spacket->eeprom_size : 0;
+    uint32_t remote_eeprom_crc32 = spacket->eeprom_crc32;
+    if (eeprom_size > E2END+1) {
+        send_pkt(RFB_INVALID_CODE_SIZE,0xffff);
+        reset_mcu();
+    }
+    #endif
+    // We resume only the same application. Delta upload is not needed then
+    if ( (data.app_size==app_size) && (data.app_crc==remote_crc) && (data.app_crc2==remote_crc2) ) {
+        if (options & RFB_OPT_RESUME) options &= ~RFB_OPT_DELTA;
+    }
+    else options &= ~RFB_OPT_RESUME;
+    #ifdef RFBOOT_WINDOW
+    bool window = options & RFB_OPT_WINDOW;
+    bool ctr = options & RFB_OPT_CTR;
+    #else
+    const bool window = false;
+    #endif
+    #ifdef RFBOOT_COMPRESSION
+    bool packed = options & RFB_OPT_PACKED;
+    #else
+    const bool packed = false;
+    #endif
+    if (spacket->options && !group) send_pkt(RFB_OPTIONS,options|(options2<<8));
+    // RFB_OPTIONS is still on the air, before we change the radio settings
+    tx_wait();
+    #ifdef RFBOOT_FAR
+    // An rftool without RFB_OPT2_FAR cannot send more than 64KB, or SPM pages
+    // of 256 bytes. It knows from RFB_OPTIONS
+    if (!(options2 & RFB_OPT2_FAR)) reset_mcu();
+    #endif
+
+    #ifdef RFBOOT_FEC
+    // rftool switches usb2rf to the FEC (and the fast settings) when it
+    // gets RFB_OPTIONS, and one echo is enough for both. If it does not
+    // answer we use the default settings again
+    if (options2 & RFB_OPT2_FEC) {
+        cc1101_setFec(FEC_PKTLEN);
+        if (options & RFB_OPT_FAST) cc1101_setFastModem(true);
+        if (!wait_echo(RFB_FEC)) {
+            cc1101_setFec(0);
+            cc1101_setFastModem(false);
+        }
+    }
+    else
+    #endif
+    #ifdef RFBOOT_WINDOW
+    if (options & RFB_OPT_FAST) {
+        // rftool switches usb2rf when it gets RFB_OPTIONS. If it does not
+        // answer we use the default settings again
+        cc1101_setFastModem(true);
+        if (!wait_echo(RFB_FAST)) cc1101_setFastModem(false);
+    }
+    #endif
+    // The lowest flash address rftool sends packets for. Without compression
+    // this is 0. With compression we know it when the first packet arrives
+    addr_t packed_end = packed ? app_size : 0;
 
     data.app_crc = spacket->app_crc;
     data.app_crc2 = spacket->app_crc2;
-    data.app_size = spacket->app_size;
+    data.app_size = app_size;
     //data.counter++;
 
-    // Here we send the request for the first packet
+    memset(page_map, 0xff, sizeof(page_map));
+    // Only the first page rftool sends (the last in flash) can be partially
+    // filled. The rest of the page remains 0xff
+    memset(out_buf, 0xff, sizeof(out_buf));
+
+    #ifdef RFBOOT_WINDOW
+    if (options & RFB_OPT_RESUME) {
+        // We report the pages not written yet. If the packet is lost
+        // rftool sends all pages
+        outpkt.data[0]=RFB_RESUME_MAP;
+        memcpy(outpkt.data+1, data.todo, sizeof(data.todo));
+        send_outpkt(1+sizeof(data.todo));
+    }
+
+    if (options & RFB_OPT_DELTA) {
+        // We report the CRC16 of every SPM page the new
+        // application is going to use. rftool compares them with its own
+        // and the pages with the same CRC are not sent. If a packet is lost
+        // rftool simply sends the pages it does not know about.
+        // The flash is not touched yet so we can read it.
+        uint16_t page=0;
+        do {
+            uint8_t n=0;
+            outpkt.data[0]=RFB_PAGE_HASH;
+            outpkt.data[1]=page/SPM_PAGESIZE;
+            do {
+                uint16_t crc=0;
+                do {
+                    crc = _crc16_update(crc,flash_read(page));
+                    page++;
+                } while (page%SPM_PAGESIZE);
+                ((uint16_t*)(outpkt.data+3))[n]=crc;
+                n++;
+            } while ( (n<HASHES_PER_PKT) && (page<app_size) );
+            outpkt.data[2]=n;
+            send_outpkt(3+2*n);
+        } while (page<app_size);
+    }
+
+    if (options & (RFB_OPT_DELTA|RFB_OPT_RESUME)) {
+        // and now we need the page map. Encrypted as all other packets
+        {
+            uint16_t i=40*10;
+            while (true) {
+                if ( (i%40)==0) {
+                    send_pkt(RFB_SEND_MAP, app_size);
+                    tx_wait();
+                }
+                if (data_ready) {
+                    data_ready = false;
+                    if ( get_data() == PAYLOAD && ccpacket.crc_ok) {
+                        break;
+                    }
+                }
+                i--;
+                if (i==0) reset_mcu();
+                _delay_us(500);
+            }
+        }
+        for (uint8_t i=0; i<=3; i++) {
+            xtea_decipher_cbc_rk( (uint32_t*)(packet+i*XTEA_BLOCK_SIZE), iv );
+        }
+        // The map ends with the signature, as the header does
+        if ( *(uint32_t*)(packet+sizeof(page_map)) != START_SIGNATURE ) {
+            send_pkt(RFB_NO_SIGNATURE,0xffff);
+            reset_mcu();
+        }
+        memcpy(page_map, packet, sizeof(page_map));
+    }
+    #endif
+
+    #ifdef RFBOOT_FEC
+    short_pkts = options2 & (RFB_OPT2_FEC|RFB_OPT2_PARITY);
+    bool parity = options2 & RFB_OPT2_PARITY;
+    #endif
+
+    // The flash location to be written
+    out_idx=next_page(app_size);
+
+    // The CRC32 starts with the pages rftool does not send (delta upload)
+    // above the first page we write. The other pages are added after they are written
+    #ifdef RFBOOT_CRC32
+    flash_crc32 = 0xffffffff;
+    if (options & RFB_OPT_CRC32) crc_fold(out_idx, app_size);
+    #endif
+
+    // If no page is sent, the application in flash should be the same.
+    // The CRC check at the end, will tell us
+    bool identical = (out_idx==0);
+
+    // Page 0 is always erased (see below) so it must be sent
+    // with any other page.
+    if (!identical) page_map[0] |= 1;
+
+    // The pages not written yet. We store them in DATA_PAGE (see below)
+    // so an interrupted upload can resume
+    memcpy(data.todo, page_map, sizeof(data.todo));
+
+    // This variable points to the end of the packet we expect.
+    // Without compression this is the same as out_idx.
+    addr_t app_idx = (packed && !identical) ? app_size : out_idx;
+
+    // Here we send the request for the first packet (or page)
     // the packets are transmitted and received in reverse order
     // from the last 32 byte packet to the first
-    send_pkt(RFB_SEND_PKT, app_idx);
+    // In a multicast upload rftool sends the pages without requests
+    if (identical || group) {
+        // nothing to request
+    }
+    #ifdef RFBOOT_WINDOW
+    else if (window) send_page(app_idx, PAGE_MASK(app_idx));
+    #endif
+    else send_pkt(RFB_SEND_PKT, app_idx);
 
     //#ifndef USE_ENTROPY
     //    eeprom_update_word(E2END-1, counter);
     //    eeprom_busy_wait();
     //#endif
 
+    #ifdef RFBOOT_TELEMETRY
+    // A new record for this upload, the earlier ones move down. It stays
+    // STATS_STARTED if the upload does not finish (see stats_save)
+    memmove(data.history+1, data.history, sizeof(data.history)-sizeof(data.history[0]));
+    memset(data.history, 0xff, sizeof(data.history[0]));
+    data.history[0].status = STATS_STARTED;
+    #endif
+
     // Time to write the info
-    page_erase(DATA_PAGE);
-    ATOMIC_BLOCK(ATOMIC_FORCEON) {
-        boot_spm_busy_wait();
-        uint16_t *j=&data;
-        uint16_t flash_idx = DATA_PAGE;
-        do {
-            boot_page_fill(flash_idx, *j);
-            flash_idx+=2;
-            j++;
-        } while( flash_idx< DATA_PAGE+sizeof(data) );
-        boot_spm_busy_wait();
-        boot_page_write(DATA_PAGE);
-    }
+    data_write();
 
     // Before any write, we erase the first SPM page. If for some reason
     // the upload process fails, the first page will contain
     // 0xff and  rfboot will refuse to start the corrupted code.
     // see the start of main() how this is implemented
-    page_erase(0);
+    if (!identical) page_erase(0);
 
     // one loop per SPM page (in reverse order). rftool sends the last bytes of code first
-    do
+    while (app_idx)
     {
         wdt_reset();
-        // if i.e. app_idx == 256 we are going to burn the flash from 128-255
-        // if app_idx == 128 we are going to burn the flash from 0-127 etc
-        // We erase this SPM page unless it is the 0-127 page
-        // which is erased before this loop starts
-        if (app_idx>SPM_PAGESIZE) { // this means _not_ the first page
-            uint16_t spm_page=(app_idx-1)/SPM_PAGESIZE*SPM_PAGESIZE;
-            page_erase(spm_page);
-        }
-        // one loop per network packet 32 bytes == 4 xtea blocks
+        // if i.e. app_idx == 256 we are going to get the packets 128-255
+        // if app_idx == 128 we are going to get the packets 0-127 etc
+        addr_t spm_page=(app_idx-1)/SPM_PAGESIZE*SPM_PAGESIZE;
+
+        // The units of this SPM page we have not received yet
+        mask_t missing = PAGE_MASK(app_idx);
+
+        #ifdef RFBOOT_WINDOW
+        // The keystream of the page is calculated from its end
+        ks_page = spm_page;
+        ks_idx = app_idx;
+        #endif
+
+        #ifdef RFBOOT_FEC
+        memset(parity_buf, 0, sizeof(parity_buf));
+        parity_got = false;
+        parity_due = true;
+        #endif
+
+        // one loop per network packet, 32 bytes == 4 xtea blocks
+        // or 16-48 bytes in window mode
         do
         {
+            // the flash address where the received packet ends, and its size
+            addr_t idx;
+            uint8_t n;
             { // we send a request and expect a data packet
-                uint16_t i=40*10-1;
+                uint16_t i=40*10-1-nack_slot;
+                #ifdef RFBOOT_MULTICAST
+                // Half ms steps the next NACK comes later, i does not count them
+                uint8_t nack_wait = 0;
+                #endif
 
                 while (true) {
-                    // every 20ms we send a request
-                    if ( (i%40)==0) send_pkt(RFB_SEND_PKT, app_idx);
-
-                    if (data_ready) {
-                        data_ready = false;
-                        if ( (get_data()==PAYLOAD) && ccpacket.crc_ok) {
+                    // every 20ms we send a request. In window mode
+                    // the timer restarts with every packet, so
+                    // we do not interrupt usb2rf while it is sending.
+                    // In a multicast upload the first 20ms without any unit
+                    // of the page are normal, rftool may repeat units of a
+                    // higher page for other nodes
+                    if ( ((i%40)==0) && !(group && (i==40*9) && (missing==PAGE_MASK(app_idx))) ) {
+                        #ifdef RFBOOT_FEC
+                        // The parity packet came before the last packet
+                        if ( (idx = parity_packet(spm_page, missing)) ) {
+                            n = PAYLOAD;
                             break;
                         }
-                        else i=40*10+1;
+                        #endif
+                        #ifdef RFBOOT_TELEMETRY
+                        stats_resend();
+                        #endif
+                        #ifdef RFBOOT_WINDOW
+                        if (window) {
+                            // The page was requested already, so we lost some packets
+                            link_lost();
+                            send_page(app_idx, missing);
+                            #ifdef RFBOOT_MULTICAST
+                            // The next NACK 20ms and a new slot later
+                            if (group) nack_wait = nack_slot = nack_next(&node);
+                            #endif
+                            #ifdef RFBOOT_FEC
+                            parity_due = true;
+                            #endif
+                        }
+                        else
+                        #endif
+                        send_pkt(RFB_SEND_PKT, app_idx);
+                    }
+
+                    // We start reading when the packet starts (sync word),
+                    // as a whole page packet does not fit in the FIFO.
+                    // GDO0 is high while our request is on the air too
+                    if ( !tx_pending && (data_ready || READ(GDO0)) ) {
                         wdt_reset();
+                        uint8_t len = get_data();
+                        // The packet end interrupt came while we were reading
+                        data_ready = false;
+                        #ifdef RFBOOT_WINDOW
+                        link_quality();
+                        #endif
+                        if (ccpacket.crc_ok) {
+                            #ifdef RFBOOT_WINDOW
+                            if (window) {
+                                // window packets start with their idx, as
+                                // they can arrive in any order (retransmissions)
+                                #ifdef RFBOOT_FAR
+                                // The low 16 bits, the rest is the page we wait for
+                                idx = spm_page + 1 + (uint16_t)(*(uint16_t*)packet - (uint16_t)spm_page - 1);
+                                #else
+                                idx = *(uint16_t*)packet;
+                                #endif
+                                n = len-2;
+                                #ifdef RFBOOT_FEC
+                                if ( parity && (idx==spm_page+1) && (n==PAYLOAD) ) {
+                                    // It is the last packet usb2rf sends, so
+                                    // the air is free for the next request.
+                                    // The parity of a retransmission is the same
+                                    parity_due = false;
+                                    if (!parity_got) {
+                                        parity_got = true;
+                                        for (uint8_t j=0; j<PAYLOAD; j++) parity_buf[j] ^= packet[2+j];
+                                        if ( (idx = parity_packet(spm_page, missing)) ) break;
+                                    }
+                                }
+                                #endif
+                                uint16_t offset = idx-spm_page-1;
+                                if ( (n%UNIT==0) && (n>0) && (n/UNIT<=PAGE_UNITS) &&
+                                (offset<SPM_PAGESIZE) && (offset+1>=n) &&
+                                (idx%UNIT==0) && (missing & UNIT_BIT(idx)) ) break;
+                            }
+                            else
+                            #endif
+                            if (len==PAYLOAD) {
+                                idx = app_idx;
+                                n = PAYLOAD;
+                                break;
+                            }
+                        }
+                        if (!window) i=40*10+1;
+                        #ifdef RFBOOT_MULTICAST
+                        // rftool repeats the header until the first page,
+                        // for the nodes that start later
+                        else if (group && (len==PAYLOAD)) i=40*10-1-nack_slot;
+                        #endif
+                    }
+                    // The 20ms start at the end of our request
+                    if ( !tx_pending || ((i%40)==0) ) {
+                        #ifdef RFBOOT_MULTICAST
+                        if ( nack_wait && (i%40) ) nack_wait--;
+                        else
+                        #endif
+                        i--;
                     }
-                    i--;
                     if (i==0) reset_mcu();
+                    flash_poll();
+                    tx_poll();
+                    #ifdef RFBOOT_WINDOW
+                    // A keystream block takes about as long as the delay
+                    if ( ctr && ctr_poll() ) continue;
+                    #endif
                     _delay_us(500);
                 }
             }
@@ -566,86 +2056,168 @@ int main(void) {
             // before even consume this
             // one. This is for efficiency. The answer will take some time
             // to arrive, so is better to do some work in the meantime
-            if (app_idx-PAYLOAD>0) send_pkt(RFB_SEND_PKT, app_idx-PAYLOAD);
-
-            // We decrypt the packet. 4 XTEA blocks
-            for (uint8_t i=0; i<=3; i++) {
-                xtea_decipher_cbc( (uint32_t*)(packet+i*XTEA_BLOCK_SIZE) , XTEA_KEY ,iv );
+            if ( (!window) && (app_idx-PAYLOAD>0) ) send_pkt(RFB_SEND_PKT, app_idx-PAYLOAD);
+
+            // The packet is stored in the page buffer until all packets
+            // after it (in the CBC chain) are decrypted. Only window mode
+            // needs this but the code is smaller this way.
+            memcpy(last_page_buf+(uint8_t)(idx-spm_page-n), packet+(window?2:0), n);
+            #ifdef RFBOOT_FEC
+            if (parity) {
+                for (uint8_t j=0; j<n; j++) parity_buf[j%PAYLOAD] ^= packet[2+j];
             }
-            // at this point the packet is in cleartext
+            #endif
+            // the bits of the units from idx-n to idx
+            missing &= ~( (UNIT_BIT(idx)<<1) - UNIT_BIT(idx-n+UNIT) );
+
+            // The same as above for window mode. The last packet of the
+            // SPM page triggers the request of the next page.
+            // The compressed packets are never skipped. If we do not know
+            // packed_end yet, the next page sends the request with its timer.
+            #ifdef RFBOOT_WINDOW
+            if (window && (!missing) && !group) {
+                #ifdef RFBOOT_FEC
+                if (parity && parity_due) skip_parity();
+                #endif
+                addr_t next = packed ? spm_page : next_page(spm_page);
+                if (next>packed_end) send_page(next, PAGE_MASK(next));
+            }
+            #endif
+
+            // rftool encrypts packets of 32 bytes, the blocks of a packet in
+            // ascending order. So we decrypt both units of a packet together
+            while ( (app_idx>spm_page) &&
+            !(missing & (UNIT_BIT(app_idx)|UNIT_BIT(app_idx-UNIT))) ) {
+                uint8_t offset = app_idx-spm_page-PAYLOAD;
+                byte* p = last_page_buf+offset;
+                SIM_MARK(SIM_DECRYPT);
+                #ifdef RFBOOT_WINDOW
+                if (ctr) {
+                    // Normally the keystream is ready
+                    while (ks_idx>app_idx-PAYLOAD) ctr_poll();
+                    for (uint8_t j=0; j<PAYLOAD; j++) p[j] ^= ks_buf[offset+j];
+                }
+                else
+                #endif
+                {
+                    // We decrypt the packet. 4 XTEA blocks
+                    for (uint8_t i=0; i<=3; i++) {
+                        xtea_decipher_cbc_rk( (uint32_t*)(p+i*XTEA_BLOCK_SIZE), iv );
+                    }
+                }
+                SIM_MARK(SIM_DECRYPT+1);
+                // at this point the packet is in cleartext
 
-            // next thing is to wtite it in flash
-            // the following code is basically what avr-gcc documentation
-            // suggests, it just doing it from high addresses to low.
-            ATOMIC_BLOCK(ATOMIC_FORCEON) {
-                boot_spm_busy_wait();
+                // next thing is to wtite it in flash (from the last byte to the first)
                 uint8_t j=PAYLOAD;
-                do {
-                    app_idx-=2;
+                #ifdef RFBOOT_COMPRESSION
+                if (packed && app_idx==app_size) {
                     j-=2;
-                    boot_page_fill(app_idx, *(uint16_t*)(packet+j));
+                    packed_end = app_size - *(uint16_t*)(p+j);
+                }
+                #endif
+                do {
+                    j--;
+                    #ifdef RFBOOT_COMPRESSION
+                    if (packed) lz_feed(p[j]);
+                    else
+                    #endif
+                    out_byte(p[j]);
                 } while(j);
+                app_idx-=PAYLOAD;
             }
 
-        // we repeat the above 4 times until an SPM (128 bytes) page fills
-        } while (app_idx%SPM_PAGESIZE);
-        //
-        // Now we filled a full SPM page we have to burn it in flash
-        //
-        ATOMIC_BLOCK(ATOMIC_FORCEON) {
-            boot_spm_busy_wait();
-            boot_page_write(app_idx);
-        }
-    // We repeat writing SPM pages
-    // if app_idx becomes 0 we have just written the SPM page 0-127
-    // and the whole application is written to the flash
-    } while (app_idx);
+        // we repeat the above until an SPM (128 bytes) page fills
+        } while (app_idx>spm_page);
+
+        // We repeat with the next page, skipping the pages
+        // rftool does not send (delta upload).
+        // if app_idx becomes 0 we have just written the SPM page 0-127
+        // and the whole application is written to the flash.
+        // The compressed packets are never skipped, and end at packed_end
+        if (!packed) app_idx = next_page(app_idx);
+        else if (app_idx<=packed_end) app_idx = 0;
+    }
 
     // We got all RF packets
-    // the upload process is finished
+    // the upload process is finished. The last page may not be written yet
+    flash_sync();
 
     // Now we are going to check if the CRC's of the written code are the same as
-    // the CRC's sent from rftool. So we need to enable flash read
-    flash_read_enable();
-
-    // the crc's are initialized with zero (from avr-libc documentation)
-    uint16_t local_crc=0;
-    uint16_t local_crc2=0;
-    for (uint16_t i = 0; i < app_size ; i++) {
+    // the CRC's sent from rftool.
+    bool crc_ok;
+    SIM_MARK(SIM_CRC);
+    #ifdef RFBOOT_CRC32
+    if (options & RFB_OPT_CRC32) {
+        // The pages are already checked one by one (see flash_poll)
+        crc_ok = (~flash_crc32 == remote_crc32);
+    }
+    else
+    #endif
+    {
+        // Earlier rftool versions. We read the whole application
+        // so we need to enable flash read
+        flash_read_enable();
 
-        // the first crc calculated reading the flash from start to end.
-        local_crc = _crc16_update(local_crc,pgm_read_byte(i));
+        // the crc's are initialized with zero (from avr-libc documentation)
+        uint16_t local_crc=0;
+        uint16_t local_crc2=0;
+        for (addr_t i = 0; i < app_size ; i++) {
+
+            // the first crc calculated reading the flash from start to end.
+            local_crc = _crc16_update(local_crc,flash_read(i));
+
+            // the second crc is calculated reading the flash from end to start
+            // The 2 crc's according to my (non scientific) tests seem independent
+            // offering an effective 32bit CRC
+            // so offer a ~100% probability that flash is correctly
+            // written. I am including a C program to test my hypothesis. If anyone has a
+            // formal mathematical proof, I am very interested to know so
+            // send me a note to  include a link here.
+            // Note also that the use of 2 CRC16 is
+            // probably an overkill but it costs only 40-50 bytes in flash
+            // and minimal MCU time.
+            local_crc2 = _crc16_update(local_crc2,flash_read(app_size-1-i));
+            // Note: I tried a CRC32 once, but bloated the code badly
+        }
 
-        // the second crc is calculated reading the flash from end to start
-        // The 2 crc's according to my (non scientific) tests seem independent
-        // offering an effective 32bit CRC
-        // so offer a ~100% probability that flash is correctly
-        // written. I am including a C program to test my hypothesis. If anyone has a
-        // formal mathematical proof, I am very interested to know so
-        // send me a note to  include a link here.
-        // Note also that the use of 2 CRC16 is
-        // probably an overkill but it costs only 40-50 bytes in flash
-        // and minimal MCU time.
-        local_crc2 = _crc16_update(local_crc2,pgm_read_byte(app_size-1-i));
-        // Note: I tried a CRC32 once, but bloated the code badly
+        // Now both crc's are calculated, we do the test
+        crc_ok = (remote_crc == local_crc) && (remote_crc2 == local_crc2);
+    }
+    SIM_MARK(SIM_CRC+1);
+    #ifdef RFBOOT_EEPROM
+    // The EEPROM only after a good application (RFB_OPT_CRC32). If it fails,
+    // page 0 is erased as below. No SPM runs now, and eeprom_read_byte
+    // waits for the last write
+    if (crc_ok && eeprom_size) {
+        eeprom_upload(eeprom_size, iv, options2 & RFB_OPT2_STATS);
+        crc_ok = (~flash_crc32 == remote_eeprom_crc32);
     }
+    #endif
 
-    // Now both crc's are calculated, we do the test
+    #ifdef RFBOOT_TELEMETRY
+    // Before the reply, which reports it
+    stats_save( !crc_ok ? RFB_WRONG_CRC : (identical ? RFB_IDENTICAL_CODE : RFB_SUCCESS) );
+    #endif
 
-    if ( (remote_crc != local_crc) || (remote_crc2 != local_crc2) ) {
+    if (!crc_ok) {
         // if the crc's dont match, we erase the first SPM page again, so rfboot wont try
         // to start a corrupted code. Note that this should be rare, since
         // the network packets are already protected with CRC.
         page_erase(0);
-        send_pkt(RFB_WRONG_CRC,0);
+        send_result(RFB_WRONG_CRC, 0, options2 & ~RFB_OPT2_PARITY);
 
         //I am not sure if this is needed but it doesn't hurt either
         flash_read_enable();
     }
     else {
-        // Success !
-        send_pkt(RFB_SUCCESS,0);
+        // In a multicast upload all nodes finish with the last packet, so
+        // every node waits for its own slot
+        for (uint8_t i=nack_slot; i; i--) _delay_ms(1);
+        // Success ! We also report the window packet size at the end of the upload
+        send_result(identical ? RFB_IDENTICAL_CODE : RFB_SUCCESS, units*UNIT, options2);
     }
+    SIM_MARK(SIM_UPLOAD+1);
 
     // Reset MCU. If flash is correctly written the application can start, not
     // directly but by using a Watchdog reset. This ensures
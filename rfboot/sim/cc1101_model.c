@@ -0,0 +1,283 @@
+// CC1101 model for the simavr benchmark, see cc1101_model.h
+
+#include <string.h>
+#include "sim_irq.h"
+#include "sim_io.h"
+#include "sim_cycle_timers.h"
+#include "avr_spi.h"
+#include "avr_ioport.h"
+#include "cc1101_model.h"
+
+// MARCSTATE values the driver checks
+#define CCM_IDLE 0x01
+#define CCM_STARTCAL 0x08
+#define CCM_RX 0x0D
+#define CCM_TXRX_SWITCH 0x10
+#define CCM_RX_OVERFLOW 0x11
+#define CCM_TX 0x13
+
+// Preamble and sync word, before GDO0 goes high
+#define CCM_SYNC_BYTES 8
+// From IDLE to RX the CC1101 calibrates (MCSM0 FS_AUTOCAL), from TX to
+// RX (MCSM1 TXOFF_MODE) it only settles. CC1101 datasheet, state
+// transition times, the same as the host benchmark (host/cc1101_host.c)
+#define CCM_CAL_US 800
+#define CCM_TX_RX_US 22
+// Every packet arrives with these (RSSI ~ -58dBm, good LQI)
+#define CCM_RSSI 0x20
+#define CCM_LQI 0x04
+
+// DRATE = (256+DRATE_M) * 2^DRATE_E * f_xosc / 2^28 (datasheet 12)
+avr_cycle_count_t ccm_byte_cycles(cc1101_model* m) {
+    double e = m->reg[0x10] & 0x0f;
+    double mant = m->reg[0x11];
+    double rate = (256.0+mant) * (double)(1u<<(int)e) * 26e6 / 268435456.0;
+    return (avr_cycle_count_t)(8.0 * m->avr->frequency / rate);
+}
+
+static void ccm_gdo0(cc1101_model* m, int level) {
+    avr_raise_irq(m->gdo0, level);
+}
+
+// The state after a packet (MCSM1 RXOFF_MODE and TXOFF_MODE). rfboot
+// uses IDLE (0) after RX (RX with RFBOOT_AUTO_RX, MCSM1=0x2F) and RX (3)
+// after TX, we know only these two
+static uint8_t ccm_off_state(uint8_t mode) {
+    return mode==3 ? CCM_RX : CCM_IDLE;
+}
+
+static avr_cycle_count_t ccm_rx_byte(avr_t* avr, avr_cycle_count_t when, void* param);
+static avr_cycle_count_t ccm_rx_sync(avr_t* avr, avr_cycle_count_t when, void* param);
+static avr_cycle_count_t ccm_tx_sync(avr_t* avr, avr_cycle_count_t when, void* param);
+static avr_cycle_count_t ccm_tx_end(avr_t* avr, avr_cycle_count_t when, void* param);
+static avr_cycle_count_t ccm_rx_ready(avr_t* avr, avr_cycle_count_t when, void* param);
+
+static void ccm_abort(cc1101_model* m) {
+    avr_cycle_timer_cancel(m->avr, ccm_rx_sync, m);
+    avr_cycle_timer_cancel(m->avr, ccm_rx_byte, m);
+    avr_cycle_timer_cancel(m->avr, ccm_tx_sync, m);
+    avr_cycle_timer_cancel(m->avr, ccm_tx_end, m);
+    avr_cycle_timer_cancel(m->avr, ccm_rx_ready, m);
+    if (m->airing || m->transmitting) ccm_gdo0(m, 0);
+    m->airing = false;
+    m->transmitting = false;
+}
+
+static void ccm_reset(cc1101_model* m) {
+    ccm_abort(m);
+    memset(m->reg, 0, sizeof(m->reg));
+    // The reset values of the data rate (datasheet), the driver sets them anyway
+    m->reg[0x10] = 0x8C;
+    m->reg[0x11] = 0x22;
+    m->marcstate = CCM_IDLE;
+    m->rx_len = m->rx_pos = 0;
+    m->tx_len = 0;
+    m->rx_off = false;
+}
+
+// The end of the calibration or of the TX to RX switch
+static avr_cycle_count_t ccm_rx_ready(avr_t* avr, avr_cycle_count_t when, void* param) {
+    cc1101_model* m = param;
+    m->marcstate = CCM_RX;
+    if (m->rx_off) {
+        m->rx_turnaround += avr->cycle - m->rx_off_since;
+        m->rx_turnarounds++;
+        m->rx_off = false;
+    }
+    return 0;
+}
+
+// To RX in 'us', the packets that arrive until then are lost
+static void ccm_to_rx(cc1101_model* m, uint8_t state, uint32_t us) {
+    m->marcstate = state;
+    avr_cycle_timer_register_usec(m->avr, us, ccm_rx_ready, m);
+}
+
+static avr_cycle_count_t ccm_rx_sync(avr_t* avr, avr_cycle_count_t when, void* param) {
+    cc1101_model* m = param;
+    ccm_gdo0(m, 1);
+    m->air_pos = 0;
+    avr_cycle_timer_register(m->avr, ccm_byte_cycles(m), ccm_rx_byte, m);
+    return 0;
+}
+
+// One more byte of the packet in the RX FIFO
+static avr_cycle_count_t ccm_rx_byte(avr_t* avr, avr_cycle_count_t when, void* param) {
+    cc1101_model* m = param;
+    if (m->rx_len - m->rx_pos >= 64) {
+        // The MCU did not read the FIFO in time
+        m->marcstate = CCM_RX_OVERFLOW;
+        ccm_gdo0(m, 0);
+        m->airing = false;
+        return 0;
+    }
+    m->rx[m->rx_len++] = m->air.data[m->air_pos++];
+    if (m->air_pos <= m->air.len) return when + ccm_byte_cycles(m);
+    // The status bytes are appended after the CRC
+    m->rx[m->rx_len++] = CCM_RSSI;
+    m->rx[m->rx_len++] = CCM_LQI | 0x80;
+    m->airing = false;
+    m->marcstate = ccm_off_state((m->reg[0x17]>>2) & 3);
+    // RXOFF_MODE RX : no turnaround at all
+    if (m->marcstate == CCM_RX) m->rx_turnarounds++;
+    else {
+        m->rx_off = true;
+        m->rx_off_since = avr->cycle;
+    }
+    ccm_gdo0(m, 0);
+    return 0;
+}
+
+bool ccm_send(cc1101_model* m, const uint8_t* data, uint8_t len) {
+    if (m->marcstate != CCM_RX || m->airing || m->transmitting) return false;
+    if (len+1 > CCM_MAX_PKT || m->rx_len + len + 3 > (int)sizeof(m->rx)) return false;
+    // The length byte is the first byte of the packet
+    m->air.len = len;
+    m->air.data[0] = len;
+    memcpy(m->air.data+1, data, len);
+    m->airing = true;
+    avr_cycle_timer_register(m->avr, CCM_SYNC_BYTES*ccm_byte_cycles(m), ccm_rx_sync, m);
+    return true;
+}
+
+static avr_cycle_count_t ccm_tx_sync(avr_t* avr, avr_cycle_count_t when, void* param) {
+    cc1101_model* m = param;
+    ccm_gdo0(m, 1);
+    // The packet and 2 bytes CRC
+    avr_cycle_timer_register(m->avr, (m->tx_len+2)*ccm_byte_cycles(m), ccm_tx_end, m);
+    return 0;
+}
+
+static avr_cycle_count_t ccm_tx_end(avr_t* avr, avr_cycle_count_t when, void* param) {
+    cc1101_model* m = param;
+    uint8_t len = m->tx[0];
+    if (len > m->tx_len-1) len = m->tx_len-1;
+    m->transmitting = false;
+    m->tx_len = 0;
+    // TXOFF_MODE RX : the packets of the next CCM_TX_RX_US are lost
+    if (ccm_off_state(m->reg[0x17] & 3) == CCM_RX) {
+        ccm_to_rx(m, CCM_TXRX_SWITCH, CCM_TX_RX_US);
+        m->tx_turnaround += avr_usec_to_cycles(avr, CCM_TX_RX_US);
+        m->tx_turnarounds++;
+    }
+    else m->marcstate = CCM_IDLE;
+    ccm_gdo0(m, 0);
+    if (m->on_tx) m->on_tx(m->tx+1, len, m->param);
+    return 0;
+}
+
+static void ccm_strobe(cc1101_model* m, uint8_t cmd) {
+    switch (cmd) {
+    case 0x30: // SRES
+        ccm_reset(m);
+        break;
+    case 0x34: // SRX
+        if (m->marcstate != CCM_IDLE) break;
+        // MCSM0 FS_AUTOCAL 1 : calibrate from IDLE to RX or TX
+        if (((m->reg[0x18]>>4) & 3) == 1) ccm_to_rx(m, CCM_STARTCAL, CCM_CAL_US);
+        else ccm_rx_ready(m->avr, m->avr->cycle, m);
+        break;
+    case 0x35: // STX
+        // CCA : not while a packet arrives
+        if (m->airing || m->transmitting || m->tx_len == 0) break;
+        if (m->marcstate != CCM_IDLE && m->marcstate != CCM_RX) break;
+        m->marcstate = CCM_TX;
+        m->transmitting = true;
+        avr_cycle_timer_register(m->avr, CCM_SYNC_BYTES*ccm_byte_cycles(m), ccm_tx_sync, m);
+        break;
+    case 0x36: // SIDLE
+        ccm_abort(m);
+        m->marcstate = CCM_IDLE;
+        break;
+    case 0x3A: // SFRX
+        m->rx_len = m->rx_pos = 0;
+        if (m->marcstate == CCM_RX_OVERFLOW) m->marcstate = CCM_IDLE;
+        break;
+    case 0x3B: // SFTX
+        m->tx_len = 0;
+        break;
+    default: // SCAL SPWD SNOP etc
+        break;
+    }
+}
+
+static uint8_t ccm_status_reg(cc1101_model* m, uint8_t addr) {
+    int rx = m->rx_len - m->rx_pos;
+    switch (addr) {
+    case 0x31: return 0x14; // VERSION
+    case 0x33: return CCM_LQI | 0x80;
+    case 0x34: return CCM_RSSI;
+    case 0x35: return m->marcstate;
+    // GDO0 and CS (carrier sense)
+    case 0x38: return (m->airing||m->transmitting ? 1 : 0) | (m->airing ? 0x40 : 0);
+    case 0x3A: return m->tx_len & 0x7f;
+    case 0x3B: return (rx>127 ? 127 : rx) | (m->marcstate==CCM_RX_OVERFLOW ? 0x80 : 0);
+    default: return 0;
+    }
+}
+
+// The chip status byte, the reply to every header byte
+static uint8_t ccm_chip_status(cc1101_model* m) {
+    uint8_t state = m->marcstate==CCM_RX ? 1 : m->marcstate==CCM_TX ? 2 :
+        m->marcstate==CCM_STARTCAL ? 4 : m->marcstate==CCM_TXRX_SWITCH ? 5 : 0;
+    return state<<4;
+}
+
+static void ccm_spi(avr_irq_t* irq, uint32_t value, void* param) {
+    cc1101_model* m = param;
+    uint8_t b = value;
+    uint8_t reply = 0;
+    if (!m->selected) return;
+    if (m->addr < 0) {
+        uint8_t addr = b & 0x3f;
+        reply = ccm_chip_status(m);
+        m->read = b & 0x80;
+        m->burst = b & 0x40;
+        // 0x30-0x3D without the burst bit are strobes
+        if (addr>=0x30 && addr<=0x3D && !m->burst) ccm_strobe(m, addr);
+        else m->addr = addr;
+    }
+    else if (m->addr == 0x3F) {
+        if (m->read) reply = m->rx_pos<m->rx_len ? m->rx[m->rx_pos++] : 0;
+        // The FIFO is empty, the next packet starts at 0 again (with
+        // RXOFF_MODE RX there is no SFRX between the packets)
+        if (m->rx_pos == m->rx_len) m->rx_len = m->rx_pos = 0;
+        else if (m->tx_len < (int)sizeof(m->tx)) m->tx[m->tx_len++] = b;
+        if (!m->burst) m->addr = -1;
+    }
+    else if (m->addr >= 0x30) {
+        // PATABLE and the status registers
+        if (m->read) reply = ccm_status_reg(m, m->addr);
+        m->addr = -1;
+    }
+    else {
+        if (m->read) reply = m->reg[m->addr];
+        else m->reg[m->addr] = b;
+        if (m->burst && m->addr<0x2E) m->addr++;
+        else m->addr = -1;
+    }
+    avr_raise_irq(m->spi_in, reply);
+}
+
+// CSn is SS (PB2)
+static void ccm_cs(avr_irq_t* irq, uint32_t value, void* param) {
+    cc1101_model* m = param;
+    m->selected = !value;
+    m->addr = -1;
+}
+
+void ccm_init(cc1101_model* m, avr_t* avr, ccm_tx_cb on_tx, void* param) {
+    memset(m, 0, sizeof(*m));
+    m->avr = avr;
+    m->on_tx = on_tx;
+    m->param = param;
+    m->addr = -1;
+    m->spi_in = avr_io_getirq(avr, AVR_IOCTL_SPI_GETIRQ('0'), SPI_IRQ_INPUT);
+    m->gdo0 = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('D'), 2);
+    avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_SPI_GETIRQ('0'), SPI_IRQ_OUTPUT), ccm_spi, m);
+    avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 2), ccm_cs, m);
+    // MISO low : the crystal is always stable
+    avr_raise_irq(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 4), 0);
+    ccm_gdo0(m, 0);
+    ccm_reset(m);
+}
@@ -0,0 +1,73 @@
+// A CC1101 on the SPI bus of a simavr atmega328p. Only what the rfboot
+// driver (cc1101/cc1101.c) uses : the registers, the strobes, the FIFOs,
+// the status registers and GDO0 (IOCFG0=0x06, high from the sync word to
+// the end of the packet). The air is perfect, every packet arrives with
+// CRC OK, and the timing follows the data rate of MDMCFG4/MDMCFG3. The
+// CC1101 does not receive while it calibrates (IDLE to RX) and while it
+// switches from TX to RX
+#ifndef CC1101_MODEL_H
+#define CC1101_MODEL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "sim_avr.h"
+
+// The longest packet (see CC1101_STREAM_LEN) and the status bytes
+#define CCM_MAX_PKT 136
+
+typedef struct ccm_packet {
+    uint8_t len;
+    uint8_t data[CCM_MAX_PKT];
+} ccm_packet;
+
+// Called when the MCU transmits a packet (at the end of the packet)
+typedef void (*ccm_tx_cb)(const uint8_t* data, uint8_t len, void* param);
+
+typedef struct cc1101_model {
+    avr_t* avr;
+    avr_irq_t* spi_in;
+    avr_irq_t* gdo0;
+    ccm_tx_cb on_tx;
+    void* param;
+
+    uint8_t reg[0x2F];
+    uint8_t marcstate;
+    bool selected;
+    // -1 when the next SPI byte is a header
+    int addr;
+    bool read;
+    bool burst;
+
+    uint8_t rx[256];
+    int rx_len;
+    int rx_pos;
+    uint8_t tx[256];
+    int tx_len;
+
+    // The packet on the air (from the host to the MCU)
+    ccm_packet air;
+    int air_pos;
+    bool airing;
+    bool transmitting;
+
+    // The radio turnarounds (cycles), from the end of a packet until the
+    // CC1101 receives again. A received packet put it out of RX at
+    // rx_off_since (IDLE, then the calibration)
+    bool rx_off;
+    avr_cycle_count_t rx_off_since;
+    avr_cycle_count_t rx_turnaround;
+    unsigned rx_turnarounds;
+    avr_cycle_count_t tx_turnaround;
+    unsigned tx_turnarounds;
+} cc1101_model;
+
+void ccm_init(cc1101_model* m, avr_t* avr, ccm_tx_cb on_tx, void* param);
+
+// The host transmits a packet. Returns false if the MCU is not in RX
+// or the air is busy, the packet is lost then as with a real radio
+bool ccm_send(cc1101_model* m, const uint8_t* data, uint8_t len);
+
+// The cycles of one byte on the air with the current settings
+avr_cycle_count_t ccm_byte_cycles(cc1101_model* m);
+
+#endif
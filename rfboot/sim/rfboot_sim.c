@@ -0,0 +1,304 @@
+/*
+ * simavr benchmark for rfboot
+ *
+ * rfboot_sim.elf (rfboot with the settings of this directory) runs on a
+ * simulated atmega328p @ 8MHz with a CC1101 model on the SPI bus
+ * (cc1101_model.c). This program is rftool and usb2rf : it pings rfboot,
+ * uploads a reference image with the packet by packet upload and reports
+ * the cycles of the sections rfboot marks (sim_marks.h) and the radio
+ * turnarounds of the CC1101 model.
+ *
+ * simavr completes the SPM erase and write at once. Here SPMCSR reads
+ * busy (SPMEN, RWWSB) for SPM_BUSY_US after rfboot starts one, as on a
+ * real chip, so the upload time includes the waits rfboot does not
+ * overlap with the reception. The page write figure is still the work
+ * of the MCU only
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_io.h"
+#include "sim_cycle_timers.h"
+
+#include "xtea.h"
+#include "cc1101_model.h"
+#include "sim_marks.h"
+#include "rfboot_settings.h"
+
+#define PAYLOAD 32
+#define START_SIGNATURE 0xd20f6cdf
+
+// The status codes of rfboot (rfboot.c)
+#define RFB_SEND_PKT 4
+#define RFB_SUCCESS 6
+
+// The reference image. Half of the flash rfboot can write
+#define IMAGE_SIZE 14336
+// usb2rf needs about this time to answer (USB and the serial port)
+#define HOST_LATENCY_US 2000
+// rfboot waits for a ping 250ms after it starts
+#define PING_US 10000
+// and the header 250ms after the IV
+#define HEADER_RETRY_US 100000
+// Simulated seconds before we give up
+#define TIMEOUT_S 60
+
+// GPIOR0 in the data space (I/O address 0x1E)
+#define GPIOR0_ADDR 0x3E
+// SPMCSR in the data space (I/O address 0x37) and its bits
+#define SPMCSR_ADDR 0x57
+#define SPM_SPMEN 0x01
+#define SPM_PGERS 0x02
+#define SPM_PGWRT 0x04
+#define SPM_RWWSB 0x40
+// A page erase or write of the atmega328p (datasheet, tWD_FLASH 3.7-4.5ms)
+#define SPM_BUSY_US 4500
+
+static avr_t* avr;
+static cc1101_model radio;
+
+static uint8_t image[IMAGE_SIZE];
+static uint8_t header[PAYLOAD];
+// The CBC packets, in the order rftool encrypts them (the last first)
+// packets[i] ends at the flash address (i+1)*PAYLOAD
+static uint8_t packets[IMAGE_SIZE/PAYLOAD][PAYLOAD];
+
+static enum { H_PING, H_HEADER, H_UPLOAD, H_DONE } state = H_PING;
+// The last reply of rfboot
+static int result = -1;
+static unsigned requests;
+static unsigned lost;
+// The answer to the first request is sent once more at the end of the
+// request, while the CC1101 of rfboot switches from TX to RX. It must
+// be lost
+static enum { PROBE_WAIT, PROBE_LOST, PROBE_RECEIVED } probe = PROBE_WAIT;
+
+// The packet usb2rf is going to send
+static uint8_t pending[PAYLOAD];
+static uint8_t pending_len;
+
+// The end of the SPM erase or write rfboot started last
+static avr_cycle_count_t spm_busy_until;
+static unsigned spm_ops;
+// An SPM started while the last one runs. A real chip ignores it
+static unsigned spm_overlaps;
+
+static const char* section_names[SIM_SECTIONS] = {
+    "upload", "decrypt (32 bytes)", "page fill+write", "page check", "CRC pass" };
+static struct {
+    avr_cycle_count_t start;
+    avr_cycle_count_t total;
+    avr_cycle_count_t min;
+    avr_cycle_count_t max;
+    unsigned count;
+} sections[SIM_SECTIONS];
+
+// avr-libc _crc16_update, as rftool calculates it
+static uint16_t crc16_update(uint16_t crc, uint8_t a) {
+    crc ^= a;
+    for (int i=0; i<8; i++) {
+        if (crc & 1) crc = (crc>>1) ^ 0xA001;
+        else crc = crc>>1;
+    }
+    return crc;
+}
+
+static void put16(uint8_t* p, uint16_t v) {
+    p[0]=v; p[1]=v>>8;
+}
+
+static void put32(uint8_t* p, uint32_t v) {
+    put16(p, v); put16(p+2, v>>16);
+}
+
+static void encipher_cbc(uint8_t* buf, int len, uint32_t iv[2]) {
+    for (int i=0; i<len; i+=8) {
+        uint32_t v[2];
+        memcpy(v, buf+i, 8);
+        xtea_encipher_cbc(v, XTEA_KEY, iv);
+        memcpy(buf+i, v, 8);
+    }
+}
+
+// The same image on every run. The first word is a "jmp", never 0xffff
+static void make_image(void) {
+    uint32_t x = 12345;
+    for (int i=0; i<IMAGE_SIZE; i++) {
+        x = x*1103515245 + 12345;
+        image[i] = x>>16;
+    }
+    image[0] = 0x0c;
+    image[1] = 0x94;
+}
+
+// The header and the packets, with the IV rfboot sent
+static void encrypt_upload(uint32_t iv[2]) {
+    uint16_t crc=0, crc2=0;
+    for (int i=0; i<IMAGE_SIZE; i++) {
+        crc = crc16_update(crc, image[i]);
+        crc2 = crc16_update(crc2, image[IMAGE_SIZE-1-i]);
+    }
+    memset(header, 0, sizeof(header));
+    put32(header, START_SIGNATURE);
+    put16(header+4, IMAGE_SIZE);
+    put16(header+6, crc);
+    put16(header+8, crc2);
+    put32(header+12, START_SIGNATURE);
+    // options (header[16]) is 0, the packet by packet upload
+    encipher_cbc(header, PAYLOAD, iv);
+    for (int i=IMAGE_SIZE/PAYLOAD-1; i>=0; i--) {
+        memcpy(packets[i], image+i*PAYLOAD, PAYLOAD);
+        encipher_cbc(packets[i], PAYLOAD, iv);
+    }
+}
+
+static avr_cycle_count_t host_send(avr_t* avr, avr_cycle_count_t when, void* param) {
+    if (!ccm_send(&radio, pending, pending_len)) lost++;
+    return 0;
+}
+
+static void host_send_later(const uint8_t* data, uint8_t len) {
+    memcpy(pending, data, len);
+    pending_len = len;
+    avr_cycle_timer_cancel(avr, host_send, NULL);
+    avr_cycle_timer_register_usec(avr, HOST_LATENCY_US, host_send, NULL);
+}
+
+static avr_cycle_count_t host_ping(avr_t* avr, avr_cycle_count_t when, void* param) {
+    uint8_t ping[4];
+    if (state != H_PING) return 0;
+    put32(ping, PING_SIGNATURE);
+    ccm_send(&radio, ping, sizeof(ping));
+    return when + avr_usec_to_cycles(avr, PING_US);
+}
+
+static avr_cycle_count_t host_header(avr_t* avr, avr_cycle_count_t when, void* param) {
+    if (state != H_HEADER) return 0;
+    host_send_later(header, PAYLOAD);
+    return when + avr_usec_to_cycles(avr, HEADER_RETRY_US);
+}
+
+// A packet from rfboot
+static void host_receive(const uint8_t* data, uint8_t len, void* param) {
+    if (state == H_PING && len == 8) {
+        uint32_t iv[2];
+        memcpy(iv, data, 8);
+        encrypt_upload(iv);
+        state = H_HEADER;
+        avr_cycle_timer_register(avr, 1, host_header, NULL);
+    }
+    else if (state != H_DONE && len == 3) {
+        uint16_t idx = data[1] | (data[2]<<8);
+        if (data[0] == RFB_SEND_PKT) {
+            state = H_UPLOAD;
+            requests++;
+            if (idx && idx<=IMAGE_SIZE && idx%PAYLOAD==0) {
+                if (probe == PROBE_WAIT)
+                    probe = ccm_send(&radio, packets[idx/PAYLOAD-1], PAYLOAD) ? PROBE_RECEIVED : PROBE_LOST;
+                host_send_later(packets[idx/PAYLOAD-1], PAYLOAD);
+            }
+        }
+        else {
+            result = data[0];
+            state = H_DONE;
+        }
+    }
+}
+
+static void mark(avr_t* avr, avr_io_addr_t addr, uint8_t v, void* param) {
+    avr->data[addr] = v;
+    if (v==0 || v>2*SIM_SECTIONS) return;
+    int s = (v-1)/2;
+    if (v&1) {
+        sections[s].start = avr->cycle;
+        return;
+    }
+    avr_cycle_count_t c = avr->cycle - sections[s].start;
+    if (!sections[s].count || c<sections[s].min) sections[s].min = c;
+    if (c>sections[s].max) sections[s].max = c;
+    sections[s].total += c;
+    sections[s].count++;
+}
+
+// simavr handles the SPM itself (its flash module has a write hook on
+// SPMCSR too), we only start the busy time of an erase or a write
+static void spm_write(avr_t* avr, avr_io_addr_t addr, uint8_t v, void* param) {
+    avr->data[addr] = v;
+    if ( (v & SPM_SPMEN) && (v & (SPM_PGERS|SPM_PGWRT)) ) {
+        if (avr->cycle < spm_busy_until) spm_overlaps++;
+        spm_busy_until = avr->cycle + avr_usec_to_cycles(avr, SPM_BUSY_US);
+        spm_ops++;
+    }
+}
+
+// boot_spm_busy() and boot_rww_busy() see the SPM running
+static uint8_t spm_read(avr_t* avr, avr_io_addr_t addr, void* param) {
+    uint8_t v = avr->data[addr];
+    if (avr->cycle < spm_busy_until) v |= SPM_SPMEN|SPM_RWWSB;
+    return v;
+}
+
+int main(int argc, char* argv[]) {
+    const char* fname = argc>1 ? argv[1] : "rfboot_sim.elf";
+    elf_firmware_t f;
+    memset(&f, 0, sizeof(f));
+    if (elf_read_firmware(fname, &f)) {
+        fprintf(stderr, "Cannot read %s\n", fname);
+        return 1;
+    }
+    avr = avr_make_mcu_by_name("atmega328p");
+    if (!avr) {
+        fprintf(stderr, "simavr does not know the atmega328p\n");
+        return 1;
+    }
+    avr_init(avr);
+    // An empty flash, rfboot waits for an upload
+    memset(avr->flash, 0xff, avr->flashend+1);
+    avr_load_firmware(avr, &f);
+    avr->frequency = 8000000;
+    // BOOTRST fuse (hfuse 0xD8)
+    avr->pc = avr->reset_pc = 0x7000;
+
+    ccm_init(&radio, avr, host_receive, NULL);
+    avr_register_io_write(avr, GPIOR0_ADDR, mark, NULL);
+    avr_register_io_write(avr, SPMCSR_ADDR, spm_write, NULL);
+    avr_register_io_read(avr, SPMCSR_ADDR, spm_read, NULL);
+    make_image();
+    avr_cycle_timer_register_usec(avr, PING_US, host_ping, NULL);
+
+    avr_cycle_count_t timeout = (avr_cycle_count_t)TIMEOUT_S * avr->frequency;
+    // We stop after the last mark (it comes after the last reply)
+    while (!sections[0].count && avr->cycle < timeout) {
+        int st = avr_run(avr);
+        if (st == cpu_Done || st == cpu_Crashed) break;
+    }
+
+    bool flash_ok = !memcmp(avr->flash, image, IMAGE_SIZE);
+    printf("rfboot simavr benchmark, %d bytes, packet by packet upload\n", IMAGE_SIZE);
+    printf("%-20s %8s %12s %10s %10s %10s\n", "section", "count", "cycles", "average", "min", "max");
+    for (int s=0; s<SIM_SECTIONS; s++) {
+        if (!sections[s].count) continue;
+        printf("%-20s %8u %12llu %10llu %10llu %10llu\n", section_names[s], sections[s].count,
+            (unsigned long long)sections[s].total,
+            (unsigned long long)(sections[s].total/sections[s].count),
+            (unsigned long long)sections[s].min, (unsigned long long)sections[s].max);
+    }
+    if (sections[0].count) {
+        printf("upload time %.1f ms (%u requests, %u packets lost)\n",
+            sections[0].total*1000.0/avr->frequency, requests, lost);
+    }
+    if (radio.rx_turnarounds && radio.tx_turnarounds) {
+        printf("radio turnaround us : %.1f after a packet to rfboot, %.1f after a packet from rfboot\n",
+            radio.rx_turnaround*1e6/avr->frequency/radio.rx_turnarounds,
+            radio.tx_turnaround*1e6/avr->frequency/radio.tx_turnarounds);
+    }
+    printf("SPM erase and write : %u, %d us each, %u started while one was running\n",
+        spm_ops, SPM_BUSY_US, spm_overlaps);
+    printf("packet during the TX to RX switch : %s\n",
+        probe==PROBE_LOST ? "lost" : probe==PROBE_RECEIVED ? "RECEIVED" : "not sent");
+    printf("result %d, flash %s\n", result, flash_ok ? "OK" : "DIFFERENT");
+    return (result==RFB_SUCCESS && flash_ok && probe==PROBE_LOST && !spm_overlaps) ? 0 : 1;
+}
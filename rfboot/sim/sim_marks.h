@@ -0,0 +1,24 @@
+// Section markers for the simavr benchmark. rfboot (compiled with
+// -DRFBOOT_SIM) writes the number of a section to GPIOR0 when it starts,
+// and the number+1 when it ends. rfboot_sim counts the cycles between them.
+// GPIOR0 is not used by rfboot, and a write to it takes 1 cycle
+#ifndef SIM_MARKS_H
+#define SIM_MARKS_H
+
+// From the header to the last reply
+#define SIM_UPLOAD 1
+// XTEA decryption (or the CTR XOR) of a 32 byte packet
+#define SIM_DECRYPT 3
+// The page fill of an SPM page and the start of the write (flash_poll)
+#define SIM_FILL 5
+// The check of a written page, and the DATA_PAGE mark (flash_poll)
+#define SIM_VERIFY 7
+// The CRC check of the whole application
+#define SIM_CRC 9
+#define SIM_SECTIONS 5
+
+#ifdef __AVR__
+#define SIM_MARK(m) (GPIOR0 = (m))
+#endif
+
+#endif
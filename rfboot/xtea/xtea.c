@@ -49,4 +49,52 @@ void xtea_decipher_cbc( uint32_t v[2], const uint32_t key[4], uint32_t iv[2] ) {
     iv[1]=c1;
 }
 
+// The 2 keys of every decryption round, in the order xtea_decipher uses them
+// sum + key[(sum>>11) & 3] and (sum-delta) + key[(sum-delta) & 3]
+uint32_t xtea_rk[64];
+
+void xtea_set_key( const uint32_t key[4] ) {
+    static const uint8_t num_rounds=32;
+    uint32_t delta=0x9E3779B9, sum=delta*num_rounds;
+    uint8_t i;
+    for (i=0; i < 2*num_rounds; i+=2) {
+        xtea_rk[i] = sum + key[(sum>>11) & 3];
+        sum -= delta;
+        xtea_rk[i+1] = sum + key[sum & 3];
+    }
+}
+
+#ifndef __AVR__
+void xtea_decipher_rk( uint32_t v[2] ) {
+    uint32_t v0=v[0], v1=v[1];
+    uint8_t i;
+    for (i=0; i < 64; i+=2) {
+        v1 -= (((v0 << 4) ^ (v0 >> 5)) + v0) ^ xtea_rk[i];
+        v0 -= (((v1 << 4) ^ (v1 >> 5)) + v1) ^ xtea_rk[i+1];
+    }
+    v[0]=v0; v[1]=v1;
+}
+
+// The same as xtea_encipher, with the round keys from the last one
+void xtea_encipher_rk( uint32_t v[2] ) {
+    uint32_t v0=v[0], v1=v[1];
+    uint8_t i;
+    for (i=64; i > 0; i-=2) {
+        v0 += (((v1 << 4) ^ (v1 >> 5)) + v1) ^ xtea_rk[i-1];
+        v1 += (((v0 << 4) ^ (v0 >> 5)) + v0) ^ xtea_rk[i-2];
+    }
+    v[0]=v0; v[1]=v1;
+}
+#endif
+
+void xtea_decipher_cbc_rk( uint32_t v[2], uint32_t iv[2] ) {
+    uint32_t c0=v[0];
+    uint32_t c1=v[1];
+    xtea_decipher_rk(v);
+    v[0] ^= iv[0];
+    v[1] ^= iv[1];
+    iv[0]=c0;
+    iv[1]=c1;
+}
+
 #endif
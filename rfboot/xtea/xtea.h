@@ -9,4 +9,13 @@ void xtea_encipher_cbc( uint32_t v[2], const uint32_t key[4], uint32_t iv[2] );
 void xtea_decipher( uint32_t v[2], const uint32_t key[4] );
 void xtea_decipher_cbc( uint32_t v[2], const uint32_t key[4], uint32_t iv[2] );
 
+// The same decryption with the round keys calculated once, by xtea_set_key.
+// xtea_encipher_rk encrypts with them (the CTR keystream).
+// On AVR both are in assembly (xtea_avr.S)
+extern uint32_t xtea_rk[64];
+void xtea_set_key( const uint32_t key[4] );
+void xtea_decipher_rk( uint32_t v[2] );
+void xtea_encipher_rk( uint32_t v[2] );
+void xtea_decipher_cbc_rk( uint32_t v[2], uint32_t iv[2] );
+
 #endif
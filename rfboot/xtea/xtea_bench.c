@@ -0,0 +1,80 @@
+// Benchmark of the XTEA decryption. Not part of rfboot.
+// Timer1 counts CPU cycles (no prescaler), and the cycles per 8 byte
+// block of xtea_decipher (C) and xtea_decipher_rk (assembly) are printed
+// on the serial port. Also checks that both give the same result.
+// Build with "make bench" in the rfboot directory
+
+#include <avr/io.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xtea.h"
+
+#ifndef BAUD
+#define BAUD 38400
+#endif
+
+static const uint32_t key[4] = { 0x01234567, 0x89abcdef, 0xfedcba98, 0x76543210 };
+
+static void uart_init(void) {
+    uint16_t ubrr = (F_CPU/8/BAUD)-1;
+    UBRR0H = ubrr >> 8;
+    UBRR0L = ubrr & 0xff;
+    UCSR0A = _BV(U2X0);
+    UCSR0B = _BV(TXEN0);
+}
+
+static void uart_print(const char* s) {
+    while (*s) {
+        loop_until_bit_is_set(UCSR0A, UDRE0);
+        UDR0 = *s++;
+    }
+}
+
+static void report(const char* name, uint16_t cycles) {
+    char buf[8];
+    uart_print(name);
+    uart_print(utoa(cycles, buf, 10));
+    uart_print(" cycles\r\n");
+}
+
+int main(void) {
+    uint32_t v1[2] = { 0xdeadbeef, 0x01020304 };
+    uint32_t v2[2];
+    uint16_t c_cycles, rk_cycles, setkey_cycles;
+
+    uart_init();
+    TCCR1A = 0;
+    TCCR1B = _BV(CS10);
+
+    memcpy(v2, v1, sizeof(v1));
+
+    TCNT1 = 0;
+    xtea_decipher(v1, key);
+    c_cycles = TCNT1;
+
+    TCNT1 = 0;
+    xtea_set_key(key);
+    setkey_cycles = TCNT1;
+
+    TCNT1 = 0;
+    xtea_decipher_rk(v2);
+    rk_cycles = TCNT1;
+
+    report("xtea_decipher    : ", c_cycles);
+    report("xtea_set_key     : ", setkey_cycles);
+    report("xtea_decipher_rk : ", rk_cycles);
+    uart_print( memcmp(v1, v2, sizeof(v1)) ? "ERROR: results differ\r\n" : "results OK\r\n" );
+
+    // The CTR keystream block, encrypted both ways
+    xtea_encipher(v1, key);
+    TCNT1 = 0;
+    xtea_encipher_rk(v2);
+    rk_cycles = TCNT1;
+    report("xtea_encipher_rk : ", rk_cycles);
+    uart_print( memcmp(v1, v2, sizeof(v1)) ? "ERROR: results differ\r\n" : "results OK\r\n" );
+
+    while (1);
+}
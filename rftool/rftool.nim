@@ -30,7 +30,7 @@ const BOOTLOADER_SIZE = 4096
 # We use the same .c file as rfboot for xtea functions
 
 {.compile: "xtea.c".}
-#proc xtea_encipher(v: var array[2,uint32], key : array[4,uint32] ) {.importc.}
+proc xtea_encipher(v: var array[2,uint32], key : array[4,uint32] ) {.importc.}
 proc xtea_encipher_cbc( v: var array[2,uint32], key : array[4,uint32], iv: var array[2,uint32] ) {.importc.}
 proc xtea_decipher(v: var array[2,uint32], key : array[4,uint32] ) {.importc.}
 #proc xtea_decipher_cbc( v: var array[2,uint32], key : array[4,uint32], iv: var array[2,uint32] ) {.importc.}
@@ -39,10 +39,50 @@ proc xtea_decipher(v: var array[2,uint32], key : array[4,uint32] ) {.importc.}
 # and finally arrive to the serial port
 const RFB_NO_SIGNATURE = 1
 const RFB_INVALID_CODE_SIZE = 2
-#const RFB_IDENTICAL_CODE = 3 **Not used anymore**
+const RFB_IDENTICAL_CODE = 3 # Only with delta upload
 const RFB_SEND_PKT = 4
 const RFB_WRONG_CRC=5
 const RFB_SUCCESS=6
+const RFB_SEND_PAGE=7
+const RFB_PAGE_HASH=8
+const RFB_SEND_MAP=9
+const RFB_OPTIONS=10
+const RFB_RESUME_MAP=11
+const RFB_FAST=12
+const RFB_FEC=13
+
+# Option bits of the header (start_packet.options in rfboot.c)
+# Earlier rfboot versions ignore them
+const RFB_OPT_WINDOW = 1
+const RFB_OPT_DELTA = 2
+const RFB_OPT_PACKED = 4 # Only if rfboot is compiled with COMPRESSION=1
+const RFB_OPT_CRC32 = 8
+const RFB_OPT_RESUME = 16 # Only the same application, after an interrupted upload
+const RFB_OPT_FAST = 32 # ~100Kbps after the handshake. Needs usb2rf version 4
+const RFB_OPT_CTR = 64 # Application packets in CTR mode, see xteaCtr
+const RFB_OPT_GROUP = 128 # Multicast upload, see actionGroup
+# The second option byte (start_packet.options2). Only with FEC=1 in
+# hardware_settings.mk, and the window mode. Needs usb2rf version 7
+const RFB_OPT2_FEC = 1 # The CC1101 FEC and fixed length packets after the handshake
+const RFB_OPT2_PARITY = 2 # A parity packet after the packets of every SPM page
+# rfboot on the atmega1284p and the atmega2560 needs this one. The size
+# has 24 bits and RFB_SEND_PAGE has 7 bytes (16 bit mask, 24 bit idx).
+# Needs usb2rf version 8
+const RFB_OPT2_FAR = 4
+# The EEPROM image of the application after the flash. Only with EEPROM=1
+# in hardware_settings.mk. rfboot asks for its packets with RFB_SEND_PKT
+# and we answer them, usb2rf is a plain bridge at that point
+const RFB_OPT2_EEPROM = 8
+# Link telemetry. Only with TELEMETRY=1 in hardware_settings.mk. The final
+# reply has the packets rebuilt from the parity and the records of the last
+# StatsHistory uploads rfboot keeps in DATA_PAGE (see printStats). The
+# EEPROM requests have the RSSI and the LQI of the last packet
+const RFB_OPT2_STATS = 16
+const StatsHistory = 3
+# The record of an upload that did not finish
+const StatsStarted = 0x7f
+# The FEC packets, the length byte, the idx and 32 bytes
+const FecPacketLen = 1+2+32
 
 const ApplicationSettingsFile = "app_settings.h"
 const RfbootSettingsFile = "rfboot/rfboot_settings.h"
@@ -51,11 +91,18 @@ const RfbootSettingsFile = "rfboot/rfboot_settings.h"
 # Also rfboot uses the last application page (128 bytes) to store IV and upload counter
 # so maximum application size = 32K-4K-128
 const SPM_PAGE_SIZE = 128
-const MaxAppSize = 32*1024 - BOOTLOADER_SIZE - SPM_PAGE_SIZE
+const MaxAppSize328 = 32*1024 - BOOTLOADER_SIZE - SPM_PAGE_SIZE
+# The atmega2560 has 256K, an 8K rfboot and pages of 256 bytes. rfboot
+# knows the flash of its MCU and reports RFB_INVALID_CODE_SIZE
+const MaxAppSize = 256*1024 - 8192 - 256
 
 const StartSignature = 0xd20f6cdf.uint32 # This is expected from rfboot. Do not change
 const Payload = 32 # The same as rfboot. This is the RF packet size
+const Unit = 16 # The same as rfboot. Window mode packets contain units of 16 bytes
 const CommdModeStr = "COMMD" # This word, switches the usb2rf module to command mode
+const Usb2rfStartMessage = "USB2RF" # usb2rf sends it after a reset
+# usb2rf version 9 and later. The framed link (see writeFrame) at this baud rate
+const FramedBaud = 500000
 const RandomGen = "/dev/urandom"
 const homeconfig = "~/.usb2rf"
 const serialPortDir = "/dev/serial/by-id"
@@ -101,6 +148,62 @@ proc crc16_rev(buf: string): uint16 =
   for i,c in buf:
     crc16_update(result,buf[buf.high-i].uint8)
 
+# CRC32 (the same as zlib) of the reversed string. With RFB_OPT_CRC32
+# rfboot calculates it while the pages are written, from the last page to the first
+proc crc32_rev(buf: string): uint32 =
+  result = 0xffffffff'u32
+  for i in countdown(buf.high, 0):
+    result = result xor buf[i].uint32
+    for j in 0 .. 7:
+      if (result and 1) == 1:
+        result = (result shr 1) xor 0xEDB88320'u32
+      else:
+        result = result shr 1
+  result = not result
+
+# LZ compression for the RFB_OPT_PACKED upload. The format is
+# the one lz_feed() in rfboot.c expects :
+# 0LLLLLLL          : L+1 literal bytes follow
+# 1LLLLLLH OOOOOOOO : copy L+3 bytes, starting (H*256+O+1) bytes back
+# The search is brute force, the applications are small anyway
+const LzWindow = 512 # The same as LZ_WINDOW in rfboot.c
+const LzMinMatch = 3
+const LzMaxMatch = 66
+const LzMaxLiterals = 128
+
+proc addLiterals(dst: var string, lit: var string) =
+  if lit.len>0:
+    dst.add char(lit.len-1)
+    dst.add lit
+    lit = ""
+
+proc lzCompress(buf: string): string =
+  result = ""
+  var lit = ""
+  var i = 0
+  while i<buf.len:
+    var bestLen = 0
+    var bestOff = 0
+    for off in 1..min(LzWindow, i):
+      var l = 0
+      while l<LzMaxMatch and i+l<buf.len and buf[i+l]==buf[i-off+l]:
+        l+=1
+      if l>bestLen:
+        bestLen = l
+        bestOff = off
+    if bestLen>=LzMinMatch:
+      result.addLiterals lit
+      result.add char(0x80 or ((bestLen-LzMinMatch) shl 1) or ((bestOff-1) shr 8))
+      result.add char((bestOff-1) and 0xff)
+      i+=bestLen
+    else:
+      lit.add buf[i]
+      i+=1
+      if lit.len==LzMaxLiterals:
+        result.addLiterals lit
+  result.addLiterals lit
+
+
 # Reads the configuration file and extracts the XTEA key
 proc parseKey(keyStr: string): array[4,uint32] =
   const msg = "XTEA_KEY: Expecting 4 integers (0 to 4294967295) separated by comma"
@@ -154,6 +257,22 @@ proc xteaEncipherCbc(st: string, key: array[4,uint32], iv: var array[2,uint32] )
     pkt[7]=char(x[1])
     result.add pkt
 
+# encrypts a string with xtea-ctr (RFB_OPT_CTR). "address" is where the string
+# is in flash. The keystream of the 8 byte block at flash address "a" is
+# the xtea encryption of {iv[0] or 0x80000000, iv[1] xor a}, with the IV
+# rfboot sends. The plain IVs have a 16 bit counter in iv[0], so this is
+# never the encryption of an IV (see help/Encryption.md)
+proc xteaCtr(st: string, key: array[4,uint32], iv: array[2,uint32], address: int) : string =
+  assert(st.len mod 8 == 0, "String to be encrypted must have size multiple of 8 bytes")
+  result = st
+  for i in countup(0 , st.len - 1, step=8):
+    var x = [iv[0] or 0x80000000'u32, iv[1] xor (address+i).uint32]
+    xtea_encipher(x,key)
+    for j in 0..7:
+      let k = if j<4: x[0] shr (8*j) else: x[1] shr (8*(j-4))
+      result[i+j] = char(result[i+j].uint32 xor (k and 0xff))
+
+
 proc getKnownPorts() : seq[string] =
   result = @[]
   if not homeconfig.expandTilde.existsFile:
@@ -527,12 +646,58 @@ proc getChar(port: SerialPort, timeout  = 1000): int =
   return buf[0].int
 
 
-proc drain(port: SerialPort, timeout = 1000.int32) =
-  while port.getChar(timeout) != -1:
-    discard
+# The framed link of usb2rf version 9 ("B" command, startFramedLink). Every
+# packet and command we write is a SLIP frame : the type ('T' packet for
+# the radio, 'C' command), the data and the CRC16 of both, and usb2rf sends
+# the packets it receives as 'R' frames. There is no 2ms silence per packet
+# and no "COMMD". The upload modes ("U", "P") keep their own protocol, only
+# the packets they forward at the end are frames. A reset ends it
+var framedLink = false
+# The data of the 'R' frames getPacket did not return yet
+var rxFrames = ""
 
+proc slipEscape(data: string): string =
+  result = ""
+  for c in data:
+    if c == '\xC0': result.add "\xDB\xDC"
+    elif c == '\xDB': result.add "\xDB\xDD"
+    else: result.add c
+
+proc writeFrame(port: SerialPort, kind: char, data: string) =
+  let body = kind & data
+  discard port.write "\xC0" & slipEscape(body & body.crc16.toString) & "\xC0"
+
+# Reads frames until an 'R' frame with a good CRC. false after "timeout" ms
+# without data
+proc readFrame(port: SerialPort, timeout: int): bool =
+  var frame = ""
+  var esc = false
+  while true:
+    let c = port.getChar(timeout)
+    if c == -1:
+      return false
+    elif c == 0xC0:
+      if frame.len >= 3 and frame[0] == 'R' and
+      frame[0..frame.len-3].crc16 == frame[frame.len-2].uint16 + 256*frame[frame.len-1].uint16:
+        rxFrames.add frame[1..frame.len-3]
+        return true
+      frame = ""
+    elif c == 0xDB:
+      esc = true
+    else:
+      frame.add(if not esc: c.char elif c == 0xDC: '\xC0' else: '\xDB')
+      esc = false
 
 proc getPacket(port: SerialPort, timeout = 100, size = 1000000): string =
+  if framedLink:
+    while rxFrames.len < size:
+      if not port.readFrame(timeout):
+        break
+    if rxFrames.len > 0:
+      let n = min(size, rxFrames.len)
+      result = rxFrames[0..n-1]
+      rxFrames = rxFrames[n..rxFrames.high]
+    return
   var sz = size;
   while (sz>0):
     let res = port.getChar(timeout)
@@ -544,16 +709,162 @@ proc getPacket(port: SerialPort, timeout = 100, size = 1000000): string =
     sz-=1
 
 
+proc drain(port: SerialPort, timeout = 1000.int32) =
+  while port.getChar(timeout) != -1:
+    discard
+  rxFrames = ""
+
+
+# A usb2rf command, "COMMD" and the command, or a 'C' frame
+proc command(port: SerialPort, cmd: string) =
+  if framedLink:
+    port.writeFrame('C', cmd)
+  else:
+    discard port.write CommdModeStr & cmd
+
+
+# A packet for the radio. Without the framed link usb2rf sends it after
+# 2ms without data, or at once if it has 32 bytes
+proc sendRf(port: SerialPort, data: string) =
+  if framedLink:
+    port.writeFrame('T', data)
+  else:
+    discard port.write data
+
+
+# rfboot replies are 3 bytes, except RFB_SEND_PAGE which
+# also contains the mask of the requested units and the packet size, RFB_PAGE_HASH
+# (first page, number of pages and then a CRC16 for every page) and RFB_RESUME_MAP
+# (the map of the pages not written yet)
+# With RFB_OPT2_FAR ("far") RFB_SEND_PAGE has 2 more bytes, and with
+# RFB_OPT2_STATS ("stats") RFB_SEND_PKT and the final reply (statsLen)
+proc statsLen(reply: int): int =
+  if reply==RFB_SEND_PKT: 2
+  elif reply in [RFB_SUCCESS, RFB_IDENTICAL_CODE, RFB_WRONG_CRC]: 1 + 8*StatsHistory
+  else: 0
+
+proc getReply(port: SerialPort, timeout = 100, far = false, stats = false): string =
+  result = port.getPacket(timeout, 3)
+  if result!=nil and result.len==3:
+    var extra = 0
+    if result[0].int==RFB_SEND_PAGE:
+      extra = if far: 4 else: 2
+    elif result[0].int==RFB_PAGE_HASH:
+      extra = 2*result[2].int
+    elif result[0].int==RFB_RESUME_MAP:
+      extra = (Payload-4) + 1 - 3 # the map and the code
+    elif stats:
+      extra = statsLen(result[0].int)
+    if extra>0:
+      let rest = port.getPacket(timeout, extra)
+      if rest!=nil:
+        result.add rest
+
+
+# The CC1101 RSSI register in dBm (the datasheet, RSSI offset 74)
+proc rssiDbm(raw: int): float =
+  (if raw >= 128: raw-256 else: raw).float / 2 - 74
+
+
+# RFB_OPT2_STATS. The uploads rfboot remembers, this one first : the time
+# from the header to the reply, the requests rfboot repeated, the packets
+# with a wrong CRC and the worst RSSI and LQI. A weak RSSI with many resends
+# is the antenna or the distance, a good link that fails is the firmware
+proc printStats(reply: string) =
+  if reply.len < 4 + 8*StatsHistory:
+    return
+  for i in 0..<StatsHistory:
+    let r = reply[4+8*i .. 11+8*i]
+    let name = if i==0: "This upload" else: "Earlier upload " & $i
+    case r[7].int
+    of 0xff:
+      continue
+    of StatsStarted:
+      echo name, " : did not finish"
+      continue
+    of RFB_WRONG_CRC:
+      echo name, " : CRC check failed"
+    else:
+      echo name, " : OK"
+    echo "  ", (r[0].int + 256*r[1].int).float/10, " sec, ", r[2].int + 256*r[3].int,
+      " requests repeated, ", r[4].int, " CRC errors, worst RSSI ", rssiDbm(r[5].int),
+      " dBm, worst LQI ", r[6].int
+
+
+# Earlier usb2rf firmware does not answer to the "V" command
+# so it is version 1
+proc getUsb2rfVersion(port: SerialPort): int =
+  port.command "V"
+  let v = port.getPacket(20, 2)
+  if v!=nil and v.len==2 and v[0]=='V':
+    return v[1].int
+  else:
+    return 1
+
+
 proc setChannel(port: SerialPort, channel: 0..10) =
-  discard port.write CommdModeStr & "C" & channel.char
+  port.command "C" & channel.char
   port.drain 10
 
 
 proc setSyncWord(port: SerialPort, address: string) =
-  discard port.write CommdModeStr & "A" & address
+  port.command "A" & address
   port.drain 10
 
 
+# usb2rf version 4 and later. The same settings as rfboot with RFB_OPT_FAST
+proc setFastModem(port: SerialPort, fast: bool) =
+  port.command "M" & fast.char
+  sleep 3
+
+# usb2rf version 7 and later. The FEC packets of "len" bytes, 0 is off
+proc setFec(port: SerialPort, len: int) =
+  port.command "F" & len.char
+  sleep 3
+
+
+# usb2rf version 9 and later. usb2rf answers at 38400 baud and then
+# expects frames at FramedBaud. The baud rate goes as hundreds of baud.
+# Earlier versions ignore the command, and we keep the raw link
+proc startFramedLink(port: SerialPort, usb2rfVersion: int) =
+  if usb2rfVersion < 9:
+    return
+  let code = (FramedBaud div 100).uint16.toString
+  port.command "B" & code
+  if port.getPacket(50, 3) == "B" & code:
+    port.baudRate = FramedBaud.int32
+    framedLink = true
+    echo "usb2rf link at ", FramedBaud, " baud"
+
+
+# usb2rf version 10 and later : the packets usb2rf lost (its queue was
+# full or the CC1101 FIFO overflowed), and the frames with a bad CRC
+proc printUsb2rfLosses(port: SerialPort, usb2rfVersion: int) =
+  if usb2rfVersion < 10:
+    return
+  port.command "S"
+  let s = port.getPacket(50, 5)
+  if s!=nil and s.len==5 and s[0]=='S':
+    echo "usb2rf : ", s[1].int + 256*s[2].int, " packets lost, ",
+      s[3].int + 256*s[4].int, " bad frames"
+
+
+# The software reset. usb2rf starts again at 38400 baud without the framed
+# link, and reports Usb2rfStartMessage. If an earlier rftool stopped with
+# the framed link, the reset goes in a frame
+proc resetUsb2rf(port: SerialPort): bool =
+  framedLink = false
+  port.drain 5
+  discard port.write CommdModeStr & "Z"
+  if port.getPacket(200, len(Usb2rfStartMessage)) == Usb2rfStartMessage:
+    return true
+  port.baudRate = FramedBaud.int32
+  port.writeFrame('C', "Z")
+  sleep 1
+  port.baudRate = 38400
+  return port.getPacket(200, len(Usb2rfStartMessage)) == Usb2rfStartMessage
+
+
 proc actionCreate() =
   const SkelDir = "skel"
   const RfbDir = "rfboot"
@@ -642,7 +953,9 @@ proc actionCreate() =
     echo "Application channel = ", appChannel
 
 
-proc actionUpload(appFileName: string, timeout=10.0) =
+# The application binary (.elf .hex .bin), padded with 0xff to a multiple
+# of Payload
+proc loadApp(appFileName: string): string =
   if appFileName==nil or appFileName.len<5:
     stderr.writeLine "Unknown file type : ", appFileName
     quit QuitFailure
@@ -661,51 +974,133 @@ proc actionUpload(appFileName: string, timeout=10.0) =
     stderr.writeLine "Unknown file type : ", appFileName
     quit QuitFailure
 
-  var app = getApp(binaryFileName)
+  result = getApp(binaryFileName)
   # Pad the app with 0xFF to multiple of Payload
   block:
-    let modulo = app.len mod Payload
+    let modulo = result.len mod Payload
     if modulo != 0:
-      app.add '\xff'.repeat(Payload-modulo)
-  let (rfbChannel,rfbootSyncWord,key,pingSignature) = getUploadParams()
-  let (newAppChannel, newAppSyncWord, newResetString) = getAppParams()
-  var appChannel: int
-  var appSyncWord = "12"
-  var resetString: string
-  #var round: int
+      result.add '\xff'.repeat(Payload-modulo)
+
+
+# The EEPROM image of the application (the .eeprom section of the .elf, or
+# the .eep file Arduino makes next to the .hex). "" if there is none
+proc loadEeprom(appFileName: string): string =
+  result = ""
+  let baseName = appFileName[0..appFileName.len-5]
+  let eepromFileName = baseName & ".eep.bin"
+  var args: seq[string]
+  if appFileName.toLowerAscii.endswith(".elf"):
+    args = @[ "-j", ".eeprom", "--change-section-lma", ".eeprom=0", "-O", "binary", appFileName, eepromFileName ]
+  elif appFileName.toLowerAscii.endswith(".hex") and existsFile(baseName & ".eep"):
+    args = @[ "-I", "ihex", "-O", "binary", baseName & ".eep", eepromFileName ]
+  else:
+    return
+  echo "avr-objcopy ", args.join(" ")
+  let p = startProcess( command="avr-objcopy", args=args, options={poStdErrToStdOut, poUsePath, poParentStreams} )
+  discard waitForExit(p)
+  if existsFile(eepromFileName):
+    result = readFile(eepromFileName)
+  if result.len > 0xffff:
+    stderr.writeLine "Very big EEPROM image : ", result.len, " bytes"
+    quit QuitFailure
+
+
+# The settings the application has now (.lastupload), which we use to
+# send the reset string. The new ones are used after the upload
+proc getResetParams(newAppChannel: int, newAppSyncWord, newResetString: string) : tuple[appChannel:int, appSyncWord:string, resetString: string] =
+  result.appSyncWord = "12"
   try:
     let lastupload = open(".lastupload", fmRead)
-    appChannel= lastupload.readline.strip.parseInt
-    appSyncWord[0] = lastupload.readline.strip.parseInt.char
-    appSyncWord[1] = lastupload.readline.strip.parseInt.char
-    resetString = lastupload.readline.strip
+    result.appChannel= lastupload.readline.strip.parseInt
+    result.appSyncWord[0] = lastupload.readline.strip.parseInt.char
+    result.appSyncWord[1] = lastupload.readline.strip.parseInt.char
+    result.resetString = lastupload.readline.strip
     lastupload.close
   except IOError:
-    appChannel = newAppChannel
-    appSyncWord = newAppSyncWord
-    resetString = newResetString
-  if resetString!=nil or resetString!="" or resetString!="MANUAL":
-    if newAppChannel!=appChannel:
-      stderr.writeLine "WARNING : appChannel changed to ", newAppChannel, ". Using the old ", appChannel, " to send the reset signal"
-    if newAppSyncWord != appSyncWord:
-      stderr.writeLine "WARNING : appSyncWord changed to ", newAppSyncWord.toArray, ". Using the old ", appSyncWord.toArray, " to send the reset signal"
-    if newResetString != resetString:
-      stderr.writeLine "WARNING : resetString changed to ", newResetString, ". Using the old ", resetString, " to send the reset signal"
+    result.appChannel = newAppChannel
+    result.appSyncWord = newAppSyncWord
+    result.resetString = newResetString
+  if result.resetString!=nil or result.resetString!="" or result.resetString!="MANUAL":
+    if newAppChannel!=result.appChannel:
+      stderr.writeLine "WARNING : appChannel changed to ", newAppChannel, ". Using the old ", result.appChannel, " to send the reset signal"
+    if newAppSyncWord != result.appSyncWord:
+      stderr.writeLine "WARNING : appSyncWord changed to ", newAppSyncWord.toArray, ". Using the old ", result.appSyncWord.toArray, " to send the reset signal"
+    if newResetString != result.resetString:
+      stderr.writeLine "WARNING : resetString changed to ", newResetString, ". Using the old ", result.resetString, " to send the reset signal"
+
+
+# "options2" is RFB_OPT2_FEC and RFB_OPT2_PARITY, for long or obstructed links.
+# "ctr" asks for RFB_OPT_CTR, see help/Encryption.md for what it costs.
+# "fast" asks for RFB_OPT_FAST, see rfboot/host/README.md for the gain
+proc actionUpload(appFileName: string, timeout=10.0, options2=0, ctr=false, fast=false) =
+  var options2 = options2
+  var app = loadApp(appFileName)
+  let eeprom = loadEeprom(appFileName)
+  let (rfbChannel,rfbootSyncWord,key,pingSignature) = getUploadParams()
+  let (newAppChannel, newAppSyncWord, newResetString) = getAppParams()
+  let (appChannel, appSyncWord, resetString) = getResetParams(newAppChannel, newAppSyncWord, newResetString)
   let portname = getPortName()
   let port = portname.openPort()
 
-  var header = StartSignature.uint32.toString & app.len.uint16.toString &
-    app.crc16.toString & app.crc16_rev.toString & 0.uint16.toString &
-    StartSignature.uint32.toString & newString(16)
-
   var smallHeader = pingSignature.toString
-  port.drain 5
-  discard port.write CommdModeStr & "Z"  # fast reset
-  const USB2RF_START_MESSAGE = "USB2RF"
-  let p = port.getPacket(200, len(USB2RF_START_MESSAGE) )
-  if p!=USB2RF_START_MESSAGE:
+  if not port.resetUsb2rf():
     stderr.writeLine "Cannot contact usb2rf"
     quit QuitFailure
+  port.drain 5
+  let usb2rfVersion = port.getUsb2rfVersion()
+  port.startFramedLink usb2rfVersion
+  # The options we ask from rfboot. An earlier rfboot ignores them
+  # and we fall back to the packet by packet upload
+  # The page by page check works with any usb2rf
+  var options = RFB_OPT_CRC32
+  # usb2rf version 2 has an earlier window mode, not compatible
+  if usb2rfVersion >= 4:
+    # A previous rftool may have stopped with the fast modem settings
+    port.setFastModem false
+    if fast:
+      options = options or RFB_OPT_FAST
+  elif fast:
+    echo "usb2rf firmware is version ", usb2rfVersion, ". The fast data rate needs version 4"
+  if usb2rfVersion >= 7:
+    port.setFec 0
+  elif options2 != 0:
+    echo "usb2rf firmware is version ", usb2rfVersion, ". The FEC upload needs version 7"
+    options2 = 0
+  # rfboot on an MCU with more than 64K of flash. The others ignore it
+  if usb2rfVersion >= 8:
+    options2 = options2 or RFB_OPT2_FAR
+  elif app.len > MaxAppSize328:
+    echo "usb2rf firmware is version ", usb2rfVersion, ". The atmega1284p and the atmega2560 need version 8"
+  # The EEPROM packets have the idx before the 32 bytes, only the framed
+  # link sends more than 32 bytes
+  if framedLink and eeprom.len > 0:
+    options2 = options2 or RFB_OPT2_EEPROM
+  elif eeprom.len > 0:
+    echo "usb2rf firmware is version ", usb2rfVersion, ". The EEPROM image needs version 9"
+  # usb2rf forwards the longer final reply as any other
+  if usb2rfVersion >= 3:
+    options2 = options2 or RFB_OPT2_STATS
+  if usb2rfVersion >= 3:
+    # rfboot resumes the upload only if it has the same application
+    # half written. Otherwise it uses the delta upload
+    options = options or RFB_OPT_WINDOW or RFB_OPT_DELTA or RFB_OPT_RESUME
+    if ctr:
+      options = options or RFB_OPT_CTR
+    # We ask for compression only if it makes the application smaller.
+    # The compressed stream is sent as the last bytes of the application
+    # see the upload below
+    var reversedApp = newString(app.len)
+    for i,c in app:
+      reversedApp[app.high-i] = c
+    if 2 + lzCompress(reversedApp).len < app.len - SPM_PAGE_SIZE:
+      options = options or RFB_OPT_PACKED
+  else:
+    echo "usb2rf firmware is version ", usb2rfVersion, ". Upgrade it for faster uploads"
+
+  var header = StartSignature.uint32.toString & app.len.uint16.toString &
+    app.crc16.toString & app.crc16_rev.toString & 0.uint16.toString &
+    StartSignature.uint32.toString & options.char & app.crc32_rev.toString & options2.char &
+    char(app.len shr 16) & eeprom.len.uint16.toString & (eeprom & app).crc32_rev.toString & newString(3)
   #else:
   #  echo "module identified : \"", USB2RF_START_MESSAGE, "\""
   if resetString==nil or resetString=="":
@@ -720,7 +1115,7 @@ proc actionUpload(appFileName: string, timeout=10.0) =
     echo "App SyncWord = ", appSyncWord.toArray
     port.setSyncWord appSyncWord
     echo "Reset String = ", resetString
-    discard port.write resetString
+    port.sendRf resetString
     let msg = port.getPacket(100, resetString.len)
     if msg == resetString:
       echo "Ok the target reported reset"
@@ -736,8 +1131,9 @@ proc actionUpload(appFileName: string, timeout=10.0) =
   var iv: array[2,uint32];
   var startPingTime = epochTime()
   while epochTime() - startPingTime < timeout:
-    discard port.write smallHeader
-    msg = port.getPacket(100,8)
+    port.sendRf smallHeader
+    # rfboot with FAST_BOOT listens only 15ms after a power-on, so we ping often
+    msg = port.getPacket(10,8)
     if msg!=nil:
       contact = true
       break
@@ -764,36 +1160,143 @@ proc actionUpload(appFileName: string, timeout=10.0) =
       stderr.writeLine "Wrong IV length from rfboot", msg.len
       quit QuitFailure
   echo "Upload starts ..."
+  # CTR mode uses the IV rfboot sent, CBC changes iv with every block
+  let sessionIv = iv
   header = xteaEncipherCbc(header, key, iv)
-  block:
-    var app1=""
-    var i = app.len
-    while i>0:
-      app1 = xteaEncipherCbc(app[i-32..i-1], key, iv) & app1
-      i-=32
-    app = app1
   # Sending the header
   if header.len != Payload:
     stderr.writeLine "Internal error, packet is not ", Payload, " bytes long"
     quit QuitFailure
   startPingTime = epochTime()
   while epochTime() - startPingTime < timeout:
-    discard port.write header
-    msg = port.getPacket(100,3)
+    port.sendRf header
+    msg = port.getReply()
     if msg!=nil:
       contact = true
       break
   if not contact:
     stderr.writeLine "Cannot contact rfboot"
     quit QuitFailure
-  if msg.len != 3:
+  # rfboot reports the options it accepts, unless it is an earlier version
+  var accepted = 0
+  var accepted2 = 0
+  var far = false
+  var stats = false
+  if msg.len==3 and msg[0].int == RFB_OPTIONS:
+    accepted = msg[1].int
+    accepted2 = msg[2].int
+    far = (accepted2 and RFB_OPT2_FAR) != 0
+    stats = (accepted2 and RFB_OPT2_STATS) != 0
+    let fast = (accepted and RFB_OPT_FAST) != 0
+    let fec = (accepted2 and RFB_OPT2_FEC) != 0
+    if fast or fec:
+      # rfboot uses the fast settings (and the FEC) now, and sends RFB_FAST
+      # (RFB_FEC with the FEC) until we answer. If we get nothing, or rfboot
+      # does not get our answer, both sides go back to the default settings
+      if fast: port.setFastModem true
+      if fec: port.setFec FecPacketLen
+      msg = port.getReply(100, far, stats)
+      while msg!=nil and msg.len==3 and msg[0].int in [RFB_FAST, RFB_FEC]:
+        port.sendRf msg[0] & "\0\0"
+        msg = port.getReply(200, far, stats)
+      if msg==nil:
+        if fast:
+          port.setFastModem false
+          echo "The fast data rate does not work, using the default"
+        if fec:
+          port.setFec 0
+          echo "The FEC does not work, using the default packets"
+        accepted = accepted and not RFB_OPT_FAST
+        accepted2 = accepted2 and not RFB_OPT2_FEC
+        msg = port.getReply(400, far, stats)
+    else:
+      msg = port.getReply(200, far, stats)
+    if msg==nil:
+      stderr.writeLine "Cannot contact rfboot"
+      quit QuitFailure
+  let packed = (accepted and RFB_OPT_PACKED) != 0
+  let ctr = (accepted and RFB_OPT_CTR) != 0
+  let eepromAccepted = (accepted2 and RFB_OPT2_EEPROM) != 0
+  if eeprom.len > 0 and not eepromAccepted:
+    echo "rfboot does not accept the EEPROM image (EEPROM=1). Only the flash is written"
+  # The SPM pages we are going to send. All of them, unless
+  # rfboot accepts the delta upload
+  let pages = (app.len + SPM_PAGE_SIZE - 1) div SPM_PAGE_SIZE
+  var changed = newSeq[bool](pages)
+  for p in 0..<pages:
+    changed[p] = true
+  if msg[0].int in [RFB_PAGE_HASH, RFB_RESUME_MAP, RFB_SEND_MAP]:
+    # Delta upload. rfboot reports the CRC16 of every page it has in flash
+    # Pages with lost reports are considered changed.
+    # Or resume. rfboot reports the pages it has already written.
+    # If the report is lost we send all pages
+    var pageHash = newSeq[int](pages)
+    var done = newSeq[bool](pages)
+    var resume = false
+    for p in 0..<pages:
+      pageHash[p] = -1
+    while true:
+      if msg==nil or msg.len<3:
+        stderr.writeLine "Cannot get the page CRCs from rfboot"
+        quit QuitFailure
+      elif msg[0].int == RFB_PAGE_HASH:
+        let first = msg[1].int
+        for j in 0..<msg[2].int:
+          if first+j<pages and msg.len>=5+2*j:
+            pageHash[first+j] = msg[3+2*j].int + 256*msg[4+2*j].int
+      elif msg[0].int == RFB_RESUME_MAP:
+        resume = true
+        for p in 0..<pages:
+          if 1+p div 8 < msg.len:
+            done[p] = (msg[1+p div 8].int and (1 shl (p mod 8))) == 0
+      elif msg[0].int == RFB_SEND_MAP:
+        break
+      else:
+        stderr.writeLine "Unexpected message from rfboot : ", msg[0].int
+        quit QuitFailure
+      msg = port.getReply(200, far, stats)
+    # The pages are compared as rfboot has them in flash.
+    # The bytes after the end of the application are 0xff
+    let fullApp = app & '\xff'.repeat(pages*SPM_PAGE_SIZE-app.len)
+    var map = newString(Payload-4)
+    var nchanged = 0
+    for p in 0..<pages:
+      changed[p] = not done[p] and fullApp[p*SPM_PAGE_SIZE .. (p+1)*SPM_PAGE_SIZE-1].crc16.int != pageHash[p]
+    # rfboot erases page 0 before writing anything, so it is always sent
+    # together with the other pages
+    for p in 1..<pages:
+      if changed[p]:
+        changed[0] = true
+    for p in 0..<pages:
+      if changed[p]:
+        map[p div 8] = char(map[p div 8].int or (1 shl (p mod 8)))
+        nchanged += 1
+    if resume:
+      echo "Resuming the previous upload : ", pages-nchanged, " of ", pages, " SPM pages already written"
+    else:
+      echo "Delta upload : ", nchanged, " of ", pages, " SPM pages changed"
+    let mapPacket = xteaEncipherCbc(map & StartSignature.uint32.toString, key, iv)
+    # rfboot asks for the map every 20ms until it gets it
+    while msg!=nil and msg.len==3 and msg[0].int == RFB_SEND_MAP:
+      port.sendRf mapPacket
+      msg = port.getReply(1200, far, stats)
+    if msg==nil:
+      stderr.writeLine "Cannot contact rfboot"
+      quit QuitFailure
+  if msg.len != 3 and not (msg.len == (if far: 7 else: 5) and msg[0].int == RFB_SEND_PAGE) and
+  not (stats and msg.len == 3 + statsLen(msg[0].int)):
     stderr.writeLine "Invalid message from rfboot. len=", msg.len
     for i in msg:
       stderr.writeLine i.int
     quit QuitFailure
   let reply = msg[0].int
-  let data = msg[1].int + 256 * msg[2].int
+  var data = msg[1].int + 256 * msg[2].int
+  if far and msg.len == 7:
+    data += msg[6].int shl 16
   var startUploadTime: float
+  var pageMode = false
+  # The flash is the same (delta upload) and rfboot asks for the EEPROM
+  var eepromOnly = false
   if reply == RFB_NO_SIGNATURE:
     stderr.writeLine "rfboot reports wrong signature"
     quit QuitFailure
@@ -801,55 +1304,199 @@ proc actionUpload(appFileName: string, timeout=10.0) =
     stderr.writeLine "rfboot reports that application size is invalid"
     quit QuitFailure
   elif reply == RFB_SEND_PKT:
+    # With the EEPROM rfboot is always in window mode, so this is the
+    # request of the last EEPROM packet
+    eepromOnly = eepromAccepted
     startUploadTime = epochTime()
+  elif reply == RFB_SEND_PAGE:
+    # rfboot accepted the window mode
+    pageMode = true
+    startUploadTime = epochTime()
+  elif reply == RFB_IDENTICAL_CODE:
+    # Delta upload and no page is changed. rfboot checked the CRCs
+    # of the whole application and starts it
+    echo "rfboot has the same application. Nothing to upload"
+    printStats(msg)
   else:
     stderr.writeLine "Unknown response ", reply, " data=", data
     quit QuitFailure
-  block:
+  if reply != RFB_IDENTICAL_CODE:
     const USB_SEND_PACKET = 20
     const USB_INFO_RESEND = 21
     const USB_INFO_END = 22
 
-    var pkt_idx = app.len
-    let applen = app.len.uint16.toString
-
-    discard port.write CommdModeStr & "U" & applen
-
-    while true:
-      let resp=port.getChar()
-      if resp == -1:
-        continue
-      elif resp==USB_SEND_PACKET:
-        #stderr.writeLine "pkt_idx=", pkt_idx
-        if pkt_idx==0:
-          stderr.writeLine "\npkt_len", app[pkt_idx-PAYLOAD..pkt_idx-1].len
-        #elif pkt_idx mod 1024==0:
-        #  stderr.write "*"
-        #  #stderr.flushFile
-        discard port.write app[pkt_idx-PAYLOAD..pkt_idx-1]
-        pkt_idx -= PAYLOAD
-      elif resp==USB_INFO_RESEND:
-        stderr.writeLine "\nResend"
-      elif resp==USB_INFO_END:
-        #stderr.writeLine "Got END from usb2rf, pkt_idx=", pkt_idx
-        if pkt_idx>0:
-          stderr.writeLine "\nWARNING: usb2rf termination"
+    # The flash packets and the usb2rf upload. Not with eepromOnly, as
+    # they would change the CBC iv the EEPROM packets continue from
+    var packets: seq[tuple[idx: int, data: string]] = @[]
+    # The requests usb2rf answered again (USB_INFO_RESEND). In window mode
+    # one for each SPM page rfboot asked for again
+    var resends = 0
+    if not eepromOnly:
+      # The packets in the order they are encrypted and sent, from
+      # the end of the application to the start. (idx is where the packet ends)
+      if packed:
+        # rfboot writes the application from the last byte to the first, so we
+        # compress the bytes of the pages we send in this order. The stream
+        # is sent as it was the last bytes of the application, again from the
+        # last to the first, and starts with the bytes we send, so rfboot knows
+        # when to stop asking for pages.
+        var stream = ""
+        var p = pages-1
+        while p>=0:
+          if changed[p]:
+            var i = min(app.len, (p+1)*SPM_PAGE_SIZE)
+            while i>p*SPM_PAGE_SIZE:
+              i-=1
+              stream.add app[i]
+          p-=1
+        stream = lzCompress(stream)
+        # rfboot receives whole SPM pages (except the first which ends at app.len)
+        let packedEnd = (app.len - 2 - stream.len) div SPM_PAGE_SIZE * SPM_PAGE_SIZE
+        if app.len - 2 - stream.len < 0:
+          stderr.writeLine "The compressed application is larger than the application"
           quit QuitFailure
-        break
+        let size = app.len - packedEnd
+        stream = char(size shr 8) & char(size and 0xff) & stream
+        stream.add '\0'.repeat(size-stream.len)
+        echo "Compressed upload : ", stream.len, " of ", app.len, " bytes"
+        var i = app.len
+        while i>packedEnd:
+          var pkt = newString(Payload)
+          for j in 0..<Payload:
+            pkt[j] = stream[app.len-i+Payload-1-j]
+          if ctr:
+            packets.add( (i, xteaCtr(pkt, key, sessionIv, i-Payload)) )
+          else:
+            packets.add( (i, xteaEncipherCbc(pkt, key, iv)) )
+          i-=Payload
       else:
-        stderr.writeLine "\nGot unknown response", resp
-        quit QuitFailure
-    let resp = port.getPacket(1200, 3)
+        var i = app.len
+        while i>0:
+          if changed[(i-1) div SPM_PAGE_SIZE]:
+            if ctr:
+              packets.add( (i, xteaCtr(app[i-Payload..i-1], key, sessionIv, i-Payload)) )
+            else:
+              packets.add( (i, xteaEncipherCbc(app[i-Payload..i-1], key, iv)) )
+          i-=Payload
+      var pkt_idx = 0
+
+      if pageMode:
+        echo "Window mode, one request per SPM page"
+        # we pass the first request (the mask and the packet size) to usb2rf
+        var pageCmd = "P" & (data and 0xffff).uint16.toString & msg[3] & msg[4]
+        if (accepted2 and RFB_OPT2_PARITY) != 0:
+          echo "A parity packet per SPM page"
+          pageCmd.add '\1'
+        elif far:
+          pageCmd.add '\0'
+        # The high byte of the mask and bits 16-23 of idx
+        if far:
+          pageCmd.add msg[5] & msg[6]
+        port.command pageCmd
+      else:
+        port.command "U" & app.len.uint16.toString
+
+      while true:
+        let resp=port.getChar()
+        if resp == -1:
+          continue
+        elif resp==USB_SEND_PACKET:
+          # A credit for one packet. usb2rf asks ahead of rfboot and
+          # keeps the packets in its ring
+          #stderr.writeLine "pkt_idx=", pkt_idx
+          if pkt_idx==packets.len:
+            # In window mode usb2rf does not know where the packets end,
+            # and asks ahead
+            if not pageMode:
+              stderr.writeLine "\nusb2rf asks for more packets than the application has"
+            continue
+          # In window mode usb2rf needs to know where the packet belongs
+          if pageMode:
+            let idx = packets[pkt_idx].idx
+            discard port.write (idx and 0xffff).uint16.toString
+            if far:
+              discard port.write $char(idx shr 16)
+          discard port.write packets[pkt_idx].data
+          pkt_idx += 1
+        elif resp==USB_INFO_RESEND:
+          stderr.writeLine "\nResend"
+          resends += 1
+        elif resp==USB_INFO_END:
+          #stderr.writeLine "Got END from usb2rf, pkt_idx=", pkt_idx
+          if pkt_idx<packets.len:
+            stderr.writeLine "\nWARNING: usb2rf termination"
+            quit QuitFailure
+          break
+        else:
+          stderr.writeLine "\nGot unknown response", resp
+          quit QuitFailure
+    var resp = if eepromOnly: msg else: port.getReply(1200, far, stats)
+    if eepromAccepted and resp.len>=3 and resp[0].int == RFB_SEND_PKT:
+      # rfboot asks for the EEPROM packets from the last to the first
+      # (CBC after the flash packets), and again every 50ms until it gets one
+      let eepromPadded = eeprom & '\xff'.repeat((Payload - eeprom.len mod Payload) mod Payload)
+      var eepromPackets = newSeq[string](eepromPadded.len div Payload)
+      var i = eepromPadded.len
+      while i>0:
+        eepromPackets[i div Payload - 1] = xteaEncipherCbc(eepromPadded[i-Payload..i-1], key, iv)
+        i-=Payload
+      echo "EEPROM : ", eeprom.len, " bytes"
+      var lastIdx = -1
+      while resp!=nil and resp.len>=3 and resp[0].int == RFB_SEND_PKT:
+        let idx = resp[1].int + 256 * resp[2].int
+        if idx mod Payload != 0 or idx == 0 or idx > eepromPadded.len:
+          stderr.writeLine "\nInvalid EEPROM request from rfboot : ", idx
+          quit QuitFailure
+        # With RFB_OPT2_STATS the link as rfboot sees it
+        if idx == lastIdx:
+          if resp.len == 5:
+            stderr.writeLine "\nResend (RSSI ", rssiDbm(resp[3].int), " dBm, LQI ", resp[4].int, ")"
+          else:
+            stderr.writeLine "\nResend"
+        lastIdx = idx
+        # The idx of the request first, so rfboot knows a late packet
+        port.sendRf idx.uint16.toString & eepromPackets[idx div Payload - 1]
+        # rfboot writes the last packet (~3.3ms per byte) before the reply
+        resp = port.getReply(1200, far, stats)
     if resp.len<3:
       stderr.writeLine "\nNo response from usb2rf module"
       quit QuitFailure
     let reply = resp[0].int
     if reply == RFB_WRONG_CRC:
       stderr.writeLine "\nCRC check failed"
+      if (accepted2 and (RFB_OPT2_FEC or RFB_OPT2_PARITY)) != 0:
+        stderr.writeLine "Pages sent again = ", resends
+      printStats(resp)
+      port.printUsb2rfLosses usb2rfVersion
       quit QuitFailure
     elif reply == RFB_SUCCESS:
+      let uploadTime = epochTime()-startUploadTime
       echo "\nCRC OK. Success !"
-      echo "Upload time = ", (epochTime()-startUploadTime).formatFloat(precision=3), " sec"
+      echo "Upload time = ", uploadTime.formatFloat(precision=3), " sec"
+      # Earlier rfboot versions report 0
+      let payload = resp[1].int + 256 * resp[2].int
+      if pageMode and payload>0:
+        echo "Packet size = ", payload, " bytes"
+      echo "Speed = ", (app.len.float/uploadTime).int, " bytes/sec"
+      if (accepted and RFB_OPT_FAST) != 0:
+        echo "Fast data rate"
+      if (accepted2 and RFB_OPT2_FEC) != 0:
+        echo "FEC packets"
+      # With the parity packets rfboot also reports the packets it rebuilt,
+      # next to the ones sent again
+      if (accepted2 and RFB_OPT2_PARITY) != 0:
+        let repaired = if stats: resp[3..3] else: port.getPacket(20, 1)
+        if repaired!=nil and repaired.len==1:
+          echo "Packets rebuilt from the parity = ", repaired[0].int
+        else:
+          echo "Packets rebuilt from the parity = unknown"
+      if (accepted2 and (RFB_OPT2_FEC or RFB_OPT2_PARITY)) != 0:
+        echo "Pages sent again = ", resends
+      printStats(resp)
+      port.printUsb2rfLosses usb2rfVersion
+    elif reply == RFB_IDENTICAL_CODE and eepromOnly:
+      echo "\nCRC OK. rfboot has the same application, only the EEPROM is written"
+      printStats(resp)
   #
   # We got success reply
   #
@@ -859,6 +1506,344 @@ proc actionUpload(appFileName: string, timeout=10.0) =
   f.writeLine newAppSyncWord[1].int
   f.writeLine newResetString
   f.close()
+  if (accepted and RFB_OPT_FAST) != 0:
+    port.setFastModem false
+  if (accepted2 and RFB_OPT2_FEC) != 0:
+    port.setFec 0
+  port.setChannel newAppChannel
+  port.setSyncWord newAppSyncWord
+
+
+# Multicast upload ("rftool group") to many nodes with the same rfboot
+# settings, compiled with MULTICAST=1 (rfboot RFB_OPT_GROUP).
+# All nodes get the reset string, and then the group ping with the IV of the
+# session (the same for all nodes) and the header. Every SPM page is sent once,
+# the nodes report the units they lost (RFB_SEND_PAGE) and we send the units
+# of all reports again, the highest page first, as the nodes write the pages
+# from the last to the first. So the time depends on the size of the
+# application and the losses, not on the number of nodes.
+const GroupCounterFile = ".groupcounter"
+# How long we send the group ping and the header (sec). The nodes
+# start at different times after the reset string
+const GroupStartTime = 1.0
+# After every page we listen for the reports of the nodes (ms)
+const GroupGap = 10
+# The upload ends when no node reports anything for this time (sec)
+const GroupQuietTime = 0.5
+
+proc actionGroup(appFileName: string, nodes = 0) =
+  let app = loadApp(appFileName)
+  let (rfbChannel,rfbootSyncWord,key,pingSignature) = getUploadParams()
+  let (newAppChannel, newAppSyncWord, newResetString) = getAppParams()
+  let (appChannel, appSyncWord, resetString) = getResetParams(newAppChannel, newAppSyncWord, newResetString)
+  # The upload counter of the session. A node accepts the group ping only
+  # if the counter is not lower than its own, so a recorded upload cannot be
+  # replayed. We keep the highest counter we know
+  var counter = 0
+  try:
+    counter = readFile(GroupCounterFile).strip.parseInt
+  except IOError, ValueError:
+    discard
+  counter += 1
+  var groupIv = [counter.uint32, StartSignature.uint32]
+  xtea_encipher(groupIv, key)
+  let groupPing = pingSignature.toString & groupIv[0].toString & groupIv[1].toString
+  # We cannot know the options of every node. A node that does not
+  # support them reports RFB_OPTIONS and leaves
+  let options = RFB_OPT_WINDOW or RFB_OPT_CRC32 or RFB_OPT_CTR or RFB_OPT_GROUP
+  var iv = groupIv
+  let header = xteaEncipherCbc(StartSignature.uint32.toString & app.len.uint16.toString &
+    app.crc16.toString & app.crc16_rev.toString & 0.uint16.toString &
+    StartSignature.uint32.toString & options.char & app.crc32_rev.toString & newString(11), key, iv)
+  # The encrypted application, at its flash addresses
+  var enc = newString(app.len)
+  block:
+    var i = app.len
+    while i>0:
+      let pkt = xteaCtr(app[i-Payload..i-1], key, groupIv, i-Payload)
+      for j in 0..<Payload:
+        enc[i-Payload+j] = pkt[j]
+      i-=Payload
+
+  let port = getPortName().openPort()
+  if not port.resetUsb2rf():
+    stderr.writeLine "Cannot contact usb2rf"
+    quit QuitFailure
+  port.drain 5
+  if port.getUsb2rfVersion() < 6:
+    stderr.writeLine "The multicast upload needs usb2rf version 6 or later"
+    quit QuitFailure
+  port.setFastModem false
+  if resetString==nil or resetString=="" or resetString=="MANUAL":
+    echo "Reset string is not defined. Reset the nodes manually"
+  else:
+    echo "App channel = ", appChannel
+    port.setChannel appChannel
+    echo "App SyncWord = ", appSyncWord.toArray
+    port.setSyncWord appSyncWord
+    echo "Reset String = ", resetString
+    # Every node answers, we do not wait for them
+    for i in 1..3:
+      discard port.write resetString
+      sleep 30
+  port.setSyncWord rfbootSyncWord
+  port.setChannel rfbChannel
+  port.drain 5
+
+  echo "Starting the nodes. Upload counter = ", counter
+  var higherCounter = 0
+  var refused = 0
+  var startTime = epochTime()
+  while epochTime() - startTime < GroupStartTime:
+    for pkt in [groupPing, header]:
+      discard port.write pkt
+      # A node with a higher counter answers with its IV, as to a ping,
+      # and a node without the options with RFB_OPTIONS
+      let msg = port.getPacket(15)
+      if msg==nil:
+        discard
+      elif msg.len==8:
+        var ivdec: array[2,uint32]
+        for j in 0..3:
+          ivdec[0] = ivdec[0] or (msg[j].uint32 shl (8*j))
+          ivdec[1] = ivdec[1] or (msg[4+j].uint32 shl (8*j))
+        xtea_decipher(ivdec,key)
+        higherCounter = max(higherCounter, ivdec[0].int)
+      elif msg.len==3 and msg[0].int==RFB_OPTIONS:
+        refused += 1
+  if higherCounter>0:
+    stderr.writeLine "Some nodes have upload counter ", higherCounter, ", they are not in this upload. Run rftool again"
+  if refused>0:
+    stderr.writeLine refused, " nodes do not support the multicast upload options"
+  writeFile(GroupCounterFile, $max(counter, higherCounter) & "\n")
+
+  const USB_SEND_PACKET = 20
+  const USB_INFO_END = 22
+  const USB_GROUP_REPLY = 23
+  let pages = (app.len + SPM_PAGE_SIZE - 1) div SPM_PAGE_SIZE
+  # The units we need to send, one bit per unit as in RFB_SEND_PAGE,
+  # and the packet size (in units) the nodes ask for
+  var pending = newSeq[int](pages)
+  var units = newSeq[int](pages)
+  for p in 0..<pages:
+    pending[p] = 0xff
+    units[p] = SPM_PAGE_SIZE div Unit
+  block:
+    let n = (app.len - (pages-1)*SPM_PAGE_SIZE) div Unit
+    pending[pages-1] = (1 shl n) - 1
+  var ready = false
+  var success = 0
+  var failed = 0
+  var reports = 0
+  var lastReport = epochTime()
+
+  # Reads what usb2rf sends for "timeout" ms, or until usb2rf can
+  # send the next packet
+  proc poll(timeout: int, untilReady = false) =
+    let start = epochTime()
+    while not (untilReady and ready):
+      let left = timeout - ((epochTime()-start)*1000).int
+      if left<=0:
+        break
+      let c = port.getChar(left)
+      if c == -1:
+        break
+      elif c == USB_SEND_PACKET:
+        ready = true
+      elif c == USB_INFO_END:
+        stderr.writeLine "\nusb2rf ended the upload"
+        quit QuitFailure
+      elif c == USB_GROUP_REPLY:
+        let size = port.getChar(100)
+        let msg = port.getPacket(100, size)
+        if size<3 or msg==nil or msg.len!=size:
+          continue
+        lastReport = epochTime()
+        if msg[0].int==RFB_SEND_PAGE and size==5:
+          let p = (msg[1].int + 256*msg[2].int - 1) div SPM_PAGE_SIZE
+          if p>=0 and p<pages:
+            pending[p] = pending[p] or msg[3].int
+            units[p] = max(1, min(units[p], msg[4].int))
+            reports += 1
+        elif msg[0].int==RFB_SUCCESS:
+          success += 1
+        elif msg[0].int==RFB_WRONG_CRC:
+          failed += 1
+
+  # Sends the pending units of the page, as usb2rf sends them in window
+  # mode : consecutive units in the same packet, from the last to the first
+  proc sendPage(p: int) =
+    let spm = p*SPM_PAGE_SIZE
+    let mask = pending[p]
+    pending[p] = 0
+    var idx = min(spm+SPM_PAGE_SIZE, app.len)
+    while idx>spm:
+      var n = 0
+      while n<units[p] and idx-n*Unit>spm and (mask and (1 shl ((idx-n*Unit-1-spm) div Unit))) != 0:
+        n += 1
+      if n==0:
+        idx -= Unit
+        continue
+      poll(1000, true)
+      if not ready:
+        stderr.writeLine "\nNo response from usb2rf module"
+        quit QuitFailure
+      ready = false
+      let pkt = idx.uint16.toString & enc[idx-n*Unit .. idx-1]
+      discard port.write pkt.len.char & pkt
+      idx -= n*Unit
+
+  echo "Multicast upload ..."
+  port.command "G"
+  let startUploadTime = epochTime()
+  while true:
+    var p = pages-1
+    while p>=0 and pending[p]==0:
+      p -= 1
+    if p>=0:
+      sendPage(p)
+      lastReport = epochTime()
+      poll(GroupGap)
+    else:
+      poll(50)
+      if epochTime()-lastReport > GroupQuietTime:
+        break
+    if nodes>0 and success+failed>=nodes:
+      break
+  # A zero length packet ends the upload mode of usb2rf
+  discard port.write "\0"
+  let uploadTime = epochTime()-startUploadTime
+  echo "\n", success, " nodes report success, ", failed, " nodes report CRC error"
+  if nodes>0 and success<nodes:
+    stderr.writeLine nodes-success, " of ", nodes, " nodes are not updated"
+  echo "Upload time = ", uploadTime.formatFloat(precision=3), " sec, ", reports, " reports of lost units"
+  if success>0:
+    let f = open(".lastupload", fmWrite)
+    f.writeLine newAppChannel
+    f.writeLine newAppSyncWord[0].int
+    f.writeLine newAppSyncWord[1].int
+    f.writeLine newResetString
+    f.close()
+  port.setChannel newAppChannel
+  port.setSyncWord newAppSyncWord
+  if failed>0 or success==0 or (nodes>0 and success<nodes):
+    quit QuitFailure
+
+
+# Background download ("rftool background SomeFirmware"), rfboot with
+# BACKGROUND=1 and an application with skel/rfboot_api.h. The application
+# keeps running and stores the encrypted image in slot B, the upper half of
+# the flash. At the end it resets and rfboot installs the image (~2 sec).
+# The image is encrypted as a multicast upload : the IV is {counter,
+# START_SIGNATURE} with a counter higher than the one rfboot has, the
+# header is CBC and the application CTR. Slot B is the IV and the header in
+# its first SPM page, and the application after it.
+# Every packet is BgMagic, a command and its data (see rfboot_api.h)
+const BgMagic = "\xb6"
+const BgChunk = 16
+
+proc actionBackground(appFileName: string) =
+  let app = loadApp(appFileName)
+  let (rfbChannel,rfbootSyncWord,key,pingSignature) = getUploadParams()
+  let (newAppChannel, newAppSyncWord, newResetString) = getAppParams()
+  let (appChannel, appSyncWord, resetString) = getResetParams(newAppChannel, newAppSyncWord, newResetString)
+  let port = getPortName().openPort()
+  if not port.resetUsb2rf():
+    stderr.writeLine "Cannot contact usb2rf"
+    quit QuitFailure
+  port.drain 5
+  port.startFramedLink port.getUsb2rfVersion()
+  echo "App channel = ", appChannel
+  port.setChannel appChannel
+  echo "App SyncWord = ", appSyncWord.toArray
+  port.setSyncWord appSyncWord
+  port.drain 5
+  # The upload counter of rfboot and the address of slot B
+  var reply: string = nil
+  for i in 1..10:
+    port.sendRf BgMagic & "C"
+    let msg = port.getPacket(100, 6)
+    if msg!=nil and msg.len==6 and msg[0..1]==BgMagic & "C":
+      reply = msg
+      break
+  if reply==nil:
+    stderr.writeLine "The application does not answer. It needs rfboot_api.h (see skel.ino) and rfboot with BACKGROUND=1"
+    quit QuitFailure
+  let counter = reply[2].int + 256*reply[3].int
+  let slot = reply[4].int + 256*reply[5].int
+  if slot==0:
+    stderr.writeLine "The running application is in the upper half of the flash, use \"rftool upload\""
+    quit QuitFailure
+  if app.len>slot:
+    stderr.writeLine "The application is ", app.len, " bytes, the background download accepts up to ", slot
+    quit QuitFailure
+  # rfboot adds 1 to its counter at every start
+  var iv = [((counter+1) and 0xffff).uint32, StartSignature.uint32]
+  xtea_encipher(iv, key)
+  let bgIv = iv
+  let options = RFB_OPT_CRC32 or RFB_OPT_CTR
+  let header = xteaEncipherCbc(StartSignature.uint32.toString & app.len.uint16.toString &
+    app.crc16.toString & app.crc16_rev.toString & 0.uint16.toString &
+    StartSignature.uint32.toString & options.char & app.crc32_rev.toString & newString(11), key, iv)
+  var slotB = bgIv[0].toString & bgIv[1].toString & header
+  slotB.add '\xff'.repeat(SPM_PAGE_SIZE-slotB.len)
+  block:
+    var i = 0
+    while i<app.len:
+      slotB.add xteaCtr(app[i..i+Payload-1], key, bgIv, i)
+      i+=Payload
+  if slotB.len mod SPM_PAGE_SIZE != 0:
+    slotB.add '\xff'.repeat(SPM_PAGE_SIZE - slotB.len mod SPM_PAGE_SIZE)
+  let pages = slotB.len div SPM_PAGE_SIZE
+
+  echo "Background download : ", app.len, " bytes, ", pages, " SPM pages"
+  let startTime = epochTime()
+  # The application first and the IV and the header (page 0) last, so rfboot
+  # never finds a half written image
+  for n in 1..pages:
+    let p = n mod pages
+    let address = slot + p*SPM_PAGE_SIZE
+    var tries = 0
+    while true:
+      for c in 0..<SPM_PAGE_SIZE div BgChunk:
+        let offset = p*SPM_PAGE_SIZE + c*BgChunk
+        port.sendRf BgMagic & "D" & (address+c*BgChunk).uint16.toString & slotB[offset..offset+BgChunk-1]
+        # The packet is ~7ms on the air. Without the framed link usb2rf
+        # also waits 2ms without data
+        sleep(if framedLink: 7 else: 8)
+      let ack = port.getPacket(200, 5)
+      if ack!=nil and ack.len==5 and ack[0..1]==BgMagic & "D" and ack[2].int+256*ack[3].int==address:
+        if ack[4].int==0:
+          stderr.writeLine "\nrfboot refused the page ", address, ". Is it compiled with BACKGROUND=1 ?"
+          quit QuitFailure
+        break
+      tries += 1
+      if tries>10:
+        stderr.writeLine "\nThe application does not answer"
+        quit QuitFailure
+      stderr.write "R"
+    stdout.write "."
+    stdout.flushFile
+  echo ""
+  echo "Download time = ", (epochTime()-startTime).formatFloat(precision=3), " sec"
+  # The application resets, and rfboot installs the new one
+  var installed = false
+  for i in 1..3:
+    port.sendRf BgMagic & "R"
+    let msg = port.getPacket(200, 2)
+    if msg!=nil and msg==BgMagic & "R":
+      installed = true
+      break
+  if not installed:
+    stderr.writeLine "The application does not answer. The new one is installed at its next reset"
+    quit QuitFailure
+  echo "The application resets, rfboot installs the new one"
+  let f = open(".lastupload", fmWrite)
+  f.writeLine newAppChannel
+  f.writeLine newAppSyncWord[0].int
+  f.writeLine newAppSyncWord[1].int
+  f.writeLine newResetString
+  f.close()
   port.setChannel newAppChannel
   port.setSyncWord newAppSyncWord
 
@@ -974,7 +1959,9 @@ For full documentation go to the Project page:
 https://github.com/pkarsy/rfboot
 
 Usage : rftool create|new ProjectName # Creates a new Arduino based project
-        rftool upload|send SomeFirmware # Accepted filetypes are .bin .hex .elf
+        rftool upload|send SomeFirmware [fec|parity] [ctr] [fast] # Accepted filetypes are .bin .hex .elf
+        rftool group SomeFirmware [nodes] # Multicast upload to many nodes with the same rfboot settings
+        rftool background SomeFirmware # The application receives the new one while it runs (rfboot BACKGROUND=1)
         rftool monitor|terminal term_emulator_cmd arg arg -p #opens a serial terminal with appropriate parameters
         rftool addport # Adds usb2rf module to ~/.usb2rf file
         rftool resetlocal # Reset the usb2rf module. It is used by the usb2rf Makefile
@@ -989,11 +1976,46 @@ Usage : rftool create|new ProjectName # Creates a new Arduino based project
     if p.len == 1:
       stderr.writeLine "No file given"
       quit QuitFailure
-    elif p.len>=3:
+    elif p.len>=6:
       stderr.writeLine "Too many arguments"
       quit QuitFailure
     let binary = p[1].strip
-    actionUpload(binary)
+    # "fec" for the FEC and the parity packets, "parity" for the parity only.
+    # "ctr" for the CTR mode (faster decryption, weaker integrity), "fast"
+    # for the fast data rate
+    var options2 = 0
+    var ctr = false
+    var fast = false
+    for i in 2..<p.len:
+      case p[i].strip.normalize
+      of "fec": options2 = RFB_OPT2_FEC or RFB_OPT2_PARITY
+      of "parity": options2 = RFB_OPT2_PARITY
+      of "ctr": ctr = true
+      of "fast": fast = true
+      else:
+        stderr.writeLine "Unknown upload option \"", p[i], "\""
+        quit QuitFailure
+    actionUpload(binary, options2=options2, ctr=ctr, fast=fast)
+  of "group","multicast":
+    if p.len == 1:
+      stderr.writeLine "No file given"
+      quit QuitFailure
+    elif p.len>=4:
+      stderr.writeLine "Too many arguments"
+      quit QuitFailure
+    var nodes = 0
+    if p.len == 3:
+      try:
+        nodes = p[2].strip.parseInt
+      except ValueError:
+        stderr.writeLine "The number of nodes must be an integer"
+        quit QuitFailure
+    actionGroup(p[1].strip, nodes)
+  of "background","bg":
+    if p.len != 2:
+      stderr.writeLine "Usage : rftool background SomeFirmware"
+      quit QuitFailure
+    actionBackground(p[1].strip)
   of "monitor","terminal":
     actionMonitor()
   of "resetlocal":
@@ -0,0 +1,109 @@
+/*
+    This file is part of rfboot
+    https://github.com/pkarsy/rfboot
+    and it is given to the Public Domain. This means you can do
+    anything with it, including removing this notice.
+*/
+
+// The background download ("rftool background SomeFirmware"). The
+// application receives the next application while it runs, and rfboot
+// installs it at the next reset. Needs BACKGROUND=1 in
+// rfboot/hardware_settings.mk, and -DRFBOOT_BACKGROUND in the Makefile.
+// Only on the atmega328p, and this application must be smaller than
+// RFBOOT_BG_SLOT (14208 bytes), as the new one is stored above it.
+//
+// The packets are encrypted and only rfboot can decrypt them, so we just
+// store them in slot B. The flash is written by rfboot too (rfboot_bg_write),
+// as the SPM instruction works only from the bootloader section.
+// Every page takes ~9ms with the interrupts off.
+#ifndef RFBOOT_API_H
+#define RFBOOT_API_H
+
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <string.h>
+
+#if FLASHEND > 0xffff
+#error "The background download is only supported on the atmega328p"
+#endif
+
+// The same as DATA_PAGE and BG_SLOT in rfboot.c (4096 bytes bootloader)
+#define RFBOOT_DATA_PAGE (FLASHEND+1-4096-SPM_PAGESIZE)
+#define RFBOOT_BG_SLOT (RFBOOT_DATA_PAGE/2/SPM_PAGESIZE*SPM_PAGESIZE)
+// The upload counter of rfboot, in DATA_PAGE (struct flash_info_struct)
+#define RFBOOT_COUNTER_ADDR (RFBOOT_DATA_PAGE+6)
+// rfboot_bg_write, in the last word of the flash. Function pointers are
+// word addresses
+#define RFBOOT_API_ADDR ((FLASHEND-3)/2)
+
+// The packets of rftool start with RFBOOT_BG_MAGIC and a command :
+// 'C' : the download starts. We reply with the counter and RFBOOT_BG_SLOT
+// 'D' : 2 bytes flash address and RFBOOT_BG_CHUNK bytes. When all chunks of
+//       an SPM page are here we write it, and reply with the page address
+//       and the result
+// 'R' : we reply, and the application must reset (see skel.ino)
+#define RFBOOT_BG_MAGIC 0xb6
+#define RFBOOT_BG_CHUNK 16
+// The longest reply
+#define RFBOOT_BG_REPLY 6
+
+// Writes the SPM page "addr" of slot B. Returns 0 if "addr" is not in slot B
+static uint8_t rfboot_bg_write(uint16_t addr, const uint8_t* buf) {
+    return ((uint8_t (*)(uint16_t, const uint8_t*))RFBOOT_API_ADDR)(addr, buf);
+}
+
+// The page we receive now
+static uint8_t rfboot_bg_page[SPM_PAGESIZE];
+static uint16_t rfboot_bg_addr = 0xffff;
+// One bit per chunk of the page
+static uint8_t rfboot_bg_got;
+
+// The end of this application in flash (avr-libc linker script)
+extern char __data_load_end[];
+
+// Returns -1 if the packet is not for the background download, or the
+// length of the reply, which is in "reply" (RFBOOT_BG_REPLY bytes)
+static int8_t rfboot_bg_packet(const uint8_t* pkt, uint8_t len, uint8_t* reply) {
+    if (len<2 || pkt[0]!=RFBOOT_BG_MAGIC) return -1;
+    reply[0] = RFBOOT_BG_MAGIC;
+    reply[1] = pkt[1];
+    if (pkt[1]=='C') {
+        uint16_t counter = pgm_read_word(RFBOOT_COUNTER_ADDR);
+        // 0 if this application is in slot B itself
+        uint16_t slot = ((uint16_t)__data_load_end <= RFBOOT_BG_SLOT) ? RFBOOT_BG_SLOT : 0;
+        reply[2] = counter;
+        reply[3] = counter>>8;
+        reply[4] = slot;
+        reply[5] = slot>>8;
+        // The image of an earlier download is not installed any more
+        if (slot) {
+            memset(rfboot_bg_page, 0xff, sizeof(rfboot_bg_page));
+            rfboot_bg_write(RFBOOT_BG_SLOT, rfboot_bg_page);
+        }
+        rfboot_bg_addr = 0xffff;
+        return 6;
+    }
+    else if (pkt[1]=='D' && len==4+RFBOOT_BG_CHUNK) {
+        uint16_t addr = pkt[2] | (pkt[3]<<8);
+        uint16_t page = addr/SPM_PAGESIZE*SPM_PAGESIZE;
+        if (page!=rfboot_bg_addr) {
+            rfboot_bg_addr = page;
+            rfboot_bg_got = 0;
+        }
+        memcpy(rfboot_bg_page+addr%SPM_PAGESIZE, pkt+4, RFBOOT_BG_CHUNK);
+        rfboot_bg_got |= 1<<(addr%SPM_PAGESIZE/RFBOOT_BG_CHUNK);
+        if (rfboot_bg_got != (uint8_t)((1<<(SPM_PAGESIZE/RFBOOT_BG_CHUNK))-1)) return 0;
+        // rftool sends the page again if the reply is lost
+        rfboot_bg_addr = 0xffff;
+        reply[2] = page;
+        reply[3] = page>>8;
+        reply[4] = rfboot_bg_write(page, rfboot_bg_page);
+        return 5;
+    }
+    else if (pkt[1]=='R') {
+        return 2;
+    }
+    return 0;
+}
+
+#endif
@@ -9,6 +9,10 @@
 #include "app_settings.h"
 #include <mCC1101.h>
 mCC1101 rf;
+// The background download, see rfboot_api.h and the Makefile
+#ifdef RFBOOT_BACKGROUND
+#include "rfboot_api.h"
+#endif
 
 // These macros enables us to "print" messages via the RF
 // link. They use the rf.print(..) which is implemented in mCC1101.cpp
@@ -77,6 +81,20 @@ void loop() {
                 // After 15ms -> reset
                 while (1) {};
             }
+            #ifdef RFBOOT_BACKGROUND
+            // "rftool background" packets. After 'R' the new application
+            // is in flash (slot B), and rfboot installs it after the reset
+            byte reply[RFBOOT_BG_REPLY];
+            int8_t reply_len = rfboot_bg_packet(packet, pkt_size, reply);
+            if (reply_len>=0) {
+                if (reply_len>0) rf.sendPacket(reply, reply_len);
+                if (reply[1]=='R') {
+                    wdt_enable( WDTO_15MS );
+                    while (1) {};
+                }
+                return;
+            }
+            #endif
             // here you can put code to check for any input
             if (pkt_size==1) {
                 byte c = packet[0];
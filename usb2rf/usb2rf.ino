@@ -18,14 +18,35 @@
 
 #define PAYLOAD 32
 
+// The same as rfboot, for the atmega328p
+#define SPM_PAGESIZE 128
+// rfboot on the atmega1284p and the atmega2560 (RFB_OPT2_FAR)
+#define FAR_PAGESIZE 256
+
+// The same as rfboot. Window mode packets contain up to
+// PAGE_UNITS units of 16 bytes (a whole SPM page), rfboot tells us how many
+#define UNIT 16
+#define PAGE_UNITS (SPM_PAGESIZE/UNIT)
+// Longer packets do not fit in the CC1101 FIFO, see send_long_packet
+#define LONG_PKT_UNITS 3
+
+// Reported with the 'V' command. rftool uses it to know which
+// upload modes the module supports. Earlier firmware does not answer at all.
+#define USB2RF_VERSION 10
+
 #include <mCC1101.h>
+// The MDMCFG2 values of rfboot
+#include "../rfboot/cc1101/cc1101_modem.h"
 mCC1101 rf;
 
-// a flag that a wireless packet has been received
-// Handle interrupt from CC1101 GDO0 <--> D2(INT0)
-void cc1101signalsInterrupt(void) {
-    rf.interrupt = true;
-}
+// The GDO0 interrupt (D2, INT0) reads the packets from the CC1101 FIFO,
+// see cc1101signalsInterrupt. The code outside it uses the SPI only
+// between rf_lock and rf_unlock. INT0 keeps the edge, and the interrupt
+// comes after rf_unlock. rf_lock waits for the end of a packet we are
+// sending (tx_start)
+volatile bool tx_pending;
+#define rf_lock() do { while (tx_pending) ; EIMSK &= ~_BV(INT0); } while (0)
+#define rf_unlock() (EIMSK |= _BV(INT0))
 
 // Seems the AltSoftSerial does better than SoftSerial @ 8MHz
 // Anything more than 19200 baud @ 8MHz seems unreliable
@@ -58,10 +79,299 @@ AltSoftSerial debug_port;
 void(* resetFunc) (void) = 0;
 uint32_t silence_timer ;
 
+// The modem settings we change for the fast data rate (rfboot
+// RFB_OPT_FAST). The same as CC1101_FASTVAL_* in rfboot/cc1101/cc1101.h
+// {register, default, fast}
+const uint8_t modem_regs[][3] = {
+    { CC1101_MDMCFG4, 0xCA, 0x5B },
+    { CC1101_MDMCFG3, 0x83, 0xF8 },
+    { CC1101_MDMCFG2, CC1101_DEFVAL_MDMCFG2, CC1101_FASTVAL_MDMCFG2 },
+    { CC1101_DEVIATN, 0x35, 0x47 },
+    { CC1101_FOCCFG, 0x16, 0x1D },
+    { CC1101_BSCFG, 0x6C, 0x1C },
+    { CC1101_AGCCTRL2, 0x43, 0xC7 },
+    { CC1101_AGCCTRL1, 0x40, 0x00 },
+    { CC1101_AGCCTRL0, 0x91, 0xB2 },
+    { CC1101_FREND1, 0x56, 0xB6 },
+    { CC1101_FSCAL3, 0xE9, 0xEA },
+};
+
+void set_fast_modem(bool fast) {
+    rf_lock();
+    rf.cmdStrobe(CC1101_SIDLE);
+    for (uint8_t i=0; i<sizeof(modem_regs)/sizeof(modem_regs[0]); i++) {
+        rf.writeReg(modem_regs[i][0], modem_regs[i][fast ? 2 : 1]);
+    }
+    rf.cmdStrobe(CC1101_SFRX);
+    rf.cmdStrobe(CC1101_SRX);
+    rf_unlock();
+}
+
+// The CC1101 FEC (rfboot RFB_OPT2_FEC). It needs fixed length packets,
+// so every packet is "fec_len" bytes (with the length byte) and the rest
+// after the real length is zeros. The same as CC1101_FECVAL_* in
+// rfboot/cc1101/cc1101.h. 0 is the default variable length packets
+uint8_t fec_len;
+uint8_t default_pktlen;
+
+void set_fec(uint8_t len) {
+    rf_lock();
+    rf.cmdStrobe(CC1101_SIDLE);
+    if (fec_len==0) default_pktlen = rf.readConfigReg(CC1101_PKTLEN);
+    fec_len = len;
+    rf.writeReg(CC1101_MDMCFG1, len ? 0xA2 : 0x22);
+    rf.writeReg(CC1101_PKTCTRL0, len ? 0x04 : 0x05);
+    rf.writeReg(CC1101_PKTLEN, len ? len : default_pktlen);
+    rf.cmdStrobe(CC1101_SFRX);
+    rf.cmdStrobe(CC1101_SRX);
+    rf_unlock();
+}
+
+// STX checks the channel (CCA) only in RX. After a packet we sent the
+// CC1101 is in RX already (TXOFF_MODE), after one we received the
+// interrupt took it through IDLE and it calibrates (~800us), so we wait
+// for RX. No SRX strobe and no fixed delay : the CCA mode is "unless
+// receiving a packet", which does not need a settled RSSI
+void rx_wait(void) {
+    byte state;
+    while ( (state = rf.readStatusReg(CC1101_MARCSTATE) & 0x1F) != 0x0D ) {
+        if (state==0x11) rf.cmdStrobe(CC1101_SFRX); // RX_OVERFLOW
+        if ( (state==0x11) or (state==0x01) ) rf.cmdStrobe(CC1101_SRX);
+    }
+}
+
+// rf.sendPacket needs the whole packet in the TX FIFO (61 bytes).
+// Here we refill the FIFO while the packet is on the air, so a packet
+// can contain a whole SPM page. The same steps as sendPacket otherwise.
+// The length byte is "len", and "size" bytes of data follow (more with
+// the FEC padding)
+bool send_long_packet(byte* data, byte len, byte size) {
+    const byte FIFO_SIZE = 64;
+    rf_lock();
+    rx_wait();
+
+    rf.writeReg(CC1101_TXFIFO, len);
+    byte sent = min(size, FIFO_SIZE-1);
+    rf.writeBurstReg(CC1101_TXFIFO, data, sent);
+    rf.cmdStrobe(CC1101_STX);
+    byte state = rf.readStatusReg(CC1101_MARCSTATE) & 0x1F;
+    if ( (state!=0x13) and (state!=0x14) and (state!=0x15) ) {
+        // the channel is not clear
+        rf.cmdStrobe(CC1101_SIDLE);
+        rf.cmdStrobe(CC1101_SFTX);
+        rf.cmdStrobe(CC1101_SRX);
+        rf_unlock();
+        return false;
+    }
+    while (sent<size) {
+        byte txbytes = rf.readStatusReg(CC1101_TXBYTES);
+        if (txbytes & 0x80) break; // underflow
+        if (txbytes >= FIFO_SIZE-1) continue;
+        byte n = min(size-sent, FIFO_SIZE-1-txbytes);
+        rf.writeBurstReg(CC1101_TXFIFO, data+sent, n);
+        sent += n;
+    }
+    // We wait until the CC1101 leaves TX (or underflows)
+    do {
+        state = rf.readStatusReg(CC1101_MARCSTATE) & 0x1F;
+    } while ( (state==0x13) or (state==0x14) or (state==0x15) );
+    bool ok = (rf.readStatusReg(CC1101_TXBYTES) & 0x7F) == 0;
+    rf.cmdStrobe(CC1101_SIDLE);
+    rf.cmdStrobe(CC1101_SFTX);
+    rf.cmdStrobe(CC1101_SRX);
+    // The end of the packet comes as an interrupt too, with
+    // nothing in the RX FIFO
+    rf_unlock();
+    return ok;
+}
+
+// Starts a packet and returns while it is on the air, the interrupt at
+// its end takes the CC1101 back to RX. The data goes straight from "data"
+// to the TX FIFO, and "size" bytes follow the length byte, zeros after
+// "len" (the FEC padding). Returns false if the channel is not clear.
+// rf_lock waits for the end of the last packet first. The next packet is
+// not loaded into the TX FIFO while one is on the air : the page packets
+// of send_long_packet need the whole FIFO, and bytes left in it after a
+// packet look like an underflow
+bool tx_start(const byte* data, byte len, byte size) {
+    rf_lock();
+    rx_wait();
+
+    rf.writeReg(CC1101_TXFIFO, len);
+    rf.writeBurstReg(CC1101_TXFIFO, (byte*)data, len);
+    for (byte i=len; i<size; i++) rf.writeReg(CC1101_TXFIFO, 0);
+    rf.cmdStrobe(CC1101_STX);
+    byte state = rf.readStatusReg(CC1101_MARCSTATE) & 0x1F;
+    if ( (state!=0x13) and (state!=0x14) and (state!=0x15) ) {
+        // the channel is not clear
+        rf.cmdStrobe(CC1101_SIDLE);
+        rf.cmdStrobe(CC1101_SFTX);
+        rf.cmdStrobe(CC1101_SRX);
+        rf_unlock();
+        return false;
+    }
+    tx_pending = true;
+    rf_unlock();
+    return true;
+}
+
+// Does not wait for the packet, the next rf_lock does. With the FEC
+// fixed length packets
+bool send_packet(byte* data, byte len) {
+    return tx_start(data, len, fec_len ? fec_len-1 : len);
+}
+
+// The packets we received. The interrupt writes only rx_head and
+// get_packet only rx_tail, so they need no lock. A packet has up to 61
+// bytes (with the FEC padding), and then the RSSI and LQI of the CC1101
+#define RX_QUEUE 4
+struct rx_packet {
+    byte len;
+    bool crc_ok;
+    byte data[61+2];
+};
+rx_packet rx_queue[RX_QUEUE];
+volatile uint8_t rx_head;
+volatile uint8_t rx_tail;
+// The packets we lost, as the queue was full or the RX FIFO overflowed.
+// Reported with the 'S' command
+volatile uint16_t rx_dropped;
+// The RSSI and LQI of the last packet get_packet returned
+byte rx_rssi;
+byte rx_lqi;
+
+#define rx_ready() (rx_head!=rx_tail)
+
+// The GDO0 interrupt : the end of a packet. The packet goes from the
+// FIFO to rx_queue, so the main loop can be busy for a while (the serial
+// port, the debug port) and we do not lose the next one. Other interrupts
+// may come while we read the FIFO, or we lose serial bytes at high
+// baud rates. A packet we sent ends here too, see tx_start
+void cc1101signalsInterrupt(void) {
+    EIMSK &= ~_BV(INT0);
+    sei();
+    bool on_air = false;
+    if (tx_pending) {
+        // The edge can be of a packet we received just before tx_start
+        byte state = rf.readStatusReg(CC1101_MARCSTATE) & 0x1F;
+        on_air = (state==0x13) or (state==0x14) or (state==0x15);
+        if (!on_air) {
+            rf.cmdStrobe(CC1101_SIDLE);
+            rf.cmdStrobe(CC1101_SFTX);
+            rf.cmdStrobe(CC1101_SRX);
+        }
+    }
+    byte bytes = on_air ? 0 : rf.readStatusReg(CC1101_RXBYTES);
+    if (bytes & 0x7F) {
+        byte next = (rx_head+1)%RX_QUEUE;
+        if ( (bytes & 0x80) or (next==rx_tail) ) {
+            rx_dropped++;
+        }
+        else {
+            rx_packet* p = &rx_queue[rx_head];
+            byte len;
+            rf.readBurstReg(&len, CC1101_RXFIFO, 1);
+            // the data, with the FEC padding
+            byte size = fec_len ? fec_len-1 : len;
+            if ( (len>0) and (len<=size) and (size<=61) and ((bytes & 0x7F)>=size+3) ) {
+                rf.readBurstReg(p->data, CC1101_RXFIFO, size+2);
+                p->len = len;
+                p->crc_ok = p->data[size+1] & 0x80;
+                // get_packet needs them after the data
+                p->data[len] = p->data[size];
+                p->data[len+1] = p->data[size+1] & 0x7F;
+                rx_head = next;
+            }
+        }
+        rf.cmdStrobe(CC1101_SIDLE);
+        rf.cmdStrobe(CC1101_SFRX);
+        rf.cmdStrobe(CC1101_SRX);
+    }
+    cli();
+    if (!on_air) tx_pending = false;
+    rf_unlock();
+}
+
+// As rf.getPacket, from rx_queue. Only after rx_ready()
+byte get_packet(byte* data) {
+    rx_packet* p = &rx_queue[rx_tail];
+    byte len = p->len;
+    memcpy(data, p->data, len);
+    rf.crc_ok = p->crc_ok;
+    rx_rssi = p->data[len];
+    rx_lqi = p->data[len+1];
+    rx_tail = (rx_tail+1)%RX_QUEUE;
+    return len;
+}
+
 void drain_serial() {
     while ( Serial.read()!=-1 ) {};
 }
 
+// The framed link (version 9, the 'B' command). Instead of 38400 baud,
+// "COMMD" and 2ms of silence after every packet, rftool sends SLIP frames :
+// the type, the data and the CRC16 (avr-libc _crc16_update, low byte first)
+// of both. 'T' is a packet for the radio and 'C' a command. The packets we
+// receive go to rftool as 'R' frames. The upload modes keep their own
+// protocol, and the replies of the commands are not framed. Frames with a
+// bad CRC are dropped, rftool sends them again after its timeout
+#include <util/crc16.h>
+#define SLIP_END 0xC0
+#define SLIP_ESC 0xDB
+#define SLIP_ESC_END 0xDC
+#define SLIP_ESC_ESC 0xDD
+bool framed = false;
+uint16_t frame_errors;
+
+void slip_write(byte c) {
+    if (c==SLIP_END) {
+        Serial.write(SLIP_ESC);
+        c = SLIP_ESC_END;
+    }
+    else if (c==SLIP_ESC) {
+        Serial.write(SLIP_ESC);
+        c = SLIP_ESC_ESC;
+    }
+    Serial.write(c);
+}
+
+// A packet from the radio to rftool
+void forward_packet(const byte* data, byte len) {
+    if (not framed) {
+        Serial.write(data, len);
+        return;
+    }
+    uint16_t crc = _crc16_update(0, 'R');
+    Serial.write(SLIP_END);
+    slip_write('R');
+    for (byte i=0; i<len; i++) {
+        slip_write(data[i]);
+        crc = _crc16_update(crc, data[i]);
+    }
+    slip_write(crc & 0xff);
+    slip_write(crc >> 8);
+    Serial.write(SLIP_END);
+}
+
+// The packets rftool sends ahead in upload mode. The radio takes the next
+// one from here and does not wait for the USB round trip
+#define UPLOAD_RING 16
+// Every USB_SEND_PACKET is a credit for one packet. We send only when the
+// radio is free, but tx_start still waits ~800us for the calibration
+// (rx_wait), and send_long_packet until the end of the packet. So
+// the serial RX buffer must hold the packets of all the credits we gave,
+// the Makefile makes it 128 bytes. page_upload packets have the idx too.
+// 3 credits in both modes with 128 bytes. This is arithmetic only, the
+// credits were not measured on hardware (serial overruns, upload time)
+#ifndef SERIAL_RX_BUFFER_SIZE
+#define SERIAL_RX_BUFFER_SIZE 64
+#endif
+#define UPLOAD_CREDITS ((SERIAL_RX_BUFFER_SIZE-1)/PAYLOAD)
+#define PAGE_CREDITS ((SERIAL_RX_BUFFER_SIZE-1)/(PAYLOAD+3))
+#if PAGE_CREDITS < 2
+#warning "The serial RX buffer holds one packet, the uploads wait for the USB after every packet"
+#endif
+
 void upload(uint16_t app_idx) {
     // Upload mode
     // Offloads some of the work rftool does
@@ -74,11 +384,18 @@ void upload(uint16_t app_idx) {
     //const byte USB_INFO_ABORT = 21;
     uint32_t timer = millis();
 
-    byte outpacket[64];
+    // The packets from app_idx down. ring[tail] is the packet rfboot
+    // asked for, and stays until rfboot asks for the next one
+    byte ring[UPLOAD_RING][PAYLOAD];
+    uint8_t tail = 0;
+    uint8_t count = 0;
+    // The bytes we have of the packet after the last in the ring
+    uint8_t fill = 0;
+    // The packets rftool owes us, and the packets we did not ask for yet
+    uint8_t credits = 0;
+    uint16_t unrequested = (app_idx+PAYLOAD-1)/PAYLOAD;
     bool rfboot_waiting = true;
-    bool outpacket_ready = false;
-    Serial.write(USB_SEND_PACKET); // want 1 packets
-    while (1) { // and (millis()-timer<1000) TODO
+    while (1) {
 
         if (millis()-timer>100) {
             if (debug) debug_port.print(F("upload: Timeout"));
@@ -86,32 +403,38 @@ void upload(uint16_t app_idx) {
             return;
         }
 
-        if ( (not outpacket_ready) and (Serial.available()>=PAYLOAD) ) {
-            outpacket_ready = true;
-            Serial.readBytes((char*)outpacket, PAYLOAD);
-            if (app_idx>PAYLOAD) Serial.write(USB_SEND_PACKET); // TODO
-            if (debug) {
-                debug_port.print(F("Savail="));
-                debug_port.println(Serial.available());
+        while ( (credits<UPLOAD_CREDITS) and (unrequested>0) and (count+credits<UPLOAD_RING) ) {
+            Serial.write(USB_SEND_PACKET);
+            credits++;
+            unrequested--;
+        }
+
+        // rftool sends the packets in the order we asked for them
+        while ( (credits>0) and Serial.available() ) {
+            ring[(tail+count)%UPLOAD_RING][fill++] = Serial.read();
+            if (fill==PAYLOAD) {
+                fill = 0;
+                count++;
+                credits--;
             }
         }
 
-        if (rfboot_waiting and outpacket_ready) {
-            rf.sendPacket(outpacket,PAYLOAD);
-            // outpacket is not market as ready yet
-            // it will when rfboot asks for next packet
+        if (rfboot_waiting and count>0 and !tx_pending) {
+            send_packet(ring[tail],PAYLOAD);
+            // the packet stays in the ring
+            // until rfboot asks for the next one
             rfboot_waiting=false;
             if (debug) {
                 debug_port.print(F("pkt out : idx="));
-                debug_port.println(app_idx);
-                //if (sending_header) debug_port.println(F("This was the header"));
+                debug_port.print(app_idx);
+                debug_port.print(F(" ring="));
+                debug_port.println(count);
             }
         }
 
-        if (rf.interrupt) {
+        if (rx_ready()) {
             byte inpacket[64];
-            byte pkt_size = rf.getPacket(inpacket);
-            rf.interrupt = false;
+            byte pkt_size = get_packet(inpacket);
             if (pkt_size==3 and rf.crc_ok) {
                 timer = millis(); // reset the timer
                 // we just got a 3 byte packet from rfboot
@@ -120,20 +443,24 @@ void upload(uint16_t app_idx) {
                 if (cmd==RFB_SEND_PKT) {
                     uint16_t i=inpacket[1]+inpacket[2]*256;
                     if (i==app_idx) {
-                        // rfboot needs the same packet
-                        rf.sendPacket(outpacket,PAYLOAD);
-                        rfboot_waiting = false;
-                        Serial.write(USB_INFO_RESEND); // inform the resent
-                        if (debug) {
-                            debug_port.println(F("Resend"));
+                        // rfboot needs the same packet. Not if it
+                        // is not here yet, we send it when it comes
+                        if (count>0) {
+                            // sent when the radio is free, see above
+                            rfboot_waiting = true;
+                            Serial.write(USB_INFO_RESEND); // inform the resent
+                            if (debug) {
+                                debug_port.println(F("Resend"));
+                            }
                         }
                     }
-                    else if (i==app_idx-PAYLOAD) { // next packet
+                    else if (i==app_idx-PAYLOAD and count>0) { // next packet
 
                         if (debug) debug_port.println(F("ok next pkt"));
                         rfboot_waiting = true;
                         app_idx = i;
-                        outpacket_ready = false;
+                        tail = (tail+1)%UPLOAD_RING;
+                        count--;
                     }
                     else {
                         if (debug) {
@@ -147,7 +474,7 @@ void upload(uint16_t app_idx) {
                         }
                         drain_serial();
                         Serial.write(USB_INFO_END);
-                        Serial.write(inpacket,3);
+                        forward_packet(inpacket,3);
                         return; // ABORT
                     }
                 }
@@ -156,7 +483,7 @@ void upload(uint16_t app_idx) {
                     drain_serial();
                     // Uncknown cmd
                     Serial.write(USB_INFO_END);
-                    Serial.write(inpacket,3);
+                    forward_packet(inpacket,3);
 
                     return; // ABORT
                 }
@@ -175,6 +502,266 @@ void upload(uint16_t app_idx) {
     }
 }
 
+// The idx of a ring slot of page_upload
+uint32_t slot_get_idx(const byte* slot) {
+    return slot[0] + ((uint16_t)slot[1]<<8) + ((uint32_t)slot[2]<<16);
+}
+
+void page_upload(uint32_t app_idx, uint16_t mask, uint8_t units, bool parity, bool far) {
+    // Window upload mode
+    // rfboot requests a whole SPM page (RFB_SEND_PAGE) and
+    // usb2rf sends all the missing packets of the page back to back.
+    // rftool sends every packet prefixed with its idx (2 bytes) and so does usb2rf,
+    // as rfboot can get them in any order, when some of them are retransmitted.
+    // The mask has one bit per 16 byte unit, and we send the missing units
+    // in packets of "units" units at most. So the packets on the air
+    // are not the same as the packets we get from rftool.
+    // With delta upload rfboot skips the pages not changed, and
+    // rftool does not send them to us either.
+    // With "parity" (RFB_OPT2_PARITY) a parity packet follows the packets,
+    // if we send more than one. It is the XOR of the 32 byte packets of
+    // the page and rfboot rebuilds one lost packet with it.
+    // With "far" (RFB_OPT2_FAR) the SPM pages have 256 bytes, the masks 16 bits
+    // and rftool sends the idx with 3 bytes. On the air the packets still
+    // start with the low 16 bits of idx.
+    const uint8_t RFB_SEND_PAGE = 7;
+    const byte USB_SEND_PACKET = 20;
+    const byte USB_INFO_RESEND = 21;
+    const byte USB_INFO_END = 22;
+    const uint16_t page_size = far ? FAR_PAGESIZE : SPM_PAGESIZE;
+    const byte PKTS = page_size/PAYLOAD;
+    const byte idx_len = far ? 3 : 2;
+    uint32_t timer = millis();
+
+    // Room for 2 SPM pages. The packets of the next page
+    // are fetched from rftool while the current is on the air.
+    // The slots are used in the order the packets arrive.
+    // Every slot has the idx (3 bytes) and the packet
+    byte ring[2*FAR_PAGESIZE/PAYLOAD][PAYLOAD+3];
+    memset(ring, 0, sizeof(ring));
+    // The slot of the next packet from rftool, the bytes of it we have,
+    // and the packets rftool owes us (see PAGE_CREDITS). They go to the
+    // slots after fetch_slot
+    uint8_t fetch_slot = 0;
+    uint8_t fill = 0;
+    uint8_t credits = 0;
+    // The idx of the last packet rftool sent us. The packet ending at PAYLOAD
+    // is always the last one.
+    uint32_t fetch_idx = 0xffffffff;
+    // The page rfboot requested (where it ends) and its missing packets
+    uint32_t page_idx = app_idx;
+    bool rfboot_waiting = true;
+    // The page on the air : the unit we send next (spm_page when all are
+    // sent), the packets we sent and if the parity packet is due
+    uint32_t send_idx = 0;
+    uint8_t sent = 0;
+    bool sending = false;
+
+    while (1) {
+        uint32_t spm_page = (page_idx-1)/page_size*page_size;
+
+        if (millis()-timer>100) {
+            if (debug) debug_port.print(F("page_upload: Timeout"));
+            Serial.write(USB_INFO_END);
+            return;
+        }
+
+        // We keep 2 pages at most. The slots of the page
+        // rfboot is waiting for, are not overwritten. After the last
+        // packet, rftool ignores the credits we gave
+        while ( (credits<PAGE_CREDITS) and (credits<2*PKTS) and (fetch_idx>PAYLOAD) ) {
+            uint32_t slot_idx = slot_get_idx(ring[(fetch_slot+credits)%(2*PKTS)]);
+            if ( (slot_idx>spm_page) and (slot_idx<=spm_page+page_size) ) break;
+            Serial.write(USB_SEND_PACKET);
+            credits++;
+        }
+
+        // rftool sends the packets in the order we asked for them.
+        // The packet is always at slot+3
+        while ( (credits>0) and Serial.available() ) {
+            byte* slot = ring[fetch_slot];
+            byte b = Serial.read();
+            if (fill<idx_len) slot[fill] = b;
+            else slot[3+fill-idx_len] = b;
+            fill++;
+            if (fill==PAYLOAD+idx_len) {
+                if (!far) slot[2] = 0;
+                fetch_idx = slot_get_idx(slot);
+                fetch_slot = (fetch_slot+1)%(2*PKTS);
+                fill = 0;
+                credits--;
+            }
+        }
+
+        // all packets of the page are here, we send them
+        // from the last unit to the first (the CBC chain order)
+        if (rfboot_waiting and (fetch_idx<=spm_page+PAYLOAD) ) {
+            send_idx = page_idx;
+            sent = 0;
+            sending = true;
+            rfboot_waiting=false;
+            if (debug) {
+                debug_port.print(F("page out : idx="));
+                debug_port.print(page_idx);
+                debug_port.print(F(" mask="));
+                debug_port.print(mask,BIN);
+                debug_port.print(F(" units="));
+                debug_port.println(units);
+            }
+        }
+
+        // One packet at a time, when the radio is free. So we keep reading
+        // the serial port while a packet is on the air
+        if (sending and !tx_pending) {
+            // consecutive missing units go to the same packet
+            uint8_t n=0;
+            while (send_idx>spm_page) {
+                while ( (n<units) and (send_idx-n*UNIT>spm_page) and
+                (mask & (1u<<((send_idx-n*UNIT-1)%page_size/UNIT))) ) n++;
+                if (n) break;
+                send_idx-=UNIT;
+            }
+            if (n) {
+                byte outpacket[2+PAGE_UNITS*UNIT];
+                outpacket[0] = send_idx & 0xff;
+                outpacket[1] = send_idx >> 8;
+                for (byte k=0; k<n; k++) {
+                    // the unit ending at "unit_idx", is in the rftool packet ending at "pkt_idx"
+                    uint32_t unit_idx = send_idx-(n-1-k)*UNIT;
+                    uint32_t pkt_idx = (unit_idx+PAYLOAD-1)/PAYLOAD*PAYLOAD;
+                    for (byte j=0; j<2*PKTS; j++) {
+                        if ( slot_get_idx(ring[j]) == pkt_idx ) {
+                            memcpy(outpacket+2+k*UNIT, ring[j]+3+PAYLOAD-UNIT-(pkt_idx-unit_idx), UNIT);
+                            break;
+                        }
+                    }
+                }
+                if (n>LONG_PKT_UNITS) send_long_packet(outpacket,2+n*UNIT,2+n*UNIT);
+                else send_packet(outpacket,2+n*UNIT);
+                send_idx-=n*UNIT;
+                sent++;
+            }
+            else {
+                if (parity and sent>1) {
+                    byte outpacket[2+PAYLOAD];
+                    memset(outpacket, 0, sizeof(outpacket));
+                    outpacket[0] = (spm_page+1) & 0xff;
+                    outpacket[1] = (spm_page+1) >> 8;
+                    for (byte j=0; j<2*PKTS; j++) {
+                        uint32_t pkt_idx = slot_get_idx(ring[j]);
+                        if ( (pkt_idx>spm_page) and (pkt_idx<=spm_page+page_size) ) {
+                            for (byte k=0; k<PAYLOAD; k++) outpacket[2+k] ^= ring[j][3+k];
+                        }
+                    }
+                    send_packet(outpacket, sizeof(outpacket));
+                }
+                sending = false;
+            }
+        }
+
+        if (rx_ready()) {
+            byte inpacket[64];
+            byte pkt_size = get_packet(inpacket);
+            if (pkt_size>=3 and rf.crc_ok) {
+                timer = millis(); // reset the timer
+                byte cmd = inpacket[0];
+                uint32_t i=(uint16_t)(inpacket[1]+inpacket[2]*256);
+                // RFB_OPT2_FAR : the high byte of the mask, and bits 16-23 of idx
+                if (far and pkt_size==7) i += (uint32_t)inpacket[6]<<16;
+
+                if (cmd==RFB_SEND_PAGE and pkt_size==(far ? 7 : 5)) {
+                    if (i==page_idx) {
+                        // rfboot needs some packets again
+                        Serial.write(USB_INFO_RESEND);
+                        if (debug) debug_port.println(F("Resend"));
+                    }
+                    else if (i<=spm_page and i>0) {
+                        // The next page (or a lower one with delta upload)
+                        if (debug) debug_port.println(F("ok next page"));
+                        page_idx = i;
+                    }
+                    else {
+                        if (debug) {
+                            debug_port.print(__LINE__);
+                            debug_port.print(F(": Protocol error. page idx="));
+                            debug_port.println(i);
+                        }
+                        drain_serial();
+                        Serial.write(USB_INFO_END);
+                        forward_packet(inpacket,pkt_size);
+                        return; // ABORT
+                    }
+                    mask = inpacket[3];
+                    if (far) mask |= inpacket[5]<<8;
+                    // Up to a whole page, see send_long_packet
+                    units = min(inpacket[4],PAGE_UNITS);
+                    rfboot_waiting = true;
+                    sending = false;
+                }
+                else {
+                    drain_serial();
+                    // Uncknown cmd
+                    Serial.write(USB_INFO_END);
+                    forward_packet(inpacket,pkt_size);
+                    return; // ABORT
+                }
+            }
+            else {
+                if (debug) debug_port.print("Got unknown pkt");
+            }
+        }
+    }
+}
+
+void group_upload() {
+    // Multicast upload (rfboot RFB_OPT_GROUP)
+    // rftool decides what to send, as it gets the NACKs of all nodes.
+    // Every packet from rftool is its length and the packet, and we ask
+    // for the next one when it is on the air. The packets we get (NACKs
+    // and the final replies) go to rftool with their length.
+    // A zero length ends the upload.
+    const byte USB_SEND_PACKET = 20;
+    const byte USB_INFO_END = 22;
+    const byte USB_GROUP_REPLY = 23;
+    uint32_t timer = millis();
+    Serial.write(USB_SEND_PACKET);
+    while (1) {
+        if (millis()-timer>1000) {
+            if (debug) debug_port.print(F("group_upload: Timeout"));
+            Serial.write(USB_INFO_END);
+            return;
+        }
+
+        if (Serial.available()) {
+            byte len = Serial.read();
+            if (len==0 or len>2+PAGE_UNITS*UNIT) {
+                drain_serial();
+                Serial.write(USB_INFO_END);
+                return;
+            }
+            byte outpacket[2+PAGE_UNITS*UNIT];
+            if (Serial.readBytes((char*)outpacket, len) != len) {
+                Serial.write(USB_INFO_END);
+                return;
+            }
+            if (len>2+LONG_PKT_UNITS*UNIT) send_long_packet(outpacket,len,len);
+            else send_packet(outpacket,len);
+            Serial.write(USB_SEND_PACKET);
+            timer = millis();
+        }
+
+        if (rx_ready()) {
+            byte inpacket[64];
+            byte pkt_size = get_packet(inpacket);
+            if (pkt_size>=3 and rf.crc_ok) {
+                Serial.write(USB_GROUP_REPLY);
+                Serial.write(pkt_size);
+                Serial.write(inpacket,pkt_size);
+            }
+        }
+    }
+}
+
 void execCmd(uint8_t* cmd , uint8_t cmd_len ) {
 
     switch (cmd[0]) {
@@ -183,7 +770,10 @@ void execCmd(uint8_t* cmd , uint8_t cmd_len ) {
             if (cmd_len==1) {
                 if (debug) {
                     debug_port.print(F("CC1101 register = "));
-                    debug_port.println(rf.readConfigReg(CC1101_MDMCFG2),HEX);
+                    rf_lock();
+                    byte reg = rf.readConfigReg(CC1101_MDMCFG2);
+                    rf_unlock();
+                    debug_port.println(reg,HEX);
                 }
             }
             else {
@@ -196,7 +786,9 @@ void execCmd(uint8_t* cmd , uint8_t cmd_len ) {
 
         case 'A':
             if (cmd_len==3) {
+                rf_lock();
                 rf.setSyncWord(cmd[1],cmd[2]);
+                rf_unlock();
                 if (debug) {
                     debug_port.print(F("Syncword = "));
                     debug_port.print(cmd[1]) ;
@@ -224,7 +816,9 @@ void execCmd(uint8_t* cmd , uint8_t cmd_len ) {
                     uint8_t channel = cmd[1];
 
                     {
+                        rf_lock();
                         rf.setChannel(channel);
+                        rf_unlock();
                         if (debug) {
                             debug_port.print(F("channel="));
                             debug_port.println(channel);
@@ -262,6 +856,7 @@ void execCmd(uint8_t* cmd , uint8_t cmd_len ) {
                     if (debug) {
                         debug_port.println(F("USB to RF Reset"));
                     }
+                    rf_lock();
                     rf.setSyncWord(0,0);
 
                     digitalWriteFast(RESET_TRIGGER_PIN,LOW);
@@ -293,6 +888,122 @@ void execCmd(uint8_t* cmd , uint8_t cmd_len ) {
 
             break;
 
+        case 'M': // Default (0) or fast (1) modem settings
+            if (cmd_len==2) {
+                set_fast_modem(cmd[1]);
+                if (debug) {
+                    debug_port.print(F("Fast modem = "));
+                    debug_port.println(cmd[1]);
+                }
+            }
+            else {
+                if (debug) {
+                    debug_port.print(F("Modem command, bad length : "));
+                    debug_port.println(cmd_len);
+                }
+            }
+            break;
+
+        case 'F': // The FEC packets of "len" bytes (rfboot RFB_OPT2_FEC), 0 is off
+            if (cmd_len==2) {
+                set_fec(cmd[1]);
+                if (debug) {
+                    debug_port.print(F("FEC packet length = "));
+                    debug_port.println(cmd[1]);
+                }
+            }
+            else {
+                if (debug) {
+                    debug_port.print(F("FEC command, bad length : "));
+                    debug_port.println(cmd_len);
+                }
+            }
+            break;
+
+        case 'P':
+            if (cmd_len==5 or cmd_len==6 or cmd_len==8) {
+                if (debug) {
+                    debug_port.println(F("Switch to page upload mode"));
+                }
+                // The first RFB_SEND_PAGE request of rfboot is
+                // received by rftool, and passed to us with this command.
+                // Version 7 and later : an optional byte, 1 for the parity packets
+                // Version 8 and later : RFB_OPT2_FAR, the high byte of the mask
+                // and bits 16-23 of idx follow
+                bool far = (cmd_len==8);
+                uint32_t app_idx=(uint16_t)(cmd[1]+cmd[2]*256);
+                uint16_t mask=cmd[3];
+                if (far) {
+                    mask |= cmd[6]<<8;
+                    app_idx += (uint32_t)cmd[7]<<16;
+                }
+                page_upload(app_idx, mask, min(cmd[4],PAGE_UNITS), cmd_len>=6 and cmd[5], far);
+            }
+            else {
+                if (debug) {
+                    debug_port.print(F("Page upload command, bad length : "));
+                    debug_port.println(cmd_len);
+                }
+            }
+            break;
+
+        case 'G':
+            if (cmd_len==1) {
+                if (debug) {
+                    debug_port.println(F("Switch to group upload mode"));
+                }
+                group_upload();
+            }
+            else {
+                if (debug) {
+                    debug_port.print(F("Group upload command, bad length : "));
+                    debug_port.println(cmd_len);
+                }
+            }
+            break;
+
+        case 'V':
+            if (cmd_len==1) {
+                Serial.write('V');
+                Serial.write(USB2RF_VERSION);
+            }
+            break;
+
+        case 'S': // The packets we lost (version 10). The reply goes as a received packet
+            if (cmd_len==1) {
+                byte reply[5];
+                cli();
+                uint16_t dropped = rx_dropped;
+                sei();
+                reply[0] = 'S';
+                reply[1] = dropped & 0xff;
+                reply[2] = dropped >> 8;
+                reply[3] = frame_errors & 0xff;
+                reply[4] = frame_errors >> 8;
+                forward_packet(reply, 5);
+            }
+            break;
+
+        case 'B': // The framed link, at cmd[1..2] hundreds of baud
+            if (cmd_len==3) {
+                // The reply is at the old baud rate
+                Serial.write(cmd, 3);
+                Serial.flush();
+                Serial.begin((cmd[1]+cmd[2]*256)*100UL);
+                framed = true;
+                if (debug) {
+                    debug_port.print(F("Framed link at baud/100 = "));
+                    debug_port.println(cmd[1]+cmd[2]*256);
+                }
+            }
+            else {
+                if (debug) {
+                    debug_port.print(F("Baud command, bad length : "));
+                    debug_port.println(cmd_len);
+                }
+            }
+            break;
+
         case 'W':
             // send wake up 1 sec pulse
             if (cmd_len==2) {
@@ -300,7 +1011,9 @@ void execCmd(uint8_t* cmd , uint8_t cmd_len ) {
                     debug_port.println(F("Sending WakeUp burst 1050ms"));
                 }
                 const byte w=cmd[1];
+                rf_lock();
                 rf.sendBurstPacket(&w,1,1050);
+                rf_unlock();
                 if (debug) {
                     debug_port.println(F("Done"));
                 }
@@ -313,6 +1026,7 @@ void execCmd(uint8_t* cmd , uint8_t cmd_len ) {
                     debug_port.println(F("Software reset"));
                     debug_port.flush();
                 }
+                rf_lock();
                 rf.setSyncWord(0,0);
                 resetFunc();
             }
@@ -350,9 +1064,9 @@ int main() {
     //rf.setCarrierFreq(CFREQ_433);
     rf.disableAddressCheck();
     rf.setSyncWord(57,232);
-    attachInterrupt(0, cc1101signalsInterrupt, FALLING);
+    rf.writeReg(CC1101_MDMCFG2, CC1101_DEFVAL_MDMCFG2);
 
-    rf.writeReg(CC1101_MDMCFG2, 0x97);
+    attachInterrupt(0, cc1101signalsInterrupt, FALLING);
 
     //if (debug)
     //delay(8);
@@ -368,6 +1082,12 @@ int main() {
     //bool last_debug = not debug;
     bool last_debug = false;
     uint8_t packet[64];
+    // The SLIP frame we receive with the framed link : the type, up to 61
+    // bytes for the radio and the CRC
+    uint8_t frame[64];
+    uint8_t frame_len = 0;
+    bool frame_esc = false;
+    bool frame_bad = false;
 
     while (1) {
         if (debug != last_debug) {
@@ -376,7 +1096,54 @@ int main() {
             if (debug) debug_port.println(F("enabled"));
             else debug_port.println(F("disabled"));
         }
-        if (cmdmode) {
+        if (framed) {
+            if (Serial.available()) {
+                uint8_t c = Serial.read();
+                if (c==SLIP_END) {
+                    uint16_t crc = 0;
+                    for (uint8_t i=0; i+2<frame_len; i++) crc = _crc16_update(crc, frame[i]);
+                    if (frame_len==0) {
+                        // Between two frames
+                    }
+                    else if (frame_bad or frame_len<3 or crc!=(frame[frame_len-2] | frame[frame_len-1]<<8)) {
+                        frame_errors++;
+                        if (debug) {
+                            debug_port.print(F("Bad frame, errors="));
+                            debug_port.println(frame_errors);
+                        }
+                    }
+                    else if (frame[0]=='T') {
+                        bool succ = send_packet(frame+1, frame_len-3);
+                        if (debug) {
+                            debug_port.write("out ");
+                            debug_port.print(frame_len-3);
+                            if (succ) debug_port.write("\r\n");
+                            else debug_port.write(" F\r\n");
+                        }
+                    }
+                    else if (frame[0]=='C') {
+                        execCmd(frame+1, frame_len-3);
+                    }
+                    else if (debug) {
+                        debug_port.print(F("Unknown frame "));
+                        debug_port.println(frame[0]);
+                    }
+                    frame_len = 0;
+                    frame_esc = false;
+                    frame_bad = false;
+                }
+                else if (c==SLIP_ESC) {
+                    frame_esc = true;
+                }
+                else {
+                    if (frame_esc) c = (c==SLIP_ESC_END) ? SLIP_END : SLIP_ESC;
+                    frame_esc = false;
+                    if (frame_len<sizeof(frame)) frame[frame_len++] = c;
+                    else frame_bad = true;
+                }
+            }
+        }
+        else if (cmdmode) {
             if (Serial.available()) {
 
                 uint8_t msg = Serial.read();
@@ -409,7 +1176,7 @@ int main() {
 
                     if (debug) debug_port.write("out 32");
 
-                    bool succ = rf.sendPacket(packet,32);
+                    bool succ = send_packet(packet,32);
 
                     if ( debug ) {
                         if (succ)  debug_port.write("\r\n");
@@ -444,7 +1211,7 @@ int main() {
 
                     bool succ;
 
-                    succ = rf.sendPacket(packet,idx);
+                    succ = send_packet(packet,idx);
 
                     if ( debug ) {
                         if (succ)  debug_port.write("\r\n");
@@ -456,9 +1223,10 @@ int main() {
             }
         }
 
-        if (rf.interrupt) {
-            byte pkt_size = rf.getPacket(packet);
-            rf.interrupt = false;
+        if (rx_ready()) {
+            // Not in "packet", it may have the start of a packet from rftool
+            byte inpacket[64];
+            byte pkt_size = get_packet(inpacket);
 
             if (rf.crc_ok) {
                 if ( pkt_size > 0) {
@@ -479,12 +1247,16 @@ int main() {
                     else {
                         Serial.write(packet, pkt_size);
                     } */
-                    Serial.write(packet, pkt_size);
+                    forward_packet(inpacket, pkt_size);
 
                     if (debug) {
                         debug_port.write("in ");
                         //if (pkt_size != 3)
-                        debug_port.println(pkt_size);
+                        debug_port.print(pkt_size);
+                        debug_port.print(F(" RSSI="));
+                        debug_port.print(rx_rssi);
+                        debug_port.print(F(" LQI="));
+                        debug_port.println(rx_lqi);
                     }
                     //}
                 }